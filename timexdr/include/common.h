@@ -23,9 +23,44 @@ extern int errno;
 #endif
 
 #include <math.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <signal.h>
 
 #include <usb.h>
 
+/* Vector instructions for the HRM decoder; a scalar fallback is used
+ * without them */
+#if defined(__AVX2__)
+#  include <immintrin.h>
+#elif defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+/* libusb-1.0 is optional and only used for asynchronous transfers */
+#if defined(HAVE_LIBUSB_1_0) && defined(HAVE_LIBUSB_1_0_LIBUSB_H)
+#  define TDR_LIBUSB1 1
+#  include <libusb-1.0/libusb.h>
+#endif
+
+/* zlib and libzstd are optional and only used for compressed files */
+#if defined(HAVE_LIBZ) && defined(HAVE_ZLIB_H)
+#  define TDR_ZLIB 1
+#  include <zlib.h>
+#endif
+#if defined(HAVE_LIBZSTD) && defined(HAVE_ZSTD_H)
+#  define TDR_ZSTD 1
+#  include <zstd.h>
+#endif
+
 #endif /* !TDR_COMMON_H */
@@ -0,0 +1,488 @@
+/* 
+ * libtimexdr - Timex Data Recorder access and session decoding
+ *
+ * Copyright (C) 2005-2006 Jan Merka <merka@highsphere.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *      
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *      
+ */             
+
+#ifndef TDR_LIBTIMEXDR_H
+#define TDR_LIBTIMEXDR_H 1
+
+/* Public interface of libtimexdr: recorder access, the session decoder,
+ * which hands the decoded records to an output sink, and the session
+ * files. The downloads of the timexdr program are declared in tdrjob.h,
+ * which is not installed.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TIMEXDR_VENDOR_ID      0x0cc2
+#define TIMEXDR_PRODUCT_ID1    0xc700
+#define TIMEXDR_PRODUCT_ID2    0xc701
+#define IS_TIMEXDR(vendor, product)                                  \
+  (((vendor) == TIMEXDR_VENDOR_ID) &&                                \
+   (((product) == TIMEXDR_PRODUCT_ID1) || ((product) == TIMEXDR_PRODUCT_ID2)))
+
+#define EEPROM_PAGESIZE         256        /* in bytes */
+#define DATA_PAGESIZE  (EEPROM_PAGESIZE-1) /* in bytes */
+
+#define TIMEXDR_STRLEN         256
+
+#define SYNC_STATE_DIR        ".timexdr"   /* In the home directory */
+#define SYNC_FILE_EXT             "sync"
+
+#define TIMEXDR_FIRSTSESSION     0x180     /* Position of the first session */
+#define TIMEXDR_ATABLESIZE         384     /* Bytes in the access table  */
+#define TIMEXDR_HEADERSIZE           7     /* Bytes in a session header  */
+#define TDR_ASIZE                    3     /* Address size in bytes */
+#define TDR_MAX_SESSIONS  (TIMEXDR_ATABLESIZE/TDR_ASIZE - 1)
+
+#define TIME_STEP_HRM                2     /* in seconds */
+#define TIME_STEP_GPS                3.57  /* in seconds */
+
+/* Multi-device session ID (both HRM and GPS data */
+#define SESSION_MASK                0xf0
+#define MULTI_DEVICE_SESSION        0xff 
+#define HRM_SESSION                 0x00
+#define GPS_SESSION                 0x20   /* ID varies 0x20-0x2f */
+
+#define HRM_FILE_EXT                "hrm"
+#define GPS_FILE_EXT                "gps"
+
+#define TDR_ASYNC_TRANSFERS           16   /* Interrupt-IN transfers in flight */
+#define TDR_MAX_DEVICES               16   /* Recorders downloaded at once */
+#define TIME_STR_LENGTH               28   /* in bytes */
+#define TDR_MAX_WORKERS               64   /* Session decoding threads */
+#define TDR_WRITER_SIZE            65536   /* Text output buffer, in bytes */
+#define TDR_MAX_FIELDS                32   /* Fields of a csv/ndjson record */
+#define TDR_MAX_OUTPUTS                8   /* Targets of tdr_output_add() */
+#define TDR_ZBUF_SIZE              65536   /* Compressor buffers, in bytes */
+#define TDR_ZPIPE_SIZE           1048576   /* Pipe to a compressor, in bytes */
+
+/* Compression of the output files */
+#define TDR_COMPRESS_NONE              0
+#define TDR_COMPRESS_GZIP              1   /* *.gz */
+#define TDR_COMPRESS_ZSTD              2   /* *.zst */
+
+/* Packet error codes */
+#define MISSING_PACKET              0x00
+#define CORRUPTED_PACKET            0x04
+
+/* GPS packets and profiles */
+
+#define PACKET_TYPE_ERROR           0x12   /* Missing/corrupted packet */
+#define PACKET_TYPE_1               0x15   /* status, speed, distance */
+#define PACKET_TYPE_2               0x25   /* altitude and heading */
+#define PACKET_TYPE_3               0x37   /* position */
+#define PACKET_TYPE_4               0x45   /* time and date */
+#define PACKET_TYPE_5               0x59   /* status, speed, distance, */ 
+					   /* altitude and heading */
+#define PACKET_TYPE_15              0xf0   /* everything */
+#define PACKET_TYPE_15_LENGTH         17   /* in bytes */
+
+#define PACKET_LENGTH_MASK          0x0f
+#define GPS_PACKET_MIN_LENGTH          2   /* in bytes */
+
+/* SNSR Status */
+#define SNSR_GPS_OK                 0x00
+#define SNSR_GPS_SYSFAILURE         0x09
+#define SNSR_ROMRAM_FAILURE         0x0a
+#define SNSR_OSCIL_DRIFT_FAILURE    0x0b
+#define SNSR_GPS_NO_CARRIER         0x01   /* Ready to power down */
+#define SNSR_GPS_NO_MOTION          0x02   /* Ready to power down */   
+#define SNSR_LOW_BATTERY            0x03   /* Ready to power down */
+
+/* Data units */
+#define SPEED_UNIT                  0.1    /* mph */
+#define DIST_UNIT                   0.001  /* mile */
+#define ALT_UNIT                    1      /* foot */
+#define HEADING_UNIT                2      /* degrees */
+#define LL_UNIT                     M_PI/pow(2,23)     /* radian */
+#define LL_UNIT_DEG                 180/pow(2,23)      /* degrees */
+
+/* Fields of the GPS packets */
+#define GPS_STATUS                     0
+#define GPS_ACQ                        1
+#define GPS_BATTERY                    2
+#define GPS_SPEED                      3
+#define GPS_DIST                       4
+#define GPS_ALT                        5
+#define GPS_HTRUE                      6   /* True heading */
+#define GPS_HMAG                       7   /* Magnetic heading */
+#define GPS_LAT                        8
+#define GPS_LON                        9
+#define GPS_SEC                       10   /* in quarters of a second */
+#define GPS_YEAR                      11   /* 2001 based */
+#define GPS_MONTH                     12
+#define GPS_DAY                       13
+#define GPS_HOUR                      14
+#define GPS_MIN                       15
+#define GPS_TOKEN                     16   /* Packet error code */
+#define GPS_NFIELDS                   17
+
+/* How a GPS packet is printed */
+#define GPS_ROW_FIX                    0   /* One column per field */
+#define GPS_ROW_TIME                   1   /* GMT date and time */
+#define GPS_ROW_ERROR                  2   /* Missing/corrupted packet */
+
+#define GPS_MAX_BITS                   3   /* Bit fields per field */
+#define GPS_MAX_FIELDS                11   /* Fields per packet */
+
+/* Altitude offset: 0 value represents 2000 feet below sea level */
+#define ALT_OFFSET                  2000   /* feet */
+
+/* Odometer quirks */
+#define ODO_MAX                     4096   /* in DIST_UNIT (4.096 miles) */
+
+/* Unit conversion */
+#define MILES_TO_KM(mi)             (1.609344 * (mi)) 
+#define FT_TO_M(ft)                 (0.3048 * (ft))
+
+/* Data types */
+struct tdr_dev;                       /* Open recorder */
+struct tdr_options;
+struct tdr_sink;
+struct gps_packet;
+
+struct tdr_header {
+  char dev;                                          /* Device identifier */
+  unsigned int year, month, day, hour, min, sec;     /* Time stamp */
+};
+
+/* Data as it sits in the download buffer. Logical byte off is found at
+ * base[start + off + skip * ((start + off) / DATA_PAGESIZE + 1)], i.e. skip
+ * is 1 for raw EEPROM pages (one transfer control byte per page) and 0 for
+ * a plain buffer. Nothing is copied out of the pages.
+ */
+struct tdr_view {
+  const unsigned char *base;
+  unsigned long int start;
+  int skip;
+};
+
+#define VIEW_INDEX(v, off)  ((v)->start + (off) + (v)->skip * \
+			     (((v)->start + (off)) / DATA_PAGESIZE + 1))
+#define VIEW_BYTE(v, off)   ((v)->base[VIEW_INDEX(v, off)])
+
+struct tdr_session {
+  time_t start;
+  struct tdr_header header, footer;
+  struct tdr_view data;                              /* Session payload */
+  unsigned long int nbytes;
+};
+
+#define SES_DATA(ses, i)    VIEW_BYTE(&(ses)->data, i)
+
+/* The position fixes of a GPS session (records with a position and, if
+ * the packet reports it, an acquisition), gathered while decoding. The
+ * bounds are raw LL_UNIT_DEG values, negative for south and west.
+ */
+struct tdr_fixes {
+  unsigned long int n, first, last;   /* Count, first and last record */
+  int32_t lat_min, lat_max, lon_min, lon_max;
+  int32_t speed_max;                  /* Of all records, in SPEED_UNIT */
+  int32_t dist;                       /* Last distance, in DIST_UNIT */
+};
+
+/* The records of one session, decoded once into columns. The values keep
+ * the units the recorder stores them in (SPEED_UNIT, ALT_OFFSET based
+ * ALT_UNIT, ...); only the time is converted, to seconds since the start
+ * of the session, and the GPS_DIST column holds the distance corrected
+ * for the odometer quirks. Bit i of error is set if record i is a missing
+ * or corrupted packet; its error code is in bpm[i]. The GPS columns are
+ * only set for GPS sessions, and field[id] only for the records whose
+ * layout has field id.
+ */
+struct tdr_records {
+  unsigned long int n, size;
+  double *sec;                        /* Since the session start */
+  unsigned char *bpm;                 /* HR or packet error code */
+  uint64_t *error;
+  const struct gps_packet **layout;   /* GPS packet of the record */
+  unsigned char *first;               /* First packet of its type */
+  int32_t *field[GPS_NFIELDS];        /* GPS_* fields */
+  struct tdr_fixes fix;               /* GPS sessions only */
+};
+
+/* Settings of a client of the library, filled in with the defaults by
+ * tdr_options_init(). The devices of tdr_open() and the decoders of
+ * tdr_decoder_init() keep a pointer to them, so they must stay valid as
+ * long as these are in use.
+ */
+struct tdr_options {
+  int verbosity;                      /* Verbosity level */
+  int units;                          /* Distance units: 0 - miles, 1 - km */
+  time_t initial_time;                /* Decode only sessions newer than this */
+  const struct tdr_sink *sink;        /* Sink of the downloaded sessions */
+  int files;                          /* Session files instead of a listing */
+  const char *output_dir;             /* Directory for the session files */
+  int compress;                       /* TDR_COMPRESS_* of the session files */
+  int jobs;                           /* Threads decoding sessions */
+  int stream;                         /* Decode while the download runs */
+  int sync;                           /* Export only sessions not seen before */
+  int time_sync;                      /* Set the recorder clock */
+  int clear_eeprom;                   /* Clear the EEPROM on device close */
+  int async_transfers;                /* 0 selects libusb-0.1 */
+  const char *simulate;               /* Simulated recorder: IMAGE[,...] */
+  const char *replay_file;            /* Replay recorded USB traffic */
+};
+
+/* Time stamp formatting state: within [lo, hi) the local time is the
+ * UTC time plus off seconds, and the time string of the decoder holds
+ * the date of local day day (-1 if none).
+ */
+struct tdr_clock {
+  time_t lo, hi;
+  long int off;
+  long int day;
+};
+
+/* Text output of a decoder, collected in len bytes of buf and written
+ * to the session output in one piece when full or at the end of a run
+ * of records.
+ */
+struct tdr_writer {
+  char *buf;                          /* TDR_WRITER_SIZE bytes */
+  size_t len;
+};
+
+/* Everything needed to decode and print one session at a time. Nothing
+ * is shared between decoders, so sessions can be decoded in parallel.
+ *
+ * Odometer quirks: 
+ *   dist_offset - to eliminate non-zero session offset
+ *   dist_prev   - remember the previous value in order to control
+ *                 rollovers at ODO_MAX (4.096 miles) and to disallow
+ *                 any decrease in distance
+ *   dist_base   - increment this on each rollover by ODO_MAX
+ */
+struct tdr_decoder {
+  const struct tdr_options *opt;      /* Settings of tdr_decoder_init() */
+  const struct tdr_sink *sink;        /* Receives the decoded sessions */
+  void *arg;                          /* Passed on to the sink */
+  FILE *out;                          /* Messages (stdout or a buffer) */
+  FILE *fp;                           /* Session output: out or a file */
+  int units;                          /* 0 - miles, 1 - km */
+  int files;                          /* Session files instead of out */
+  const char *dir;                    /* Directory of the session files */
+  int compress;                       /* TDR_COMPRESS_* of the files */
+  long int dist_offset, dist_prev, dist_base;   /* in DIST_UNIT */
+  char time_str[TIME_STR_LENGTH];
+  struct tdr_clock clock;             /* Keeps time_str up to date */
+  struct tdr_writer w;                /* Buffered records for fp */
+  struct tdr_records rec;             /* Records of the current session */
+  unsigned long int *gps, ngps, gps_size;  /* GPS packet offsets */
+  int err;                            /* -1 once the output has failed */
+};
+
+struct tdr_info {
+  char vendor[TIMEXDR_STRLEN];
+  char product[TIMEXDR_STRLEN];
+  char serial[TIMEXDR_STRLEN];
+  long int eeprom_size;
+  long int fw_main;
+  long int fw_usb;
+};
+
+/* A bit field of a GPS packet: the bits in mask of the byte at offset
+ * byte, shifted left by shift bits (right if negative). A field is the
+ * sum of its bit fields; a zero mask ends the list.
+ */
+struct gps_bits {
+  unsigned char byte, mask;
+  signed char shift;
+};
+
+struct gps_field {
+  int id;                                            /* GPS_* field */
+  struct gps_bits bits[GPS_MAX_BITS];
+};
+
+/* Layout of one GPS packet type */
+struct gps_packet {
+  unsigned char type;                                /* First packet byte */
+  unsigned char length;                              /* in bytes */
+  int row;                                           /* GPS_ROW_* */
+  int nfields;
+  struct gps_field field[GPS_MAX_FIELDS];
+};
+
+/* Output sink: receives the sessions from the decoder. begin and end
+ * bracket every HRM and GPS session (a multi-device session is passed as
+ * one of each) and records gets the records from to to of the session's
+ * record batch, all of them at once unless the sink is buffered. Any of
+ * the callbacks may be NULL. A sink that writes nothing but dec->fp is
+ * buffered; such sinks may be run on several threads, each formatting a
+ * run of the records, with the output reassembled in order. heading, if
+ * set, starts a listing of several sessions written to dec->fp. The
+ * callbacks return -1 once the output has failed.
+ */
+struct tdr_sink {
+  const char *name;
+  int buffered;
+  int (*begin)(struct tdr_decoder *dec, const struct tdr_session *ses);
+  int (*records)(struct tdr_decoder *dec, const struct tdr_session *ses,
+		 const struct tdr_records *r, unsigned long int from,
+		 unsigned long int to);
+  int (*end)(struct tdr_decoder *dec, const struct tdr_session *ses);
+  int (*heading)(struct tdr_decoder *dec);
+};
+
+/* The text listing of the timexdr program */
+extern const struct tdr_sink tdr_text_sink;
+
+/* Binary and packed (delta coded) session files, one per session */
+extern const struct tdr_sink tdr_binary_sink;
+extern const struct tdr_sink tdr_packed_sink;
+
+/* GPX 1.1 tracks and Garmin Training Center (TCX v2, HST v1) laps of the
+ * position fixes of GPS sessions, one document per session
+ */
+extern const struct tdr_sink tdr_gpx_sink;
+extern const struct tdr_sink tdr_tcx_sink;
+extern const struct tdr_sink tdr_hst_sink;
+
+/* Delimited records of the fields chosen by tdr_set_fields(): CSV with
+ * a heading, or one JSON object per line. HRM and GPS sessions share one
+ * listing.
+ */
+extern const struct tdr_sink tdr_csv_sink;
+extern const struct tdr_sink tdr_ndjson_sink;
+
+/* All of the above, ended by NULL */
+extern const struct tdr_sink *const tdr_sinks[];
+
+/* Binary session file: a struct tdr_bin_header followed by the columns
+ * of the session's record batch, in the byte order of the machine that
+ * wrote it and each starting at a multiple of 8 bytes:
+ *   sec    n doubles, seconds since the session start
+ *   bpm    n bytes, HR or packet error code
+ *   error  (n + 63) / 64 words of the packet error bits
+ *   type   n GPS packet types (GPS sessions only)
+ *   field  n int32_t values of each GPS_* field, zero where the packet
+ *          has no such field (GPS sessions only)
+ *   index  sec of every index_step-th record
+ * The values keep the recorder units of struct tdr_records. Absent
+ * columns have offset 0. The file is meant to be mapped, not parsed.
+ */
+#define TDR_BIN_MAGIC          "TDRBIN1"   /* 8 bytes with the NUL */
+#define TDR_BIN_ORDER         0x01020304
+#define TDR_BIN_EXT                "tdb"
+#define TDR_BIN_INDEX_STEP           256   /* Records per index entry */
+
+/* Packed session file: the struct tdr_bin_header of a binary session file
+ * with TDR_PACK_MAGIC, followed by the coded columns. The column offsets
+ * point to the codes of each column, index to the end of the last one.
+ * A column is a series of LEB128 varints, where a zero is followed by the
+ * number of zeros after it. The varints code
+ *   sec    delta of delta of the bit patterns of the doubles, zig-zag
+ *   bpm    zig-zag delta
+ *   error  the words as they are
+ *   type   zig-zag delta
+ *   field  zig-zag delta over the packets holding the field; delta of
+ *          delta for GPS_SEC
+ * tdr_bin_open() decodes it into the columns of a binary session file.
+ */
+#define TDR_PACK_MAGIC         "TDRPAK1"   /* 8 bytes with the NUL */
+#define TDR_PACK_EXT               "tdp"
+
+struct tdr_bin_header {
+  char magic[8];
+  uint32_t order;                     /* TDR_BIN_ORDER */
+  uint32_t index_step;
+  int64_t start;                      /* Session start (time_t) */
+  uint32_t header[7], footer[7];      /* dev, year, month, ..., sec */
+  uint64_t n;                         /* Records */
+  uint64_t sec, bpm, error, type, index;     /* Column offsets */
+  uint64_t field[GPS_NFIELDS];
+};
+
+/* A binary session file mapped by tdr_bin_open(), or read into memory if
+ * it is compressed. The columns of rec point into the mapping.
+ */
+struct tdr_bin {
+  const unsigned char *map;
+  size_t size;
+  int loaded;                         /* map is a decompressed copy */
+  const struct tdr_bin_header *hdr;
+  struct tdr_session ses;
+  struct tdr_records rec;
+  const double *index;
+  unsigned long int nindex;
+};
+
+/* Errors are printed on stderr and returned as -1, or NULL by the
+ * functions returning a pointer; the library never exits.
+ */
+extern const char *tdr_progname;    /* Prefix of the error messages */
+
+void tdr_options_init(struct tdr_options *opt);
+
+/* Recorder access */
+struct tdr_dev *tdr_open(int n, struct tdr_info *info, int *count,
+			 const struct tdr_options *opt);
+struct libusb_context;
+struct libusb_device;
+struct tdr_dev *tdr_attach(struct libusb_context *ctx, 
+			   struct libusb_device *usbdev, 
+			   struct tdr_info *info, 
+			   const struct tdr_options *opt);
+int tdr_read_info(struct tdr_dev *dev);
+int tdr_sync_time(struct tdr_dev *dev);
+int tdr_close(struct tdr_dev *dev);
+
+/* USB traffic capture and replay */
+int tdr_capture_open(const char *file);
+void tdr_replay_report(const char *replay_file);
+
+/* Decoding */
+void tdr_set_days(struct tdr_options *opt, time_t days);
+void tdr_decoder_init(struct tdr_decoder *dec, FILE *out, 
+		      const struct tdr_sink *sink, void *arg, 
+		      const struct tdr_options *opt);
+void tdr_decoder_free(struct tdr_decoder *dec);
+int tdr_decode(struct tdr_decoder *dec, const struct tdr_session *ses);
+
+const struct tdr_sink *tdr_sink_find(const char *name);
+int tdr_set_fields(const char *list);
+
+/* Fan-out: every decoded session goes to all of the outputs added, each
+ * written by a thread of its own. Set up before the download, which the
+ * options then hand to the fan-out; tdr_outputs_close() waits for the
+ * writers.
+ */
+int tdr_output_add(struct tdr_options *opt, const char *spec);
+int tdr_outputs_close(void);
+
+/* Compressed output: the data written to the stream are compressed by a
+ * thread of its own. tdr_zclose() also closes plain streams.
+ */
+int tdr_compress_find(const char *name);
+int tdr_compress_suffix(const char *path);
+FILE *tdr_zopen(const char *path, int method);
+int tdr_zclose(FILE *fp);
+
+/* Binary session files */
+struct tdr_bin *tdr_bin_open(const char *path);
+void tdr_bin_close(struct tdr_bin *bin);
+unsigned long int tdr_bin_seek(const struct tdr_bin *bin, double sec);
+int tdr_bin_output(struct tdr_decoder *dec, struct tdr_bin *bin,
+		   unsigned long int from, unsigned long int to);
+
+#endif /* TDR_LIBTIMEXDR_H */
@@ -0,0 +1,84 @@
+/* 
+ * Timex Data Recorder userspace control utility
+ *
+ * Copyright (C) 2005-2006 Jan Merka <merka@highsphere.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *      
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *      
+ */             
+
+#ifndef TDR_TDRJOB_H
+#define TDR_TDRJOB_H 1
+
+/* Downloads of the timexdr program: the session table and the jobs that
+ * download and export the EEPROM of a recorder. Not installed.
+ */
+#include <pthread.h>
+#include "libtimexdr.h"
+
+/* Incremental sync state of one recorder: the access table seen by the last
+ * run and the headers of the sessions exported so far.
+ */
+struct tdr_sync {
+  char path[2 * TIMEXDR_STRLEN];
+  unsigned char table[TIMEXDR_ATABLESIZE];
+  char exported[TDR_MAX_SESSIONS];
+  struct tdr_header header[TDR_MAX_SESSIONS];
+};
+
+/* The session table of one download and the decoder of the sessions
+ * printed in order. Released by tdr_sessions_free().
+ */
+struct tdr_arena {
+  struct tdr_session ses[TDR_MAX_SESSIONS];
+  int nses;
+  struct tdr_decoder dec;
+  struct tdr_sync *sync;              /* Incremental sync state or NULL */
+};
+
+/* Download of one recorder. With several recorders attached every one is
+ * downloaded on its own thread and gets its own output directory.
+ */
+#define JOB_DONE                     0     /* EEPROM downloaded */
+#define JOB_EMPTY                    1     /* Nothing stored in EEPROM */
+#define JOB_SYNCED                   2     /* No new sessions */
+#define JOB_FAILED                   3     /* Download failed */
+
+struct tdr_job {
+  struct tdr_dev *dev;
+  struct tdr_info info;
+  struct tdr_sync sync;
+  char dir[TIMEXDR_STRLEN];           /* Output directory or "" */
+  int choice;                         /* Command: 'a', 'd' or 'e' */
+  unsigned char *buf;                 /* Raw EEPROM data */
+  unsigned long int bytes;            /* Bytes in buf */
+  int status;                         /* JOB_* */
+  pthread_t thread;
+};
+
+/* Download and export, as set up by the options of the device. Both
+ * return -1 on failure. tdr_job_failed() gives up a job before its
+ * download, so that the EEPROM is kept.
+ */
+int tdr_download(struct tdr_job *job);
+int tdr_export(struct tdr_job *job, int full_eeprom_listing);
+int tdr_job_failed(struct tdr_job *job);
+
+/* Session table of the raw EEPROM data */
+struct tdr_arena *tdr_sessions(const unsigned char *buf, 
+			       const struct tdr_options *opt);
+void tdr_sessions_free(struct tdr_arena *arena);
+
+#endif /* TDR_TDRJOB_H */
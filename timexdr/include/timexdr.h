@@ -22,6 +22,10 @@
 #ifndef TDR_TIMEXDR_H
 #define TDR_TIMEXDR_H 1
 
+/* Internals of libtimexdr */
+#include "libtimexdr.h"
+#include "tdrjob.h"
+
 //#define TDR_DEBUG 1
 
 /*-------------------------------------------------------------------------*/
@@ -76,32 +80,18 @@
 
 /*-------------------------------------------------------------------------*/
 
-#define TIMEXDR_VENDOR_ID      0x0cc2
-#define TIMEXDR_PRODUCT_ID1    0xc700
-#define TIMEXDR_PRODUCT_ID2    0xc701
 #define TIMEXDR_USAGE          0xffa00000
 
 #define TIMEXDR_EP             0x81
 
 #define MAXBUFSIZE             4096        /* in bytes */
 #define RESPONSE_BUFSIZE          7        /* in bytes */
-#define EEPROM_PAGESIZE         256        /* in bytes */
-#define DATA_PAGESIZE  (EEPROM_PAGESIZE-1) /* in bytes */
-
-#define TIMEXDR_STRLEN         256
 #define TIMEXDR_STR_VENDOR       1
 #define TIMEXDR_STR_PRODUCT      2
 
 #define TIMEXDR_CONFIG           1
 #define TIMEXDR_INTERFACE        0
 
-#define TIMEXDR_FIRSTSESSION     0x180     /* Position of the first session */
-#define TIMEXDR_ATABLESIZE         384     /* Bytes in the access table  */
-#define TDR_ASIZE                    3     /* Address size in bytes */
-
-#define TIME_STEP_HRM                2     /* in seconds */
-#define TIME_STEP_GPS                3.57  /* in seconds */
-
 //#define TIME_CHECKSUM             0xb9     /* for time synchronization */
 
 #define TDR_ADDRESS(b0, b1, b2)     ((b0) | ((b1) << 8) | ((b2) << 16)) 
@@ -109,64 +99,19 @@
 #define TDR_YR(yr)       (2000 + (yr))
 #define TDR_MD(md)       (1 + (md))
 
-
-/* Multi-device session ID (both HRM and GPS data */
-#define SESSION_MASK                0xf0
-#define MULTI_DEVICE_SESSION        0xff 
-#define HRM_SESSION                 0x00
-#define GPS_SESSION                 0x20   /* ID varies 0x20-0x2f */
-
-#define HRM_FILE_EXT                "hrm"
-#define GPS_FILE_EXT                "gps"
-
 #define TIMEXDR_CTRL_TIMEOUT         600   /* in miliseconds */
+#define TIMEXDR_PAGE_TIMEOUT  (10 * TIMEXDR_CTRL_TIMEOUT)  /* in miliseconds */
 
+#define TDR_MAX_RESTARTS               5   /* Upload restarts before giving up */
+#define TDR_TIMEOUT_MARGIN            10   /* Page timeout in average page times */
 
-/* Packet error codes */
-#define MISSING_PACKET              0x00
-#define CORRUPTED_PACKET            0x04
-
-/* GPS packets and profiles */
-
-#define PACKET_TYPE_ERROR           0x12   /* Missing/corrupted packet */
-#define PACKET_TYPE_1               0x15   /* status, speed, distance */
-#define PACKET_TYPE_2               0x25   /* altitude and heading */
-#define PACKET_TYPE_3               0x37   /* position */
-#define PACKET_TYPE_4               0x45   /* time and date */
-#define PACKET_TYPE_5               0x59   /* status, speed, distance, */ 
-					   /* altitude and heading */
-#define PACKET_TYPE_15              0xf0   /* everything */
-#define PACKET_TYPE_15_LENGTH         17   /* in bytes */
-
-#define PACKET_LENGTH_MASK          0x0f
-#define GPS_PACKET_MIN_LENGTH          2   /* in bytes */
-
-/* SNSR Status */
-#define SNSR_GPS_OK                 0x00
-#define SNSR_GPS_SYSFAILURE         0x09
-#define SNSR_ROMRAM_FAILURE         0x0a
-#define SNSR_OSCIL_DRIFT_FAILURE    0x0b
-#define SNSR_GPS_NO_CARRIER         0x01   /* Ready to power down */
-#define SNSR_GPS_NO_MOTION          0x02   /* Ready to power down */   
-#define SNSR_LOW_BATTERY            0x03   /* Ready to power down */
-
-/* Data units */
-#define SPEED_UNIT                  0.1    /* mph */
-#define DIST_UNIT                   0.001  /* mile */
-#define ALT_UNIT                    1      /* foot */
-#define HEADING_UNIT                2      /* degrees */
-#define LL_UNIT                     M_PI/pow(2,23)     /* radian */
-#define LL_UNIT_DEG                 180/pow(2,23)      /* degrees */
-
-/* Altitude offset: 0 value represents 2000 feet below sea level */
-#define ALT_OFFSET                  2000   /* feet */
-
-/* Odometer quirks */
-#define ODO_MAX                     4.096  /* miles */
-
-/* Unit conversion */
-#define MILES_TO_KM(mi)             (1.609344 * (mi)) 
-#define FT_TO_M(ft)                 (0.3048 * (ft))
+/* Page queue between the reader and decoder threads (streamed download) */
+#define PAGE_QUEUE_LEN                64   /* in pages, power of two */
+#define PAGE_QUEUE_END       (~0UL)        /* end of transfer marker */
+
+#ifndef TDR_PARALLEL_MIN
+#define TDR_PARALLEL_MIN            4096   /* Records worth splitting up */
+#endif
 
 /* Output report array: Byte 0 is the Report Number, byte 1 specifies the 
  * configuration, byte 2 encodes command type and the number n of bytes to send 
@@ -174,8 +119,6 @@
  * rest is insignificant. 
  */
 #define TIMEXDR_CTRL_SIZE           0xa
-char ctrl_cmd[TIMEXDR_CTRL_SIZE] = {0x01, 0x0, 0x0, 0x0, 0x0, 
-				    0x0, 0x0, 0x0, 0x0, 0x0};
 
 /* Vendor command definitions */
 #define EEPROM_USAGE               0
@@ -250,39 +193,287 @@ char ctrl_cmd[TIMEXDR_CTRL_SIZE] = {0x01, 0x0, 0x0, 0x0, 0x0,
 #define DEC_EEPROM_USAGE(b2, b3, b4) ((((b2) & 0xf) << 16) | ((b4) << 8) | (b3)) 
 
 /* Data types */
-struct tdr_session; 
 
-struct tdr_header {
-  char dev;                                          /* Device identifier */
-  unsigned int year, month, day, hour, min, sec;     /* Time stamp */
+/* Sessions decoded by a pool of worker threads. Each worker prints into
+ * a buffer of its session; the buffers are written out in session order.
+ */
+struct tdr_pool {
+  struct tdr_arena *arena;
+  int next;                           /* Next session to take */
+  char selected[TDR_MAX_SESSIONS];    /* To be printed */
+  char done[TDR_MAX_SESSIONS];
+  char *buf[TDR_MAX_SESSIONS];
+  size_t len[TDR_MAX_SESSIONS];
+  int err;                            /* A session has failed */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+
+/* Single-producer/single-consumer ring of received page numbers. Only the
+ * reader advances head and only the decoder advances tail; the semaphore
+ * merely lets the decoder sleep while the ring is empty.
+ */
+struct page_queue {
+  unsigned long int page[PAGE_QUEUE_LEN];
+  volatile unsigned long int head, tail;
+  sem_t ready;
+};
+
+struct tdr_dev;
+struct tdr_download;
+
+/* A transport carries the output reports and the interrupt-IN data between
+ * the program and a recorder: libusb-0.1, libusb-1.0 or the simulator.
+ */
+struct tdr_transport {
+  const char *name;
+  /* Sends an output report, returns the number of bytes sent */
+  int (*send)(struct tdr_dev *dev, const char *report, int size);
+  /* Interrupt read, returns the bytes received or a negative value */
+  int (*read)(struct tdr_dev *dev, unsigned char *buf, int size, int timeout);
+  /* One pass of the EEPROM download, returns -1 on failure */
+  int (*download)(struct tdr_dev *dev, struct tdr_download *dl);
+  /* Releases the recorder, returns -1 on failure */
+  int (*close)(struct tdr_dev *dev);
 };
 
-struct tdr_session {
-  time_t start;
-  struct tdr_session *next, *prev;
-  struct tdr_header header, footer;
-  unsigned char *data;
-  unsigned long int nbytes;
+/* Simulated recorder: answers the vendor commands from an EEPROM image and
+ * delivers the upload with a per-page latency and a limited throughput.
+ */
+#define SIM_EEPROM_CAPACITY   0x200000     /* in bytes */
+#define SIM_FW_VERSION        0x014321     /* BCD, both microcontrollers */
+
+struct tdr_sim {
+  unsigned char *image;               /* EEPROM data (without control bytes) */
+  unsigned long int size;             /* Bytes in image */
+  double latency;                     /* Seconds before each page */
+  double rate;                        /* Bytes per second, 0 is unlimited */
+  long int fail_page;                 /* The first read of it times out */
+  int failed;
+  unsigned char response[RESPONSE_BUFSIZE];
+  int pending;                        /* A response is waiting */
+  int upload;                         /* The upload is running */
+  unsigned long int pos;              /* Bytes of the upload sent */
 };
 
-struct tdr_info {
-  char vendor[TIMEXDR_STRLEN];
-  char product[TIMEXDR_STRLEN];
-  long int eeprom_size;
-  long int fw_main;
-  long int fw_usb;
+/* USB traffic capture: the file starts with CAPTURE_MAGIC followed by one
+ * record per output report or interrupt read. A record is a header of
+ * CAPTURE_RECSIZE bytes with little-endian fields
+ *   0  kind (u8)            1  command type of a report (u8)
+ *   2  recorder (u16)       4  return code (s32)
+ *   8  bytes requested (u32)  12  reserved (u32)
+ *  16  start (u64, ns)     24  end (u64, ns, monotonic clock)
+ * followed by the report sent or the bytes received.
+ */
+#define CAPTURE_MAGIC       "TDRCAP01"
+#define CAPTURE_MAGIC_LEN            8
+#define CAPTURE_RECSIZE             32
+#define CAPTURE_CTRL                 1     /* Output report */
+#define CAPTURE_READ                 2     /* Interrupt-IN read */
+#define CAPTURE_NOCMD             0xff
+#define CAPTURE_BUCKETS             24     /* Latency buckets: 2^i us */
+#define CAPTURE_DATA                16     /* Histogram slot of upload data */
+
+struct tdr_record {
+  int kind;
+  int cmd;
+  int recorder;
+  int ret;
+  unsigned long int size;
+  unsigned long long start, end;
+  unsigned char data[MAXBUFSIZE];
 };
 
-/* Global settings */
-int dist_units = 1;                 /* Distance units: 0 - miles, 1 - km */
-time_t initial_time = 0;            /* Download only sessions newer than 
-				       init_time */
-int write_session_to_file = 0;
-FILE *sfp;                          /* Session file pointer (stdout) */
+/* Replay of a capture: the transport answers with the recorded data */
+struct tdr_replay {
+  FILE *fp;
+  struct tdr_record rec;              /* Next record of the recorder */
+  int have;                           /* rec is valid */
+  int recorder;                       /* Recorder replayed */
+  unsigned long int skipped;          /* Records that didn't match */
+};
 
-int verbosity = 0;                  /* Verbosity level */
+/* Open device. The transport tells which of the libusb-0.1 and libusb-1.0
+ * handles, the simulator and the replayed capture is set.
+ */
+struct tdr_dev {
+  const struct tdr_transport *transport;
+  usb_dev_handle *udev;               /* Blocking libusb-0.1 backend */
+#if TDR_LIBUSB1
+  libusb_context *ctx;                /* Asynchronous libusb-1.0 backend */
+  libusb_device_handle *handle;
+  int keep_ctx;                       /* ctx belongs to the hotplug daemon */
+#endif
+  struct tdr_sim *sim;                /* Simulated recorder */
+  struct tdr_replay *replay;          /* Replayed capture */
+  int id;                             /* Recorder number in captures */
+  struct tdr_info *info;              /* Filled in by tdr_open() */
+  const struct tdr_options *opt;      /* Settings given to tdr_open() */
+  int failed;                         /* Keeps the EEPROM after a failed job */
+};
+
+/* Progress of an EEPROM download. The device always sends the EEPROM from
+ * the start so after a restart the pages already received are skipped.
+ */
+struct tdr_download {
+  unsigned char *buf;
+  unsigned long int size;             /* Bytes expected */
+  unsigned long int pos;              /* Bytes received in the current pass */
+  unsigned long int limit;            /* Stop the pass after so many bytes */
+  unsigned char *received;            /* Non-zero for each page in buf */
+  unsigned long int npages;           /* Pages in buf */
+  double page_time;                   /* Average seconds per page */
+  struct timespec mark;               /* Time of the last received page */
+  int restarts;                       /* Upload restarts after a failure */
+  unsigned long int retried;          /* Pages transferred more than once */
+  double retry_time;                  /* Seconds lost to failures */
+  void (*page_done)(unsigned long int page, void *arg);
+  void *arg;
+};
 
-struct tdr_info tdr_info = {vendor:"", product:"", 
-			    eeprom_size:0, fw_main:0, fw_usb:0};
+#if TDR_LIBUSB1
+/* One pass of an asynchronous download: several interrupt-IN transfers of
+ * one page each are kept queued and every completion submits the next one.
+ */
+struct tdr_async {
+  struct tdr_download *dl;
+  unsigned long int pending;          /* Bytes requested by queued transfers */
+  struct libusb_transfer **xfer;      /* All transfers of the pass */
+  char *busy;                         /* Non-zero while xfer[i] is queued */
+  int ntransfers, in_flight;
+  int status;                         /* First failed transfer status */
+  struct tdr_dev *dev;
+  struct timespec *start;             /* Submit time of xfer[i] */
+};
+#endif
+
+struct tdr_stream {
+  struct tdr_dev *dev;
+  struct tdr_download *dl;
+  struct page_queue queue;
+  int err;                            /* The download has failed */
+};
+
+#define GPS_BYTE(b)              { (b), 0xff, 0 }
+#define GPS_WORD(hi, lo)         { GPS_BYTE(lo), { (hi), 0xff, 8 } }
+#define GPS_24BIT(hi, mid, lo)   { GPS_BYTE(lo), { (mid), 0xff, 8 }, \
+				   { (hi), 0xff, 16 } }
+/* Status byte, speed and distance (12 bits each, high nibbles in hsb) */
+#define GPS_STATUS_FIELDS(st, hsb, spd, odo)			  \
+  { GPS_STATUS, { { (st), 0xf0, -4 } } },			  \
+  { GPS_ACQ, { { (st), 0x0c, -2 } } },				  \
+  { GPS_BATTERY, { { (st), 0x03, 0 } } },			  \
+  { GPS_SPEED, { GPS_BYTE(spd), { (hsb), 0xf0, 4 } } },		  \
+  { GPS_DIST, { GPS_BYTE(odo), { (hsb), 0x0f, 8 } } }
+#define GPS_ALT_FIELDS(alt, ht, hm)				  \
+  { GPS_ALT, GPS_WORD(alt, (alt) + 1) },			  \
+  { GPS_HTRUE, { GPS_BYTE(ht) } },				  \
+  { GPS_HMAG, { GPS_BYTE(hm) } }
+#define GPS_POS_FIELDS(lat, lon)				  \
+  { GPS_LAT, GPS_24BIT(lat, (lat) + 1, (lat) + 2) },		  \
+  { GPS_LON, GPS_24BIT(lon, (lon) + 1, (lon) + 2) }
+
+static const struct gps_packet gps_packets[] = {
+  { PACKET_TYPE_ERROR, 2, GPS_ROW_ERROR, 1, {
+      { GPS_TOKEN, { GPS_BYTE(1) } } } },
+  { PACKET_TYPE_1, 5, GPS_ROW_FIX, 5, {
+      GPS_STATUS_FIELDS(1, 2, 3, 4) } },
+  { PACKET_TYPE_2, 5, GPS_ROW_FIX, 3, {
+      GPS_ALT_FIELDS(1, 3, 4) } },
+  { PACKET_TYPE_3, 7, GPS_ROW_FIX, 2, {
+      GPS_POS_FIELDS(1, 4) } },
+  { PACKET_TYPE_4, 5, GPS_ROW_TIME, 6, {
+      { GPS_YEAR, { { 1, 0x0f, 0 } } },
+      { GPS_MONTH, { { 1, 0xf0, -4 } } },
+      { GPS_DAY, { { 3, 0xe0, -5 }, { 2, 0x03, 3 } } },
+      { GPS_HOUR, { { 3, 0x1f, 0 } } },
+      { GPS_MIN, { { 2, 0xfc, -2 } } },
+      { GPS_SEC, { GPS_BYTE(4) } } } },
+  { PACKET_TYPE_5, 9, GPS_ROW_FIX, 8, {
+      GPS_STATUS_FIELDS(1, 2, 3, 4), GPS_ALT_FIELDS(5, 7, 8) } },
+  { PACKET_TYPE_15, PACKET_TYPE_15_LENGTH, GPS_ROW_FIX, 11, {
+      GPS_STATUS_FIELDS(2, 3, 4, 5), GPS_ALT_FIELDS(6, 8, 9),
+      GPS_POS_FIELDS(10, 13), { GPS_SEC, { GPS_BYTE(16) } } } }
+};
+
+#define GPS_NPACKETS  (sizeof(gps_packets) / sizeof(gps_packets[0]))
+
+/* Packet type -> 1 + index into gps_packets[], 0 for unknown types */
+static const unsigned char gps_packet_index[256] = {
+  [PACKET_TYPE_ERROR] = 1, [PACKET_TYPE_1] = 2, [PACKET_TYPE_2] = 3,
+  [PACKET_TYPE_3] = 4, [PACKET_TYPE_4] = 5, [PACKET_TYPE_5] = 6,
+  [PACKET_TYPE_15] = 7
+};
+
+/* State of the GPS decoder within a session */
+struct gps_state {
+  double split_time;
+  unsigned char seen[GPS_NPACKETS];                  /* Packet types seen */
+};
+
+/* A run of the records of a session formatted by its own thread */
+struct tdr_chunk {
+  const struct tdr_decoder *parent;   /* Sink and records of the session */
+  const struct tdr_session *ses;
+  unsigned long int from, to;         /* Records of the run */
+  char *buf;                          /* Formatted records */
+  size_t len;
+  int err;                            /* The run couldn't be formatted */
+  pthread_t thread;
+};
+
+/* Decoded sessions waiting for the writer of a fan-out target */
+#define TDR_FANOUT_QUEUE               8
+
+/* A decoded session handed to the fan-out targets. The last one to
+ * write it releases it.
+ */
+struct fanout_batch {
+  struct tdr_session ses;
+  struct tdr_records rec;
+  char dir[TIMEXDR_STRLEN];           /* Recorder directory (-M) or "" */
+  int refs;
+};
+
+/* An output of the fan-out: a sink writing a listing to out, or session
+ * files to the directory path, on a thread of its own
+ */
+struct fanout_target {
+  const struct tdr_sink *sink;
+  char path[TIMEXDR_STRLEN];
+  int files;
+  FILE *out;
+  struct tdr_decoder dec;
+  struct fanout_batch *queue[TDR_FANOUT_QUEUE];
+  unsigned long int head, tail;       /* Under the fan-out lock */
+  pthread_t thread;
+};
+
+extern const struct tdr_sink tdr_fanout_sink;
+
+/* An output file compressed by a thread of its own: the stream writes
+ * into a pipe, which the thread reads and compresses into fd.
+ */
+struct tdr_zstream {
+  FILE *fp;                           /* Write end of the pipe */
+  int pipe;                           /* Read end of the pipe */
+  int fd;                             /* The compressed file */
+  int method;                         /* TDR_COMPRESS_* */
+  int err;
+  pthread_t thread;
+  struct tdr_zstream *next;
+};
+
+struct tdr_fanout {
+  struct fanout_target target[TDR_MAX_OUTPUTS];
+  int n;
+  const struct tdr_options *opt;      /* Of tdr_output_add() */
+  int started;                        /* Writer threads running */
+  int done;
+  int err;                            /* A writer has failed */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;                /* A queue has changed */
+};
 
 #endif /* TDR_TIMEXDR_H */
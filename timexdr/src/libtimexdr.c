@@ -0,0 +1,5738 @@
+/* 
+ * libtimexdr - Timex Data Recorder access and session decoding
+ *
+ * Copyright (C) 2005-2006 Jan Merka <merka@highsphere.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *      
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *      
+ */   
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "common.h"
+#include "timexdr.h"
+
+const char *tdr_progname = PACKAGE; /* Prefix of the error messages */
+
+
+static int download_pass_sync(struct tdr_dev *dev, struct tdr_download *dl);
+#if TDR_LIBUSB1
+static int download_pass_async(struct tdr_dev *dev, struct tdr_download *dl);
+#endif
+
+/*
+ * Prints an error message. Returns -1 for the caller to pass on.
+ */
+static int failed(const char *message) {
+  fprintf(stderr, "%s: %s (%m).\n", tdr_progname, message);
+  return -1;
+}
+
+/*
+ * Fails the output of a decoder: nothing more is written and the sink
+ * callbacks return -1. Only the first error is printed.
+ */
+static int decoder_failed(struct tdr_decoder *dec, const char *message) {
+  if (!dec->err) failed(message);
+  dec->err = -1;
+  return -1;
+}
+ 
+/* 
+ * Finds the Timex Data Recorder devices. Up to max of them are stored in
+ * tdr. Returns the number of devices found.
+ */
+static int find_timexdr(struct usb_device **tdr, int max) {
+  struct usb_bus *bus;
+  struct usb_device *dev;
+  int count = 0;
+  
+  for (bus = usb_get_busses(); bus; bus = bus->next) {
+    for (dev = bus->devices; dev; dev = dev->next) {
+      if (IS_TIMEXDR(dev->descriptor.idVendor, dev->descriptor.idProduct)) {
+	if (count < max) tdr[count] = dev;
+	count++;
+      }
+    }
+  }
+  return (count < max) ? count : max;
+}
+
+/* Maximum length of the device name string */
+#define DNAMELEN                50 
+
+/*
+ * Opens and initializes the n-th device (the last one if n is negative)
+ * through libusb-0.1. The number of devices found is stored in count.
+ */ 
+static usb_dev_handle *timexdr_open_sync(struct tdr_dev *tdr, int n, 
+					 int *count) {
+  struct tdr_info *tdr_info = tdr->info;
+  int verbosity = tdr->opt->verbosity;
+  struct usb_dev_handle *udev;
+  struct usb_device *list[TDR_MAX_DEVICES], *dev;
+  char dname[DNAMELEN];
+  int ret;
+
+  usb_init();
+
+  usb_find_busses();
+  usb_find_devices();
+  
+  if ( (*count = find_timexdr(list, TDR_MAX_DEVICES)) == 0) {
+    failed("Device not found. Check the connection");
+    return NULL;
+  }
+
+  if (verbosity > 5) printf("Found %d device(s).\n", *count);
+
+  dev = list[((n < 0) || (n >= *count)) ? *count - 1 : n];
+
+  if ((udev = usb_open(dev))) {
+
+    ret = usb_get_string_simple(udev, TIMEXDR_STR_VENDOR, tdr_info->vendor, 
+				sizeof(tdr_info->vendor));
+    ret = usb_get_string_simple(udev, TIMEXDR_STR_PRODUCT, tdr_info->product, 
+				sizeof(tdr_info->product));
+    if (dev->descriptor.iSerialNumber) {
+      ret = usb_get_string_simple(udev, dev->descriptor.iSerialNumber, 
+				  tdr_info->serial, sizeof(tdr_info->serial));
+    }
+
+    if (verbosity) {
+      printf("Vendor:  [0x%04x] %s\nProduct: [0x%04x] %s\n", 
+	     dev->descriptor.idVendor, tdr_info->vendor, 
+	     dev->descriptor.idProduct, tdr_info->product);
+    }
+
+/* Non-portable Linux-only code */
+#if defined(LIBUSB_HAS_GET_DRIVER_NP) && defined (LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP)
+    if ( usb_get_driver_np(udev, TIMEXDR_INTERFACE, dname, DNAMELEN) == 0 ) {
+      if ( usb_detach_kernel_driver_np(udev, TIMEXDR_INTERFACE) < 0 ) {
+	fprintf(stderr, "Couldn't detach kernel driver %s (%s).\n", dname, 
+		usb_strerror());
+	usb_close(udev);
+	return NULL;
+      }
+    } /* Don't stop here if usb_get_driver_np fails because that only 
+	 means there is no kernel driver to be detached */
+#endif
+
+    if ( usb_set_configuration(udev, TIMEXDR_CONFIG) < 0 ) {
+      failed("Couldn't set configuration");
+      usb_close(udev);
+      return NULL;
+      }
+
+    if ( usb_claim_interface(udev, TIMEXDR_INTERFACE) < 0 ) {
+      failed("Couldn't claim interface");
+      usb_close(udev);
+      return NULL;
+    }
+
+  } else {
+    failed("Couldn't open the device. Check your access rights");
+  }
+
+  return udev;
+}
+
+/*
+ * libusb-0.1 transport.
+ */
+static int usb0_send(struct tdr_dev *dev, const char *report, int size) {
+  return usb_control_msg(dev->udev, 
+			 USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 
+			 USB_REQ_SET_CONFIGURATION, 
+			 0x201, 
+			 0, 
+			 (char *)report, 
+			 size, 
+			 TIMEXDR_CTRL_TIMEOUT);
+}
+
+static int usb0_read(struct tdr_dev *dev, unsigned char *buf, int size, 
+		     int timeout) {
+  return usb_interrupt_read(dev->udev, TIMEXDR_EP, (char *)buf, size, timeout);
+}
+
+static int usb0_close(struct tdr_dev *dev) {
+  int ret;
+
+  if ( (ret = usb_release_interface(dev->udev, 0)) < 0 ) {
+    failed("Couldn't release device");
+  }
+  usb_close(dev->udev);
+  if (dev->opt->verbosity > 5) printf("Release interface status: %d\n", ret);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static const struct tdr_transport usb0_transport = {
+  "libusb-0.1", usb0_send, usb0_read, download_pass_sync, usb0_close
+};
+
+#if TDR_LIBUSB1
+/*
+ * libusb-1.0 transport.
+ */
+static int usb1_send(struct tdr_dev *dev, const char *report, int size) {
+  return libusb_control_transfer(dev->handle, 
+				 USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 
+				 USB_REQ_SET_CONFIGURATION, 
+				 0x201, 
+				 0, 
+				 (unsigned char *)report, 
+				 size, 
+				 TIMEXDR_CTRL_TIMEOUT);
+}
+
+static int usb1_read(struct tdr_dev *dev, unsigned char *buf, int size, 
+		     int timeout) {
+  int ret, got = 0;
+
+  ret = libusb_interrupt_transfer(dev->handle, TIMEXDR_EP, buf, size, &got,
+				  timeout);
+  /* A timed out transfer may still have delivered some data */
+  return ((ret == 0) || (got > 0)) ? got : ret;
+}
+
+static int usb1_close(struct tdr_dev *dev) {
+  int ret;
+
+  if ( (ret = libusb_release_interface(dev->handle, 0)) < 0 ) {
+    failed("Couldn't release device");
+  }
+  libusb_close(dev->handle);
+  if (!dev->keep_ctx) libusb_exit(dev->ctx);
+  if (dev->opt->verbosity > 5) printf("Release interface status: %d\n", ret);
+
+  return (ret < 0) ? -1 : 0;
+}
+
+static const struct tdr_transport usb1_transport = {
+  "libusb-1.0", usb1_send, usb1_read, download_pass_async, usb1_close
+};
+
+/*
+ * Opens the given recorder through libusb-1.0 and claims its interface.
+ * Returns -1 if it can't be claimed.
+ */ 
+static int timexdr_claim_async(struct tdr_dev *tdr, libusb_device *dev, 
+			       const struct libusb_device_descriptor *found) {
+  struct tdr_info *tdr_info = tdr->info;
+  int ret;
+
+  tdr->transport = &usb1_transport;
+  if (libusb_open(dev, &tdr->handle) < 0) {
+    return failed("Couldn't open the device. Check your access rights");
+  }
+
+  libusb_get_string_descriptor_ascii(tdr->handle, TIMEXDR_STR_VENDOR, 
+				     (unsigned char *)tdr_info->vendor, 
+				     sizeof(tdr_info->vendor));
+  libusb_get_string_descriptor_ascii(tdr->handle, TIMEXDR_STR_PRODUCT, 
+				     (unsigned char *)tdr_info->product, 
+				     sizeof(tdr_info->product));
+  if (found->iSerialNumber) {
+    libusb_get_string_descriptor_ascii(tdr->handle, found->iSerialNumber, 
+				       (unsigned char *)tdr_info->serial, 
+				       sizeof(tdr_info->serial));
+  }
+
+  if (tdr->opt->verbosity) {
+    printf("Vendor:  [0x%04x] %s\nProduct: [0x%04x] %s\n", 
+	   found->idVendor, tdr_info->vendor, found->idProduct, tdr_info->product);
+  }
+
+  if (libusb_kernel_driver_active(tdr->handle, TIMEXDR_INTERFACE) == 1) {
+    if ((ret = libusb_detach_kernel_driver(tdr->handle, TIMEXDR_INTERFACE)) < 0) {
+      fprintf(stderr, "Couldn't detach kernel driver (%s).\n", 
+	      libusb_error_name(ret));
+      libusb_close(tdr->handle);
+      return -1;
+    }
+  }
+
+  if (libusb_set_configuration(tdr->handle, TIMEXDR_CONFIG) < 0) {
+    failed("Couldn't set configuration");
+    libusb_close(tdr->handle);
+    return -1;
+  }
+
+  if (libusb_claim_interface(tdr->handle, TIMEXDR_INTERFACE) < 0) {
+    failed("Couldn't claim interface");
+    libusb_close(tdr->handle);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Opens and initializes the n-th device (the last one if n is negative)
+ * through libusb-1.0. The number of devices found is stored in count.
+ * Returns -1 if the device can't be opened.
+ */ 
+static int timexdr_open_async(struct tdr_dev *tdr, int nth, int *count) {
+  libusb_device **list, *dev = NULL;
+  struct libusb_device_descriptor desc, found;
+  ssize_t i, n;
+  int ret;
+
+  if (libusb_init(&tdr->ctx) < 0) {
+    return failed("Couldn't initialize libusb");
+  }
+
+  if ((n = libusb_get_device_list(tdr->ctx, &list)) < 0) {
+    libusb_exit(tdr->ctx);
+    return failed("Couldn't get the list of USB devices");
+  }
+
+  *count = 0;
+  for (i = 0; (i < n) && (*count < TDR_MAX_DEVICES); i++) {
+    if ((libusb_get_device_descriptor(list[i], &desc) == 0) &&
+	IS_TIMEXDR(desc.idVendor, desc.idProduct)) {
+      if ((nth < 0) || (*count <= nth)) {
+	dev = list[i];
+	found = desc;
+      }
+      (*count)++;
+    }
+  }
+
+  if (*count == 0) {
+    failed("Device not found. Check the connection");
+    libusb_free_device_list(list, 1);
+    libusb_exit(tdr->ctx);
+    return -1;
+  }
+
+  if (tdr->opt->verbosity > 5) printf("Found %d device(s).\n", *count);
+
+  ret = timexdr_claim_async(tdr, dev, &found);
+  libusb_free_device_list(list, 1);
+  if (ret < 0) libusb_exit(tdr->ctx);
+
+  return ret;
+}
+
+/*
+ * Opens a recorder found by the caller (the hotplug daemon) in its own
+ * libusb-1.0 context and stores its description in info. The context is
+ * left to the caller on close. Returns NULL if the recorder can't be
+ * claimed.
+ */ 
+struct tdr_dev *tdr_attach(libusb_context *ctx, libusb_device *usbdev, 
+			   struct tdr_info *info, 
+			   const struct tdr_options *opt) {
+  struct libusb_device_descriptor desc;
+  struct tdr_dev *tdr;
+
+  if (!(tdr = calloc(1, sizeof(*tdr)))) {
+    failed("Couldn't allocate memory");
+    return NULL;
+  }
+  tdr->ctx = ctx;
+  tdr->keep_ctx = 1;
+  tdr->info = info;
+  tdr->opt = opt;
+  tdr->id = libusb_get_device_address(usbdev);
+
+  libusb_get_device_descriptor(usbdev, &desc);
+  if (timexdr_claim_async(tdr, usbdev, &desc) < 0) {
+    free(tdr);
+    return NULL;
+  }
+
+  return tdr;
+}
+#endif
+
+/*
+ * USB traffic capture.
+ */
+static FILE *capture_fp = NULL;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *capture_cmd_name[] = {
+  "EEPROM_USAGE", "EEPROM_CLEAR", "DATA_UPLOAD", "UPLOAD_CANCEL", 
+  "SYNC_TIME", "UPLOAD_DONE", "SW_TIMEOUT", "FW_VERSION", "EEPROM_TEST", 
+  "ROM_TEST", "RAM_TEST", "READ_BOND_OPTION", "MODIFY_BOND_OPTION", 
+  "RESTORE_BOND_OPTION", "EEPROM_CAPACITY", "RAM_ROM_DEBUG", "upload data"
+};
+
+/*
+ * Returns the monotonic clock in nanoseconds.
+ */
+static unsigned long long capture_time(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put_le(unsigned char *p, unsigned long long v, int n) {
+  for (; n > 0; n--, v >>= 8) *p++ = v & 0xff;
+}
+
+static unsigned long long get_le(const unsigned char *p, int n) {
+  unsigned long long v = 0;
+
+  while (n-- > 0) v = (v << 8) | p[n];
+
+  return v;
+}
+
+/*
+ * Flushes and closes the capture file.
+ */
+static void capture_close(void) {
+  if (capture_fp && (fclose(capture_fp) != 0)) {
+    fprintf(stderr, "%s: Error writing the capture file (%m).\n", tdr_progname);
+  }
+  capture_fp = NULL;
+}
+
+/*
+ * Starts capturing the USB traffic into file. The capture is completed
+ * on exit, also if the program stops on an error. Returns -1 if the file
+ * can't be written.
+ */
+int tdr_capture_open(const char *file) {
+  if (!(capture_fp = fopen(file, "wb"))) {
+    fprintf(stderr, "%s: Can't open capture file %s (%m).\n", tdr_progname, file);
+    return -1;
+  }
+  setvbuf(capture_fp, NULL, _IOFBF, 64 * 1024);
+
+  if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, capture_fp) != 1) {
+    failed("Error writing the capture file");
+    fclose(capture_fp);
+    capture_fp = NULL;
+    return -1;
+  }
+  atexit(capture_close);
+
+  return 0;
+}
+
+/*
+ * Appends a record of n bytes of data to the capture. The transfer started
+ * at start and ends now. A failed write ends the capture, not the
+ * transfer.
+ */
+static void capture_write(const struct tdr_dev *dev, int kind, int cmd, 
+			  int ret, unsigned long int size, 
+			  unsigned long long start, const unsigned char *data,
+			  int n) {
+  unsigned char hdr[CAPTURE_RECSIZE];
+
+  /* Failed reads have no data */
+  if ((kind == CAPTURE_READ) && (n > ret)) n = ret;
+  if (n < 0) n = 0;
+
+  memset(hdr, 0, sizeof(hdr));
+  hdr[0] = kind;
+  hdr[1] = cmd;
+  put_le(hdr + 2, dev->id, 2);
+  put_le(hdr + 4, (unsigned int)ret, 4);
+  put_le(hdr + 8, size, 4);
+  put_le(hdr + 16, start, 8);
+  put_le(hdr + 24, capture_time(), 8);
+
+  pthread_mutex_lock(&capture_lock);
+  if (capture_fp && ((fwrite(hdr, sizeof(hdr), 1, capture_fp) != 1) || 
+		     (n && (fwrite(data, n, 1, capture_fp) != 1)))) {
+    failed("Error writing the capture file");
+    fclose(capture_fp);
+    capture_fp = NULL;
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+/*
+ * Reads the next record of a capture. Returns 0 at the end of the file or
+ * of its intact part.
+ */
+static int capture_read(FILE *fp, struct tdr_record *rec) {
+  unsigned char hdr[CAPTURE_RECSIZE];
+  int n;
+
+  if (fread(hdr, sizeof(hdr), 1, fp) != 1) return 0;
+
+  rec->kind = hdr[0];
+  rec->cmd = hdr[1];
+  rec->recorder = get_le(hdr + 2, 2);
+  rec->ret = (int)get_le(hdr + 4, 4);
+  rec->size = get_le(hdr + 8, 4);
+  rec->start = get_le(hdr + 16, 8);
+  rec->end = get_le(hdr + 24, 8);
+
+  n = (rec->kind == CAPTURE_CTRL) ? rec->size : rec->ret;
+  if (n < 0) n = 0;
+  if ((n > MAXBUFSIZE) || ((n > 0) && (fread(rec->data, n, 1, fp) != 1))) {
+    fprintf(stderr, "%s: The capture file is truncated or corrupted.\n", 
+	    tdr_progname);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Opens a capture file and checks its magic. Returns NULL if it is not
+ * a capture file.
+ */
+static FILE *capture_open_read(const char *file) {
+  char magic[CAPTURE_MAGIC_LEN];
+  FILE *fp;
+
+  if (!(fp = fopen(file, "rb"))) {
+    fprintf(stderr, "%s: Can't open capture file %s (%m).\n", tdr_progname, file);
+    return NULL;
+  }
+  if ((fread(magic, sizeof(magic), 1, fp) != 1) || 
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+    fprintf(stderr, "%s: %s is not a capture file.\n", tdr_progname, file);
+    fclose(fp);
+    return NULL;
+  }
+
+  return fp;
+}
+
+/*
+ * Prints the latency histogram of every command type in a capture to
+ * stderr. The latency of a command runs from sending its report to the
+ * end of the read that returned its response; upload data count per read.
+ */
+static void capture_histogram(const char *file) {
+  struct tdr_record rec;
+  unsigned long int hist[CAPTURE_DATA + 1][CAPTURE_BUCKETS];
+  unsigned long int count[CAPTURE_DATA + 1], failed[CAPTURE_DATA + 1], peak;
+  double sum[CAPTURE_DATA + 1], min[CAPTURE_DATA + 1], max[CAPTURE_DATA + 1];
+  unsigned long long sent[TDR_MAX_DEVICES];
+  int cmd[TDR_MAX_DEVICES];
+  double us;
+  int i, j, k, slot;
+  FILE *fp;
+
+  if (!(fp = capture_open_read(file))) return;
+
+  memset(hist, 0, sizeof(hist));
+  memset(count, 0, sizeof(count));
+  memset(failed, 0, sizeof(failed));
+  for (i = 0; i <= CAPTURE_DATA; i++) {
+    sum[i] = max[i] = 0;
+    min[i] = -1;
+  }
+  for (i = 0; i < TDR_MAX_DEVICES; i++) cmd[i] = -1;
+
+  while (capture_read(fp, &rec)) {
+    k = rec.recorder % TDR_MAX_DEVICES;
+
+    if (rec.kind == CAPTURE_CTRL) {
+      cmd[k] = rec.cmd & 0xf;
+      sent[k] = rec.start;
+      continue;
+    }
+
+    /* A response of the pending command or upload data */
+    slot = CAPTURE_DATA;
+    us = (rec.end - rec.start) * 1e-3;
+    if ((cmd[k] >= 0) && 
+	((rec.ret < 0) || ((rec.ret == RESPONSE_BUFSIZE) && 
+			   (((rec.data[2] & 0xff) >> 4) == cmd[k])))) {
+      slot = cmd[k];
+      us = (rec.end - sent[k]) * 1e-3;
+      cmd[k] = -1;
+    }
+
+    if (rec.ret <= 0) {
+      failed[slot]++;
+      continue;
+    }
+
+    for (j = 0; (j < CAPTURE_BUCKETS - 1) && (us >= (2 << j)); j++);
+    hist[slot][j]++;
+    count[slot]++;
+    sum[slot] += us;
+    if ((min[slot] < 0) || (us < min[slot])) min[slot] = us;
+    if (us > max[slot]) max[slot] = us;
+  }
+
+  fclose(fp);
+
+  fprintf(stderr, "Latency histogram of %s\n", file);
+  for (i = 0; i <= CAPTURE_DATA; i++) {
+    if (!count[i] && !failed[i]) continue;
+
+    fprintf(stderr, "\n%s: %lu transfer(s), %lu failed", 
+	    capture_cmd_name[i], count[i], failed[i]);
+    if (count[i]) {
+      fprintf(stderr, ", min %.3f ms, mean %.3f ms, max %.3f ms", 
+	      min[i] * 1e-3, sum[i] / count[i] * 1e-3, max[i] * 1e-3);
+    }
+    fprintf(stderr, "\n");
+
+    for (j = 0, peak = 1; j < CAPTURE_BUCKETS; j++) {
+      if (hist[i][j] > peak) peak = hist[i][j];
+    }
+    for (j = 0; j < CAPTURE_BUCKETS; j++) {
+      if (!hist[i][j]) continue;
+      fprintf(stderr, "  %9lu - %9lu us |", j ? (1UL << j) : 0UL, 2UL << j);
+      for (k = 0; k < (int)(40 * hist[i][j] / peak) || (k == 0); k++) {
+	fputc('#', stderr);
+      }
+      fprintf(stderr, " %lu\n", hist[i][j]);
+    }
+  }
+}
+
+/*
+ * Waits for the given number of seconds.
+ */
+static void sim_sleep(double sec) {
+  struct timespec ts;
+
+  if (sec <= 0) return;
+  ts.tv_sec = (time_t)sec;
+  ts.tv_nsec = (long)((sec - ts.tv_sec) * 1e9);
+  while ((nanosleep(&ts, &ts) < 0) && (errno == EINTR));
+}
+
+/*
+ * Simulated transport: answers an output report.
+ */
+static int sim_send(struct tdr_dev *dev, const char *report, int size) {
+  struct tdr_sim *sim = dev->sim;
+  unsigned char *r = sim->response;
+  unsigned long int usage, cap;
+  int cmdtype = (report[2] & 0xff) >> 4;
+
+  memset(r, 0, RESPONSE_BUFSIZE);
+  r[0] = 0x01;
+  r[1] = CTRL_COMMAND_SUCCESS;
+  r[2] = cmdtype << 4;
+
+  switch (cmdtype) {
+  case EEPROM_USAGE:
+    usage = sim->size;
+    r[2] |= (usage >> 16) & 0xf;
+    r[3] = usage & 0xff;
+    r[4] = (usage >> 8) & 0xff;
+    break;
+  case EEPROM_CAPACITY:
+    cap = ((sim->size > SIM_EEPROM_CAPACITY) ? sim->size : SIM_EEPROM_CAPACITY) - 1;
+    r[3] = cap & 0xff;
+    r[4] = (cap >> 8) & 0xff;
+    r[5] = (cap >> 16) & 0xff;
+    break;
+  case FW_VERSION:
+    r[3] = SIM_FW_VERSION & 0xff;
+    r[4] = (SIM_FW_VERSION >> 8) & 0xff;
+    r[5] = (SIM_FW_VERSION >> 16) & 0xff;
+    break;
+  case DATA_UPLOAD:
+    sim->upload = 1;
+    sim->pos = 0;
+    break;
+  case UPLOAD_CANCEL:
+  case UPLOAD_DONE:
+    sim->upload = 0;
+    break;
+  case EEPROM_CLEAR:
+    /* An empty EEPROM holds just the zeroed access table */
+    sim->size = TIMEXDR_ATABLESIZE;
+    memset(sim->image, 0, sim->size);
+    break;
+  default:
+    break;
+  }
+
+  sim->pending = 1;
+
+  return size;
+}
+
+/*
+ * Simulated transport: interrupt read. A pending response comes first,
+ * then the running upload. Each EEPROM page costs the configured latency
+ * plus its transfer time at the configured rate. A read with nothing to
+ * deliver times out after the full timeout.
+ */
+static int sim_read(struct tdr_dev *dev, unsigned char *buf, int size, 
+		    int timeout) {
+  struct tdr_sim *sim = dev->sim;
+  unsigned long int raw, p;
+  int n = 0;
+
+  if (sim->pending) {
+    sim->pending = 0;
+    n = (size < RESPONSE_BUFSIZE) ? size : RESPONSE_BUFSIZE;
+    memcpy(buf, sim->response, n);
+    return n;
+  }
+
+  raw = sim->size + (sim->size + DATA_PAGESIZE - 1) / DATA_PAGESIZE;
+
+  if (!sim->upload || (sim->pos >= raw) || 
+      (!sim->failed && (sim->fail_page >= 0) && 
+       (sim->pos >= (unsigned long int)sim->fail_page * EEPROM_PAGESIZE))) {
+    if (sim->upload && (sim->pos < raw)) sim->failed = 1;
+    sim_sleep(timeout * 1e-3);
+    errno = ETIMEDOUT;
+    return -ETIMEDOUT;
+  }
+
+  if (sim->pos % EEPROM_PAGESIZE == 0) sim_sleep(sim->latency);
+
+  /* Every page starts with the transfer control byte */
+  for (; (n < size) && (sim->pos < raw); n++, sim->pos++) {
+    p = sim->pos;
+    buf[n] = (p % EEPROM_PAGESIZE == 0) ? 0x02 : 
+      sim->image[(p / EEPROM_PAGESIZE) * DATA_PAGESIZE + p % EEPROM_PAGESIZE - 1];
+  }
+
+  if (sim->rate > 0) sim_sleep(n / sim->rate);
+
+  return n;
+}
+
+static int sim_close(struct tdr_dev *dev) {
+  free(dev->sim->image);
+  free(dev->sim);
+
+  return 0;
+}
+
+static const struct tdr_transport sim_transport = {
+  "simulator", sim_send, sim_read, download_pass_sync, sim_close
+};
+
+/*
+ * Loads the EEPROM image of the simulator. The image holds the EEPROM data
+ * as binary, or as the text dump printed by the -e option. Returns -1 if
+ * it can't be loaded.
+ */
+static int sim_load_image(struct tdr_sim *sim, const char *file) {
+  unsigned long int addr, alloc = 0;
+  unsigned int b;
+  char line[MAXBUFSIZE], *p;
+  unsigned char *image;
+  int n, text, nomem = 0;
+  FILE *fp;
+
+  if (!(fp = fopen(file, "r"))) {
+    fprintf(stderr, "%s: Can't open EEPROM image %s (%m).\n", tdr_progname, file);
+    return -1;
+  }
+
+  /* A text dump starts with an empty line and "00000000:" */
+  text = fgets(line, sizeof(line), fp) && (line[0] == '\n') && 
+    fgets(line, sizeof(line), fp) && (strncmp(line, "00000000:", 9) == 0);
+  rewind(fp);
+
+  sim->size = 0;
+  sim->image = NULL;
+
+  if (text) {
+    while (!nomem && fgets(line, sizeof(line), fp)) {
+      if (sscanf(line, "%lx:%n", &addr, &n) < 1) continue;
+      for (p = line + n; sscanf(p, "%2x%n", &b, &n) == 1; p += n, addr++) {
+	if (addr >= alloc) {
+	  alloc = 2 * (addr + 1);
+	  if (!(image = realloc(sim->image, alloc))) {
+	    nomem = 1;
+	    break;
+	  }
+	  sim->image = image;
+	}
+	sim->image[addr] = b;
+	if (addr >= sim->size) sim->size = addr + 1;
+      }
+    }
+  } else {
+    do {
+      alloc += MAXBUFSIZE * 16;
+      if (!(image = realloc(sim->image, alloc))) {
+	nomem = 1;
+	break;
+      }
+      sim->image = image;
+      sim->size += fread(sim->image + sim->size, 1, alloc - sim->size, fp);
+    } while (sim->size == alloc);
+  }
+
+  fclose(fp);
+
+  if (nomem) {
+    failed("Couldn't allocate memory");
+    free(sim->image);
+    return -1;
+  }
+  if (sim->size < TIMEXDR_ATABLESIZE) {
+    fprintf(stderr, "%s: %s is not an EEPROM image.\n", tdr_progname, file);
+    free(sim->image);
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Opens the simulated recorder described by the simulate option:
+ * IMAGE[,LATENCY[,RATE[,FAIL_PAGE]]] with the page latency in ms, the
+ * throughput in bytes/s (0 is unlimited) and the number of a page whose
+ * first read times out. Returns -1 if the image can't be loaded.
+ */
+static int timexdr_open_sim(struct tdr_dev *tdr) {
+  struct tdr_sim *sim;
+  char *spec = NULL, *field[4] = {NULL, NULL, NULL, NULL};
+  int i;
+
+  if (!(sim = calloc(1, sizeof(*sim))) || !(spec = strdup(tdr->opt->simulate))) {
+    free(sim);
+    return failed("Couldn't allocate memory");
+  }
+
+  field[0] = spec;
+  for (i = 1; i < 4; i++) {
+    if (!(field[i] = strchr(field[i - 1], ','))) break;
+    *field[i]++ = '\0';
+  }
+
+  if (sim_load_image(sim, field[0]) < 0) {
+    free(spec);
+    free(sim);
+    return -1;
+  }
+  sim->latency = field[1] ? atof(field[1]) * 1e-3 : 0;
+  sim->rate = field[2] ? atof(field[2]) : 0;
+  sim->fail_page = field[3] ? atol(field[3]) : -1;
+
+  tdr->transport = &sim_transport;
+  tdr->sim = sim;
+
+  snprintf(tdr->info->vendor, sizeof(tdr->info->vendor), "Timex (simulated)");
+  snprintf(tdr->info->product, sizeof(tdr->info->product), 
+	   "Timex Data Recorder");
+  snprintf(tdr->info->serial, sizeof(tdr->info->serial), "SIM");
+
+  if (tdr->opt->verbosity) {
+    printf("Simulated recorder: %s (%lu bytes), %.1f ms/page, ", 
+	   field[0], sim->size, sim->latency * 1e3);
+    if (sim->rate > 0) {
+      printf("%.0f bytes/s\n", sim->rate);
+    } else {
+      printf("unlimited rate\n");
+    }
+  }
+
+  free(spec);
+
+  return 0;
+}
+
+/*
+ * Replay transport: loads the next record of the replayed recorder.
+ * Returns 0 at the end of the capture.
+ */
+static int replay_next(struct tdr_replay *rp) {
+  while (!rp->have && capture_read(rp->fp, &rp->rec)) {
+    rp->have = (rp->rec.recorder == rp->recorder);
+  }
+
+  return rp->have;
+}
+
+/*
+ * Replay transport: the report must match the next recorded one. Reads
+ * that the replayed download did not repeat are skipped. Returns -1 if
+ * the capture has another command or ended.
+ */
+static int replay_send(struct tdr_dev *dev, const char *report, int size) {
+  struct tdr_replay *rp = dev->replay;
+  int cmdtype = (report[2] & 0xff) >> 4;
+
+  while (replay_next(rp)) {
+    rp->have = 0;
+    if (rp->rec.kind != CAPTURE_CTRL) {
+      rp->skipped++;
+      continue;
+    }
+    if (rp->rec.cmd != cmdtype) {
+      fprintf(stderr, "%s: Replay: sent command %d, the capture has %d.\n", 
+	      tdr_progname, cmdtype, rp->rec.cmd);
+      errno = EPROTO;
+      return -1;
+    }
+    return rp->rec.ret;
+  }
+
+  fprintf(stderr, "%s: Replay: the capture ended before the command.\n",
+	  tdr_progname);
+  errno = EPROTO;
+  return -1;
+}
+
+/*
+ * Replay transport: returns the next recorded read. If the capture has a
+ * report next, the read times out.
+ */
+static int replay_read(struct tdr_dev *dev, unsigned char *buf, int size, 
+		       int timeout) {
+  struct tdr_replay *rp = dev->replay;
+  int n;
+
+  if (!replay_next(rp) || (rp->rec.kind != CAPTURE_READ)) {
+    errno = ETIMEDOUT;
+    return -ETIMEDOUT;
+  }
+  rp->have = 0;
+
+  if ((n = rp->rec.ret) < 0) {
+    errno = -n;
+    return n;
+  }
+  if (n > size) n = size;
+  memcpy(buf, rp->rec.data, n);
+
+  return n;
+}
+
+static int replay_close(struct tdr_dev *dev) {
+  if (dev->replay->skipped && dev->opt->verbosity) {
+    printf("Replay skipped %lu record(s)\n", dev->replay->skipped);
+  }
+  fclose(dev->replay->fp);
+  free(dev->replay);
+
+  return 0;
+}
+
+static const struct tdr_transport replay_transport = {
+  "replay", replay_send, replay_read, download_pass_sync, replay_close
+};
+
+/*
+ * Prints the latency histogram of the capture replayed from replay_file.
+ */
+void tdr_replay_report(const char *replay_file) {
+  char *file, *p;
+
+  if ((file = strdup(replay_file))) {
+    if ((p = strrchr(file, ','))) *p = '\0';
+    capture_histogram(file);
+    free(file);
+  }
+}
+
+/*
+ * Opens the replay of the capture of the replay_file option:
+ * FILE[,RECORDER] where
+ * RECORDER selects one of the recorders of a multi-device capture.
+ * Returns -1 if the capture can't be read.
+ */
+static int timexdr_open_replay(struct tdr_dev *tdr) {
+  struct tdr_replay *rp;
+  char *file = NULL, *p;
+
+  if (!(rp = calloc(1, sizeof(*rp))) || !(file = strdup(tdr->opt->replay_file))) {
+    free(rp);
+    return failed("Couldn't allocate memory");
+  }
+  if ((p = strrchr(file, ','))) {
+    *p++ = '\0';
+    rp->recorder = atoi(p);
+  }
+
+  if (!(rp->fp = capture_open_read(file))) {
+    free(file);
+    free(rp);
+    return -1;
+  }
+
+  tdr->transport = &replay_transport;
+  tdr->replay = rp;
+
+  snprintf(tdr->info->vendor, sizeof(tdr->info->vendor), "Timex (replay)");
+  snprintf(tdr->info->product, sizeof(tdr->info->product), 
+	   "Timex Data Recorder");
+  snprintf(tdr->info->serial, sizeof(tdr->info->serial), "REPLAY");
+
+  if (tdr->opt->verbosity) printf("Replaying recorder %d of %s\n", rp->recorder, file);
+
+  free(file);
+
+  return 0;
+}
+
+/*
+ * Sets the options to their defaults: a text listing on stdout in
+ * kilometers, decoded on one thread after the download.
+ */
+void tdr_options_init(struct tdr_options *opt) {
+  memset(opt, 0, sizeof(*opt));
+  opt->units = 1;
+  opt->sink = &tdr_text_sink;
+  opt->compress = TDR_COMPRESS_NONE;
+  opt->jobs = 1;
+  opt->async_transfers = TDR_ASYNC_TRANSFERS;
+}
+
+/*
+ * Opens and initializes the n-th device (the last one if n is negative)
+ * with the options opt and stores its description in info. The number of
+ * attached recorders is stored in count unless it is NULL. A capture is
+ * replayed if replay_file is set and the simulated recorder is used if
+ * simulate is set, otherwise the asynchronous libusb-1.0 backend is used
+ * when available unless async_transfers is zero. Returns NULL if the
+ * device can't be opened.
+ */ 
+struct tdr_dev *tdr_open(int n, struct tdr_info *info, int *count,
+			 const struct tdr_options *opt) {
+  struct tdr_dev *tdr;
+  int found = 0, ret;
+
+  if (!(tdr = calloc(1, sizeof(*tdr)))) {
+    failed("Couldn't allocate memory");
+    return NULL;
+  }
+  tdr->info = info;
+  tdr->opt = opt;
+  tdr->id = (n < 0) ? 0 : n;
+
+  if (opt->replay_file) {
+    ret = timexdr_open_replay(tdr);
+    found = 1;
+  } else if (opt->simulate) {
+    ret = timexdr_open_sim(tdr);
+    found = 1;
+  } else
+#if TDR_LIBUSB1
+  if (opt->async_transfers > 0) {
+    ret = timexdr_open_async(tdr, n, &found);
+  } else
+#endif
+  {
+    tdr->transport = &usb0_transport;
+    tdr->udev = timexdr_open_sync(tdr, n, &found);
+    ret = tdr->udev ? 0 : -1;
+  }
+
+  if (count) *count = found;
+
+  if (ret < 0) {
+    free(tdr);
+    return NULL;
+  }
+
+  return tdr;
+}
+
+/*
+ * Interrupt read from the device. Returns a negative value on failure.
+ */
+static int timex_int_xfer(struct tdr_dev *dev, unsigned char *buf, int size, 
+			  int timeout) {
+  unsigned long long start = 0;
+  int ret;
+
+  errno = 0;
+
+  if (capture_fp) start = capture_time();
+
+  ret = dev->transport->read(dev, buf, size, timeout);
+
+  if (capture_fp) {
+    capture_write(dev, CAPTURE_READ, CAPTURE_NOCMD, ret, size, start, buf, ret);
+  }
+
+  if ((dev->opt->verbosity > 5) && (ret <= TIMEXDR_CTRL_SIZE)) {
+    printf("Received (%d):\t", ret);
+    {
+      int i;
+      
+      for (i=0; (ret<10) && (i<ret); i++) {
+	printf("%02x ", buf[i] & 0xff);
+      }
+      printf("\n");
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * Interrupt read from the device. Returns -1 if it failed.
+ */
+static int timex_int_read(struct tdr_dev *dev, unsigned char *buf, int size, 
+			  int timeout) {
+  int ret;
+
+  if ((ret = timex_int_xfer(dev, buf, size, timeout)) < 0) {
+    /* The return code is often negative when reading the main data from the
+     * device. It seems to be related to the length of the timeout. 
+     * Try setting it larger.
+     */
+    //printf("Interrupt read (%d: %m) (%s).\n", errno, usb_strerror());
+    return failed("Interrupt read timeout");
+  } 
+
+  return ret;
+}
+
+/*
+ * Check the response to a control command for command failure or command type
+ * mismatch. Returns -1 if the command failed.
+ */
+static int check_response(char cmdtype, unsigned char *buf) {
+  if ((buf[1] & 0xff) != CTRL_COMMAND_SUCCESS) {
+    fprintf(stderr, "Error: Control command %u failed with code %02x.\n", 
+	    cmdtype, buf[1] & 0xff);
+    return -1;
+  }
+  if (((buf[2] & 0xff) >> 4) != cmdtype) {
+    fprintf(stderr, "Error: Return message command type mismatch.\n");
+    fprintf(stderr, "Error: Sent command %u, received response from command %u.\n", 
+	    cmdtype, (buf[2] & 0xff) >> 4);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Prepare the control command (output report) to be sent to the device
+ * Inputs: ctrl_cmd - the report, TIMEXDR_CTRL_SIZE bytes
+ *         cmdtype - specify command type as defined in the header file
+ *         micro - optional, specify which microcontroller is the recipient. 
+ *                 If cmdtype=MODIFY_BOND_OPTION, then micro contains the settings
+ *                 data that will be passed to the device.
+ * Returns -1 if the command type is unknown.
+ */
+
+static int prepare_cmd(char *ctrl_cmd, char cmdtype, char micro) {
+  int n = 1;   // number of bytes to send
+  int cs= 0;   // checksum
+
+  /* Report number */
+  ctrl_cmd[0] = 0x01;
+  /* Most of the commands send only 1 byte so this is a good default */
+  ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n); 
+
+  switch (cmdtype) {
+  case EEPROM_USAGE:
+    ctrl_cmd[1] = CMD_EEPROM_USAGE; 
+    break;
+  case EEPROM_CLEAR:
+  case UPLOAD_CANCEL:
+  case UPLOAD_DONE:
+  case SW_TIMEOUT:
+  case EEPROM_TEST:
+  case RESTORE_BOND_OPTION:
+    /* Command 0x40 */
+    ctrl_cmd[1] = CMD_EEPROM_CLEAR;
+    break;
+  case DATA_UPLOAD:
+    ctrl_cmd[1] = CMD_DATA_UPLOAD;
+    break;
+  case SYNC_TIME:
+    /* Synchronize device's clock with PC (use localtime) */
+    ctrl_cmd[1] = CMD_SYNC_TIME;
+    n = 7;   // Send 7 bytes
+    {
+      struct tm tm, *sys_time = &tm;
+      time_t tp;
+
+      tp = time(NULL);
+      localtime_r(&tp, sys_time);
+      
+      ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n);
+      ctrl_cmd[3] = (char) sys_time->tm_sec;
+      ctrl_cmd[4] = (char) sys_time->tm_min;
+      ctrl_cmd[5] = (char) sys_time->tm_hour;
+      ctrl_cmd[6] = (char) (sys_time->tm_mday - 1);
+      ctrl_cmd[7] = (char) sys_time->tm_mon;
+      ctrl_cmd[8] = (char) (sys_time->tm_year - 100);
+      cs = ctrl_cmd[3] + ctrl_cmd[4] + ctrl_cmd[5] 
+	+ ctrl_cmd[6] + ctrl_cmd[7] + ctrl_cmd[8] ;
+    }
+    break;
+  case FW_VERSION:
+    /* Default microcontroller is MAIN_MICRO */
+    ctrl_cmd[1] = (micro == USB_MICRO) ? 
+      CMD_FW_VERSION_USB_MICRO : CMD_FW_VERSION_MAIN_MICRO;
+    break;
+  case ROM_TEST:
+  case RAM_TEST:
+    ctrl_cmd[1] = (micro == USB_MICRO) ?
+      CMD_ROM_TEST_USB_MICRO : CMD_ROM_TEST_MAIN_MICRO;
+    break;
+  case READ_BOND_OPTION:
+    ctrl_cmd[1] = CMD_READ_BOND_OPTION;
+    break;
+  case MODIFY_BOND_OPTION:
+    /* Note that micro contains the data to pass to the device */
+    n = 2;                      // bytes to send
+    ctrl_cmd[1] = CMD_MODIFY_BOND_OPTION;
+    ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n);
+    ctrl_cmd[3] = 3 + micro;    // first two bits must be set
+    cs += ctrl_cmd[3];
+    break;
+  case EEPROM_CAPACITY:
+    ctrl_cmd[1] = CMD_EEPROM_CAPACITY;
+    break;
+  case RAM_ROM_DEBUG:
+    ctrl_cmd[1] = CMD_RAM_ROM_DEBUG;
+    break;
+  default:
+    fprintf(stderr, "%s: prepare_cmd: Unknown command type %d.\n", 
+	    tdr_progname, cmdtype);
+    return -1;
+  }
+
+  /* Calculate the checksum */
+  cs += (int) ctrl_cmd[2];
+  ctrl_cmd[n+2] = ( ~cs + 1 ) % 256;
+
+  /* Fill up the rest of ctrl_cmd with zeros */
+  /* Not needed for functionality but convenient for debugging */
+  { 
+    int i;
+    for (i=n+3; i<TIMEXDR_CTRL_SIZE; i++) {
+      ctrl_cmd[i] = 0x0; 
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Sends the output report of cmdtype to the device's microcontroller micro
+ * without waiting for the response.
+ */
+static int timex_ctrl_send(struct tdr_dev *dev, char cmdtype, char micro) {
+  char ctrl_cmd[TIMEXDR_CTRL_SIZE];
+  unsigned long long start = 0;
+  int ret;
+
+  /* Prepare the control message (output report) */
+  if (prepare_cmd(ctrl_cmd, cmdtype, micro) < 0) return -1;
+
+  if (capture_fp) start = capture_time();
+
+  /* Send the report */
+  ret = dev->transport->send(dev, ctrl_cmd, TIMEXDR_CTRL_SIZE);
+
+  if (capture_fp) {
+    capture_write(dev, CAPTURE_CTRL, cmdtype, ret, TIMEXDR_CTRL_SIZE, start, 
+		  (unsigned char *)ctrl_cmd, TIMEXDR_CTRL_SIZE);
+  }
+
+  if (dev->opt->verbosity > 5) {
+    printf("Cmd sent (%d):\t", ret);
+    {
+      int i;
+	
+      for (i=0; i<ret; i++) {
+	printf("%02x ", ctrl_cmd[i] & 0xff);
+      }
+      printf((ret < 0) ? "failed\n" : "\n");
+    }
+  }
+
+  return ret;
+}
+
+/*
+ * Sends a control message of cmdtype to the device's microcontroller micro.
+ * Returns -1 if the command failed.
+ */
+static int timex_ctrl(struct tdr_dev *dev, char cmdtype, char micro,  
+		      unsigned char *buf, int bufsize) {
+  int ret;
+
+  ret = timex_ctrl_send(dev, cmdtype, micro);
+
+  if (ret == TIMEXDR_CTRL_SIZE) {
+    if ((ret = timex_int_read(dev, buf, bufsize, TIMEXDR_CTRL_TIMEOUT)) < 0) {
+      return -1;
+    }
+    if (ret != 7) {
+      fprintf(stderr, "Error: Expected response size 7 bytes, received %i.\n", 
+	      ret);
+      return -1;
+    }
+    if (check_response(cmdtype, buf) < 0) return -1;
+  } else {
+    fprintf(stderr, "Error: Sent only %i of %i bytes.\n", ret, TIMEXDR_CTRL_SIZE);
+    return -1;
+  }
+
+  return ret;
+}
+
+/*
+ * Sets the recorder clock to the time of the computer. Returns -1 if
+ * the recorder did not take it.
+ */
+int tdr_sync_time(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+
+  return (timex_ctrl(dev, SYNC_TIME, 0, buf, RESPONSE_BUFSIZE) < 0) ? -1 : 0;
+}
+
+/*
+ * Get the firmware version of the device's main microcontroller and write it
+ * into the device info
+ */
+static int get_fw_version(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+
+  if (timex_ctrl(dev, FW_VERSION, MAIN_MICRO, buf, RESPONSE_BUFSIZE) < 0) {
+    return -1;
+  }
+  dev->info->fw_main = DEC_FW_VER(buf[3], buf[4], buf[5]);
+  if (timex_ctrl(dev, FW_VERSION, USB_MICRO, buf, RESPONSE_BUFSIZE) < 0) {
+    return -1;
+  }
+  dev->info->fw_usb = DEC_FW_VER(buf[3], buf[4], buf[5]);
+
+  if (dev->opt->verbosity) printf("Firmware version:\tMain:\t%li\n\t\t\tUSB:\t%li\n", 
+			dev->info->fw_main, dev->info->fw_usb);
+  return 0;
+}
+
+/*
+ * Get the EEPROM size and write it into the device info
+ */
+static int get_eeprom_size(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+
+  if (timex_ctrl(dev, EEPROM_CAPACITY, DEFAULT_MICRO, buf, 
+		 RESPONSE_BUFSIZE) < 0) {
+    return -1;
+  }
+  dev->info->eeprom_size = (long int) (buf[3] + (buf[4] << 8) + 
+				       (buf[5] << 16)) + 1;
+
+  if (dev->opt->verbosity) printf("EEPROM size:\t%li bytes (%li kB)\n", 
+			dev->info->eeprom_size, dev->info->eeprom_size/1024);
+  return 0;
+}
+
+/*
+ * Set the initial time of the options for session download. The parameter
+ * is number of days before now. The initial time is (now - days) adjusted
+ * down to the midnight.
+ */
+void tdr_set_days(struct tdr_options *opt, time_t days) {
+  struct tm btime;
+
+  opt->initial_time = time(NULL) - days*86400;
+  localtime_r(&opt->initial_time, &btime);
+  btime.tm_sec = 0;
+  btime.tm_min = 0;
+  btime.tm_hour = 0;
+  opt->initial_time = mktime(&btime);
+}
+
+/*
+ * Return 1 if the session time stamp is newer than the initial time of
+ * the options
+ */
+static int newer_session(const struct tdr_options *opt, 
+			 const struct tdr_header *ses_time) {
+  struct tm btime;
+  time_t sys_time;
+
+  if (opt->initial_time == 0) {
+    return 1;
+  }
+  sys_time = time(NULL);
+  localtime_r(&sys_time, &btime); 
+  btime.tm_sec = ses_time->sec;
+  btime.tm_min = ses_time->min;
+  btime.tm_hour = ses_time->hour;
+  btime.tm_mday = ses_time->day;
+  btime.tm_mon = ses_time->month - 1;
+  btime.tm_year = ses_time->year - 1900;
+  
+  return mktime(&btime) >= opt->initial_time;
+}
+
+/*
+ * Calculates number of pages of size "psize" for given number of bytes.
+ */
+static unsigned long int num_of_pages(const unsigned long int bytes, 
+				      const int psize) {
+  return bytes / psize
+    + ( (bytes % psize) == 0 ? 0 : 1);
+}
+
+/* 
+ * Find how many bytes are used in the TDR's EEPROM for data. Note that
+ * the address of last byte as returned by the control command is NOT the
+ * total number of bytes transferred because there is an extra byte 0x02 at the 
+ * beginning of each 255 bytes of data. Returns -1 if the command failed.
+ */
+static long int eeprom_usage(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+  unsigned long int bytes;
+
+  if (timex_ctrl(dev, EEPROM_USAGE, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE) < 0) {
+    return -1;
+  }
+  bytes = DEC_EEPROM_USAGE(buf[2], buf[3], buf[4]);
+
+  if (dev->opt->verbosity) {
+    printf("EEPROM used:\t%lu bytes (%lu%% in use)\n", bytes, 
+	   (bytes + 1)*100/dev->info->eeprom_size);
+  }
+
+  return bytes + num_of_pages(bytes, DATA_PAGESIZE);
+}
+
+/*
+ * Reads the firmware versions and the EEPROM size of the recorder into
+ * its device info and reports the EEPROM usage. Returns -1 if the
+ * recorder did not answer.
+ */
+int tdr_read_info(struct tdr_dev *dev) {
+  if ((get_fw_version(dev) < 0) || (get_eeprom_size(dev) < 0) ||
+      (eeprom_usage(dev) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Returns the number of seconds elapsed since t0.
+ */
+static double elapsed_time(const struct timespec *t0) {
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) * 1e-9;
+}
+
+/*
+ * Returns the timeout in miliseconds for a read that completes after depth
+ * more pages. It adapts to the throughput observed so far.
+ */
+static int download_timeout(const struct tdr_download *dl, int depth) {
+  double t;
+
+  if (dl->npages == 0) {
+    return depth * TIMEXDR_PAGE_TIMEOUT;
+  }
+
+  t = TDR_TIMEOUT_MARGIN * dl->page_time * 1000 * depth;
+
+  return (t < TIMEXDR_CTRL_TIMEOUT) ? TIMEXDR_CTRL_TIMEOUT : (int) t;
+}
+
+/*
+ * Records the completion of a page in the current pass.
+ */
+static void download_page_done(struct tdr_download *dl, unsigned long int page) {
+  double dt;
+
+  dt = elapsed_time(&dl->mark);
+  clock_gettime(CLOCK_MONOTONIC, &dl->mark);
+
+  if (dl->received[page]) {
+    /* Received again after a restart */
+    dl->retried++;
+    dl->retry_time += dt;
+    return;
+  }
+
+  dl->received[page] = 1;
+  dl->npages++;
+  dl->page_time = (dl->npages == 1) ? dt : 0.875 * dl->page_time + 0.125 * dt;
+
+  if (dl->page_done) dl->page_done(page, dl->arg);
+}
+
+/*
+ * Stores n bytes received at the current position of the pass. Data of the
+ * pages that are already in the buffer are dropped.
+ */
+static void download_store(struct tdr_download *dl, const unsigned char *data,
+			   unsigned long int n) {
+  unsigned long int page, end, len;
+
+  while (n > 0) {
+    page = dl->pos / EEPROM_PAGESIZE;
+    end = (page + 1) * EEPROM_PAGESIZE;
+    if (end > dl->size) end = dl->size;
+
+    len = (n < end - dl->pos) ? n : end - dl->pos;
+    if (!dl->received[page]) memcpy(dl->buf + dl->pos, data, len);
+
+    dl->pos += len;
+    data += len;
+    n -= len;
+
+    if (dl->pos == end) download_page_done(dl, page);
+  }
+}
+
+/*
+ * One pass of the blocking download: reads the upload page by page.
+ * Returns -1 if a read fails.
+ */
+static int download_pass_sync(struct tdr_dev *dev, struct tdr_download *dl) {
+  unsigned char page[EEPROM_PAGESIZE];
+  unsigned long int len;
+  int ret;
+
+  while (dl->pos < dl->limit) {
+    len = EEPROM_PAGESIZE - dl->pos % EEPROM_PAGESIZE;
+    if (len > dl->limit - dl->pos) len = dl->limit - dl->pos;
+
+    if ((ret = timex_int_xfer(dev, page, len, download_timeout(dl, 1))) <= 0) {
+      return -1;
+    }
+    download_store(dl, page, ret);
+  }
+
+  return 0;
+}
+
+#if TDR_LIBUSB1
+/*
+ * Queues transfer i for the next part of an asynchronous download. A
+ * transfer that can't be queued fails the pass.
+ */
+static int async_submit(struct tdr_async *as, int i) {
+  unsigned long int len = as->dl->limit - as->dl->pos - as->pending;
+
+  if (len > EEPROM_PAGESIZE) len = EEPROM_PAGESIZE;
+
+  as->xfer[i]->length = len;
+  as->xfer[i]->timeout = download_timeout(as->dl, as->in_flight + 1);
+  if (capture_fp) clock_gettime(CLOCK_MONOTONIC, &as->start[i]);
+  if (libusb_submit_transfer(as->xfer[i]) < 0) {
+    as->status = LIBUSB_TRANSFER_ERROR;
+    return failed("Couldn't submit an interrupt transfer");
+  }
+  as->pending += len;
+  as->busy[i] = 1;
+  as->in_flight++;
+
+  return 0;
+}
+
+/*
+ * Cancels the transfers still queued in a failed pass.
+ */
+static void async_cancel(struct tdr_async *as) {
+  int i;
+
+  for (i = 0; i < as->ntransfers; i++) {
+    if (as->busy[i]) libusb_cancel_transfer(as->xfer[i]);
+  }
+}
+
+/*
+ * Completion handler of the asynchronous download. Transfers on one
+ * endpoint complete in the order of submission so the received data are
+ * simply appended to the download.
+ */
+static void LIBUSB_CALL async_read_done(struct libusb_transfer *xfer) {
+  struct tdr_async *as = (struct tdr_async *)xfer->user_data;
+  int i;
+
+  for (i = 0; as->xfer[i] != xfer; i++);
+  as->busy[i] = 0;
+  as->in_flight--;
+  as->pending -= xfer->length;
+
+  if (capture_fp) {
+    capture_write(as->dev, CAPTURE_READ, CAPTURE_NOCMD, 
+		  (xfer->status == LIBUSB_TRANSFER_COMPLETED) ? 
+		  xfer->actual_length : 
+		  (xfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? -ETIMEDOUT : 
+		  (xfer->status == LIBUSB_TRANSFER_CANCELLED) ? -ECANCELED : -EIO,
+		  xfer->length, 
+		  as->start[i].tv_sec * 1000000000ULL + as->start[i].tv_nsec,
+		  xfer->buffer, xfer->actual_length);
+  }
+
+  /* Once a transfer has failed, the data of the later ones belong after
+   * the bytes it lost: they are dropped and the restart reads them again.
+   * A failed transfer may still have delivered some data, as in
+   * usb1_read().
+   */
+  if (as->status == LIBUSB_TRANSFER_COMPLETED) {
+    if (xfer->actual_length > 0) {
+      download_store(as->dl, xfer->buffer, xfer->actual_length);
+    }
+    if ((xfer->status != LIBUSB_TRANSFER_COMPLETED) && 
+	(as->dl->pos < as->dl->limit)) {
+      as->status = xfer->status;
+    }
+  }
+
+  /* Give up on a failed pass: cancel whatever is still queued */
+  if ((as->status == LIBUSB_TRANSFER_COMPLETED) &&
+      (as->dl->pos + as->pending < as->dl->limit)) {
+    async_submit(as, i);
+  }
+  if (as->status != LIBUSB_TRANSFER_COMPLETED) async_cancel(as);
+}
+
+/*
+ * One pass of the asynchronous download with up to async_transfers (an
+ * option of the device) interrupt transfers in flight. Returns -1 if a transfer fails.
+ */
+static int download_pass_async(struct tdr_dev *dev, struct tdr_download *dl) {
+  struct tdr_async as;
+  struct timeval tv;
+  int i;
+
+  as.dl = dl;
+  as.dev = dev;
+  as.pending = 0;
+  as.ntransfers = dev->opt->async_transfers;
+  as.in_flight = 0;
+  as.status = LIBUSB_TRANSFER_COMPLETED;
+
+  as.xfer = calloc(as.ntransfers, sizeof(*as.xfer));
+  as.busy = calloc(as.ntransfers, sizeof(*as.busy));
+  as.start = calloc(as.ntransfers, sizeof(*as.start));
+  if (!as.xfer || !as.busy || !as.start) {
+    failed("Couldn't allocate memory");
+    as.status = LIBUSB_TRANSFER_ERROR;
+    as.ntransfers = 0;
+  }
+
+  for (i = 0; i < as.ntransfers; i++) {
+    if (!(as.xfer[i] = libusb_alloc_transfer(0)) || 
+	!(as.xfer[i]->buffer = malloc(EEPROM_PAGESIZE))) {
+      failed("Couldn't allocate memory");
+      as.status = LIBUSB_TRANSFER_ERROR;
+      if (as.xfer[i]) libusb_free_transfer(as.xfer[i]);
+      as.ntransfers = i;
+      break;
+    }
+    libusb_fill_interrupt_transfer(as.xfer[i], dev->handle, TIMEXDR_EP,
+				   as.xfer[i]->buffer, EEPROM_PAGESIZE, 
+				   async_read_done, &as, TIMEXDR_PAGE_TIMEOUT);
+  }
+
+  for (i = 0; (as.status == LIBUSB_TRANSFER_COMPLETED) && 
+	 (i < as.ntransfers) && (dl->pos + as.pending < dl->limit); i++) {
+    if (async_submit(&as, i) < 0) async_cancel(&as);
+  }
+
+  /* Completion-driven event loop */
+  while (as.in_flight > 0) {
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    libusb_handle_events_timeout_completed(dev->ctx, &tv, NULL);
+  }
+
+  for (i = 0; i < as.ntransfers; i++) {
+    free(as.xfer[i]->buffer);
+    libusb_free_transfer(as.xfer[i]);
+  }
+  free(as.xfer);
+  free(as.busy);
+  free(as.start);
+
+  return (as.status == LIBUSB_TRANSFER_COMPLETED) ? 0 : -1;
+}
+#endif
+
+/*
+ * Cancels a running upload. Data still on the way are read and dropped
+ * until the cancel command is answered. Returns -1 if it can't be sent.
+ */
+static int download_cancel(struct tdr_dev *dev) {
+  unsigned char buf[EEPROM_PAGESIZE];
+  int i, ret;
+
+  if (timex_ctrl_send(dev, UPLOAD_CANCEL, DEFAULT_MICRO) != TIMEXDR_CTRL_SIZE) {
+    return failed("Couldn't cancel the upload");
+  }
+
+  for (i = 0; i < TDR_MAX_RESTARTS * DATA_PAGESIZE; i++) {
+    ret = timex_int_xfer(dev, buf, sizeof(buf), TIMEXDR_CTRL_TIMEOUT);
+    if ((ret == RESPONSE_BUFSIZE) && 
+	(((buf[2] & 0xff) >> 4) == UPLOAD_CANCEL)) {
+      break;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Stops a broken upload and starts it again from the beginning. Returns -1
+ * if the recorder did not take the commands.
+ */
+static int download_restart(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+
+  if ((download_cancel(dev) < 0) || 
+      (timex_ctrl(dev, DATA_UPLOAD, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE) < 0)) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Prepares the download of size bytes of EEPROM data into buf. The caller
+ * may set page_done to be called with the page number as soon as each
+ * EEPROM page is complete, and may lower limit to read only the beginning
+ * of the upload first. Returns -1 if memory can't be allocated.
+ */
+static int download_init(struct tdr_download *dl, unsigned char *buf,
+			  unsigned long int size) {
+  dl->buf = buf;
+  dl->size = size;
+  dl->pos = 0;
+  dl->limit = size;
+  dl->npages = 0;
+  dl->page_time = 0;
+  dl->restarts = 0;
+  dl->retried = 0;
+  dl->retry_time = 0;
+  dl->page_done = NULL;
+  dl->arg = NULL;
+
+  if (!(dl->received = calloc(num_of_pages(size, EEPROM_PAGESIZE), 1))) {
+    return failed("Couldn't allocate memory");
+  }
+  return 0;
+}
+
+/*
+ * Receives the EEPROM data after the DATA_UPLOAD command up to the download
+ * limit; a later call continues where the previous one stopped. A failed
+ * pass restarts the upload up to TDR_MAX_RESTARTS times, then -1 is
+ * returned.
+ */
+static int timex_data_read(struct tdr_dev *dev, struct tdr_download *dl) {
+  struct timespec t0;
+  int ret;
+
+  for (;;) {
+    clock_gettime(CLOCK_MONOTONIC, &dl->mark);
+
+    ret = dev->transport->download(dev, dl);
+
+    if (ret == 0) break;
+
+    /* The page in progress is lost as well as the time until the failure
+     * was detected */
+    dl->retried++;
+    dl->retry_time += elapsed_time(&dl->mark);
+
+    if (++dl->restarts > TDR_MAX_RESTARTS) {
+      return failed("Interrupt read timeout");
+    }
+
+    if (dev->opt->verbosity) {
+      printf("Transfer failed at page %lu, restarting the upload\n", 
+	     dl->pos / EEPROM_PAGESIZE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (download_restart(dev) < 0) return -1;
+    dl->pos = 0;
+    dl->retry_time += elapsed_time(&t0);
+  }
+
+  return 0;
+}
+
+/*
+ * Sets up a view of the downloaded EEPROM data. With raw set the transfer
+ * control byte of every page is skipped, otherwise the pages are shown as
+ * they were received.
+ */
+static void view_init(struct tdr_view *v, const unsigned char *buf, int raw) {
+  v->base = buf;
+  v->start = 0;
+  v->skip = raw ? 1 : 0;
+}
+
+/*
+ * Returns the number of data bytes in bytes raw EEPROM bytes.
+ */
+static unsigned long int view_size(const struct tdr_view *v, 
+				   unsigned long int bytes) {
+  return bytes - v->skip * num_of_pages(bytes, EEPROM_PAGESIZE);
+}
+
+/*
+ * Returns a pointer to the data byte at offset off and sets *run to the
+ * number of bytes that follow it contiguously (up to the end of the page).
+ */
+static const unsigned char *view_run(const struct tdr_view *v, 
+				     unsigned long int off, 
+				     unsigned long int *run) {
+  *run = v->skip ? DATA_PAGESIZE - (v->start + off) % DATA_PAGESIZE : ~0UL;
+  return &VIEW_BYTE(v, off);
+}
+
+/*
+ * Dumps the EEPROM to stdout.
+ */
+static void print_eeprom(const struct tdr_view *v, unsigned long int bytes) {
+  unsigned long int i, pages;
+
+  pages = num_of_pages(bytes, EEPROM_PAGESIZE);
+
+  for (i=0; i < (pages*EEPROM_PAGESIZE); i++) {
+    if ((i>0) && ((i % EEPROM_PAGESIZE) == 0)) printf("\n");
+    if ((i % 16) == 0) printf("\n%08lx:\t", i);
+    if (i < bytes) {
+      printf("%02x ", VIEW_BYTE(v, i) & 0xff);
+    } else {
+      printf("00 ");
+    }
+  }
+  printf("\n");
+}
+
+/*
+ * Decodes the 7 byte session header or footer at data offset off.
+ */
+static void parse_header(const struct tdr_view *v, unsigned long int off,
+			 struct tdr_header *hdr) {
+  hdr->dev = VIEW_BYTE(v, off);
+  hdr->year = (unsigned int) TDR_YR(VIEW_BYTE(v, off + 6));
+  hdr->month = (unsigned int) TDR_MD(VIEW_BYTE(v, off + 5));
+  hdr->day = (unsigned int) TDR_MD(VIEW_BYTE(v, off + 4));
+  hdr->hour = (unsigned int) VIEW_BYTE(v, off + 3);
+  hdr->min = (unsigned int) VIEW_BYTE(v, off + 2);
+  hdr->sec = (unsigned int) VIEW_BYTE(v, off + 1);
+}
+
+/*
+ * Fills in a session structure for the session stored between pstart and
+ * pend in the EEPROM data. The session data is left in place.
+ */
+static void parse_session(const struct tdr_view *v, unsigned long int pstart,
+			  unsigned long int pend, struct tdr_session *ses) {
+  struct tm stm;
+
+  parse_header(v, pstart, &ses->header);
+    
+  /* Calculate start time of the session in time_t format */
+  stm.tm_year = ses->header.year - 1900;
+  stm.tm_mon = ses->header.month - 1;
+  stm.tm_mday = ses->header.day;
+  stm.tm_hour = ses->header.hour;
+  stm.tm_min = ses->header.min;
+  stm.tm_sec = ses->header.sec;
+  /* Negative means that we don't know if daylight saving time is in effect */
+  stm.tm_isdst = -1;
+
+  ses->start = mktime(&stm);
+    
+  parse_header(v, pend - TIMEXDR_HEADERSIZE, &ses->footer);
+
+  ses->nbytes = pend - pstart - 2 * TIMEXDR_HEADERSIZE;
+
+  ses->data = *v;
+  ses->data.start = v->start + pstart + TIMEXDR_HEADERSIZE;
+}
+
+/*
+ * Returns the end address of the i-th session from the access table.
+ */
+static unsigned long int session_end(const struct tdr_view *v, int i) {
+  return TDR_ADDRESS(VIEW_BYTE(v, TDR_ASIZE*(i+1)), 
+		     VIEW_BYTE(v, TDR_ASIZE*(i+1) + 1), 
+		     VIEW_BYTE(v, TDR_ASIZE*(i+1) + 2));
+}
+
+/*
+ * Sets up a decoder handing the sessions to sink, which writes to out, as
+ * set by the options opt.
+ */
+void tdr_decoder_init(struct tdr_decoder *dec, FILE *out, 
+		      const struct tdr_sink *sink, void *arg, 
+		      const struct tdr_options *opt) {
+  memset(dec, 0, sizeof(*dec));
+  dec->opt = opt;
+  dec->sink = sink;
+  dec->arg = arg;
+  dec->out = out;
+  dec->fp = out;
+  dec->units = opt->units;
+  dec->files = opt->files;
+  dec->dir = opt->output_dir;
+  dec->compress = opt->compress;
+  dec->dist_offset = -1;
+  dec->dist_prev = -1;
+}
+
+/*
+ * Appends the offset of a GPS packet to the packet index of the decoder.
+ * Returns -1 if it can't be grown.
+ */
+static int decoder_gps(struct tdr_decoder *dec, unsigned long int off) {
+  unsigned long int *gps;
+
+  if (dec->ngps == dec->gps_size) {
+    if (!(gps = realloc(dec->gps, (dec->gps_size ? 2 * dec->gps_size : 1024) *
+			sizeof(*dec->gps)))) {
+      return decoder_failed(dec, "Couldn't allocate memory");
+    }
+    dec->gps = gps;
+    dec->gps_size = dec->gps_size ? 2 * dec->gps_size : 1024;
+  }
+  dec->gps[dec->ngps++] = off;
+  return 0;
+}
+
+/*
+ * Releases the columns of a record batch.
+ */
+static void records_free(struct tdr_records *r) {
+  int k;
+
+  free(r->sec);
+  free(r->bpm);
+  free(r->error);
+  free(r->layout);
+  free(r->first);
+  for (k = 0; k < GPS_NFIELDS; k++) {
+    free(r->field[k]);
+  }
+}
+
+/*
+ * Releases the buffers of a decoder.
+ */
+void tdr_decoder_free(struct tdr_decoder *dec) {
+  records_free(&dec->rec);
+  free(dec->gps);
+  free(dec->w.buf);
+}
+
+/*
+ * Allocates an empty session arena decoded by the sink of the options.
+ * Returns NULL on failure.
+ */
+static struct tdr_arena *arena_new(const struct tdr_options *opt) {
+  struct tdr_arena *arena;
+
+  if (!(arena = malloc(sizeof(*arena)))) {
+    failed("Couldn't allocate memory");
+    return NULL;
+  }
+  arena->nses = 0;
+  arena->sync = NULL;
+  tdr_decoder_init(&arena->dec, stdout, opt->sink, NULL, opt);
+
+  /* A listing on stdout starts with the heading of the sink */
+  if (!arena->dec.files && opt->sink->heading && 
+      (opt->sink->heading(&arena->dec) < 0)) {
+    tdr_sessions_free(arena);
+    return NULL;
+  }
+
+  return arena;
+}
+
+/*
+ * Sets up the arena for the sessions of a job: the session files go to
+ * the directory of the job and incremental runs keep the job's sync state.
+ */
+static void arena_job(struct tdr_arena *arena, struct tdr_job *job) {
+  if (job->dir[0]) arena->dec.dir = job->dir;
+  arena->sync = job->dev->opt->sync ? &job->sync : NULL;
+}
+
+/*
+ * Releases a session arena and everything allocated from it.
+ */
+void tdr_sessions_free(struct tdr_arena *arena) {
+  tdr_decoder_free(&arena->dec);
+  free(arena);
+}
+
+/*
+ * Splits the EEPROM data into the session table of the arena.
+ */
+static void split_data(struct tdr_arena *arena, const struct tdr_view *v) {
+  unsigned long int pstart=TIMEXDR_FIRSTSESSION, pend;
+
+  /* ***FIXME*** There can be possibly 128 sessions but we don't know the
+   * maximum EEPROM address (or size of the EEPROM memory). Until we figure 
+   * that out, allow only up to 127 sessions.
+   */
+
+  for (arena->nses = 0; 
+       (arena->nses < TDR_MAX_SESSIONS) && 
+	 ((pend = session_end(v, arena->nses)) > 0); 
+       arena->nses++) {
+    parse_session(v, pstart, pend, &arena->ses[arena->nses]);
+    pstart = pend;
+  }
+}
+
+/*
+ * Returns the session table of the raw EEPROM data in buf (as downloaded,
+ * with the transfer control bytes), decoded to stdout by the sink of the
+ * options. Released by tdr_sessions_free(). Returns NULL on failure.
+ */
+struct tdr_arena *tdr_sessions(const unsigned char *buf, 
+			       const struct tdr_options *opt) {
+  struct tdr_arena *arena = arena_new(opt);
+  struct tdr_view v;
+
+  if (!arena) return NULL;
+  view_init(&v, buf, 1);
+  split_data(arena, &v);
+
+  return arena;
+}
+
+/*
+ * Returns 1 if two session headers are equal.
+ */
+static int same_header(const struct tdr_header *a, const struct tdr_header *b) {
+  return (a->dev == b->dev) && (a->year == b->year) && 
+    (a->month == b->month) && (a->day == b->day) && (a->hour == b->hour) && 
+    (a->min == b->min) && (a->sec == b->sec);
+}
+
+/*
+ * Loads the incremental sync state of the recorder with the given serial
+ * number from ~/.timexdr/SERIAL.sync. A missing file means that nothing was
+ * exported. Returns -1 if the state can't be kept.
+ */
+static int sync_load(struct tdr_sync *sync, const char *serial) {
+  char line[4 * TIMEXDR_ATABLESIZE], *p, *home;
+  struct tdr_header *hdr;
+  unsigned int i, b, dev;
+  FILE *fp;
+
+  memset(sync, 0, sizeof(*sync));
+
+  if (!(home = getenv("HOME"))) {
+    return failed("HOME is not set, can't keep the sync state");
+  }
+  snprintf(sync->path, sizeof(sync->path), "%s/" SYNC_STATE_DIR, home);
+  if ((mkdir(sync->path, 0700) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "%s: Can't create %s (%m).\n", tdr_progname, sync->path);
+    return -1;
+  }
+
+  /* One state file per recorder */
+  i = strlen(sync->path);
+  snprintf(sync->path + i, sizeof(sync->path) - i, "/%s." SYNC_FILE_EXT, 
+	   serial[0] ? serial : "default");
+  for (p = sync->path + i + 1; *p; p++) {
+    if (!isalnum(*p) && (*p != '.') && (*p != '-')) *p = '_';
+  }
+
+  if (!(fp = fopen(sync->path, "r"))) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    if (strncmp(line, "table ", 6) == 0) {
+      for (i = 0, p = line + 6; 
+	   (i < TIMEXDR_ATABLESIZE) && (sscanf(p, "%2x", &b) == 1); 
+	   i++, p += 2) {
+	sync->table[i] = b;
+      }
+    } else if ((sscanf(line, "session %u", &i) == 1) && 
+	       (i < TDR_MAX_SESSIONS)) {
+      hdr = &sync->header[i];
+      if (sscanf(line, "session %*u %x %u-%u-%u %u:%u:%u", &dev,
+		 &hdr->year, &hdr->month, &hdr->day, 
+		 &hdr->hour, &hdr->min, &hdr->sec) == 7) {
+	hdr->dev = dev;
+	sync->exported[i] = 1;
+      }
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Compares the access table and the first session header of the EEPROM
+ * with the sync state. If the EEPROM was cleared or rewritten since, the
+ * state is forgotten. Returns the number of sessions not exported yet.
+ */
+static int sync_compare(struct tdr_sync *sync, const struct tdr_view *v,
+			const struct tdr_header *first, 
+			const struct tdr_options *opt) {
+  struct tdr_view saved;
+  unsigned long int k;
+  int i, n = 0;
+
+  view_init(&saved, sync->table, 0);
+
+  for (i = 0; (i < TDR_MAX_SESSIONS) && (session_end(v, i) > 0); i++) {
+    if (sync->exported[i] && 
+	((session_end(&saved, i) != session_end(v, i)) || 
+	 ((i == 0) && !same_header(&sync->header[0], first)))) {
+      if (opt->verbosity) printf("EEPROM content changed since the last sync\n");
+      memset(sync->exported, 0, sizeof(sync->exported));
+      i = -1;
+      n = 0;
+      continue;
+    }
+    if (!sync->exported[i]) n++;
+  }
+
+  for (k = 0; k < TIMEXDR_ATABLESIZE; k++) {
+    sync->table[k] = VIEW_BYTE(v, k);
+  }
+
+  /* Sessions past the end of the table are gone */
+  for (; i < TDR_MAX_SESSIONS; i++) {
+    sync->exported[i] = 0;
+  }
+
+  return n;
+}
+
+/*
+ * Returns 1 if the i-th session was exported by an earlier run.
+ */
+static int sync_known(const struct tdr_sync *sync, int i, 
+		      const struct tdr_header *hdr) {
+  return sync->exported[i] && same_header(&sync->header[i], hdr);
+}
+
+/*
+ * Marks the i-th session as exported.
+ */
+static void sync_mark(struct tdr_sync *sync, int i, 
+		      const struct tdr_header *hdr) {
+  sync->exported[i] = 1;
+  sync->header[i] = *hdr;
+}
+
+/*
+ * Writes the sync state back to its file. Returns -1 on failure.
+ */
+static int sync_save(const struct tdr_sync *sync, const char *serial) {
+  const struct tdr_header *hdr;
+  FILE *fp;
+  int i;
+
+  if (!(fp = fopen(sync->path, "w"))) {
+    fprintf(stderr, "%s: Can't write sync state %s (%m).\n", tdr_progname, 
+	    sync->path);
+    return -1;
+  }
+
+  fprintf(fp, "# timexdr sync state of recorder %s\ntable ", 
+	  serial[0] ? serial : "default");
+  for (i = 0; i < TIMEXDR_ATABLESIZE; i++) {
+    fprintf(fp, "%02x", sync->table[i]);
+  }
+  fprintf(fp, "\n");
+
+  for (i = 0; i < TDR_MAX_SESSIONS; i++) {
+    if (sync->exported[i]) {
+      hdr = &sync->header[i];
+      fprintf(fp, "session %d %02x %04u-%02u-%02u %02u:%02u:%02u\n", i, 
+	      hdr->dev & 0xff, hdr->year, hdr->month, hdr->day, 
+	      hdr->hour, hdr->min, hdr->sec);
+    }
+  }
+
+  if (fclose(fp) != 0) {
+    return failed("Error writing the sync state");
+  }
+  return 0;
+}
+
+/*
+ * Converts seconds into a time string 
+ * *str_time - output string
+ * st - session start time
+ * seconds - elapsed session time in seconds
+ * Returns -1 if the time can't be converted.
+ */
+static int time2str(char *str_time, const time_t st, double seconds) {
+  double tmp;
+  time_t tsec;
+  struct tm t;
+  long int fsec; 
+  char s1[TIME_STR_LENGTH], s2[TIME_STR_LENGTH];
+
+  tsec = st + seconds;
+  fsec = (long int)(modf(seconds, &tmp)*100);
+
+  /* Convert from time_t to tm structure */
+  localtime_r(&tsec, &t);
+  
+  /* Date and time */
+  if (strftime(s1, sizeof(s1), "%F %T", &t) == 0) {
+	  return -1;
+  }
+
+  /* Time zone */
+  if (strftime(s2, sizeof(s2), "%z", &t) == 0) {
+	  return -1;
+  }
+
+  /* Final assembly */
+  sprintf(str_time, "%s.%02ld%s", s1, fsec, s2);
+  return 0;
+}
+
+/*
+ * Returns the UTC offset of the local time at t in seconds.
+ */
+static long int utc_offset(time_t t) {
+  struct tm lt;
+
+  localtime_r(&t, &lt);
+  return lt.tm_gmtoff;
+}
+
+/*
+ * Converts days since 1970-01-01 to the civil (proleptic Gregorian) date.
+ */
+static void civil_date(long int days, long int *y, long int *m, long int *d) {
+  long int era, doe, yoe, doy, mp;
+
+  days += 719468;                     /* Days from 0000-03-01 */
+  era = ((days >= 0) ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = (mp < 10) ? mp + 3 : mp - 9;
+  *y = yoe + era * 400 + ((*m <= 2) ? 1 : 0);
+}
+
+/*
+ * Sets up the clock for the interval starting at t in which the local time
+ * is t plus a fixed UTC offset. An offset change within a day of t (DST)
+ * ends the interval and is located by bisection. The clock is left empty
+ * if the local time isn't plain offset arithmetic (leap seconds) or the
+ * year doesn't have four digits.
+ */
+static void clock_window(struct tdr_clock *ck, time_t t) {
+  struct tm lt;
+  time_t local, lo, hi, mid;
+  long int y, m, d, sod;
+
+  ck->lo = ck->hi = t;
+  ck->day = -1;
+
+  localtime_r(&t, &lt);
+  local = t + lt.tm_gmtoff;
+  if ((local < 0) || (lt.tm_year > 9999 - 1900)) {
+    return;
+  }
+  civil_date(local / 86400, &y, &m, &d);
+  sod = local % 86400;
+  if ((lt.tm_sec != sod % 60) || (lt.tm_min != (sod / 60) % 60) || 
+      (lt.tm_hour != sod / 3600) || (lt.tm_mday != d) || 
+      (lt.tm_mon + 1 != m) || (lt.tm_year + 1900 != y)) {
+    return;
+  }
+  ck->off = lt.tm_gmtoff;
+
+  lo = t;
+  hi = t + 86400;
+  if (utc_offset(hi) != ck->off) {
+    while (hi - lo > 1) {
+      mid = lo + (hi - lo) / 2;
+      if (utc_offset(mid) == ck->off) {
+	lo = mid;
+      } else {
+	hi = mid;
+      }
+    }
+  }
+  ck->hi = hi;
+}
+
+/*
+ * Writes the two digits of n (0-99) at s.
+ */
+static void put_2digits(char *s, long int n) {
+  s[0] = '0' + n / 10;
+  s[1] = '0' + n % 10;
+}
+
+/*
+ * Formats the time stamp of a record like time2str() into dec->time_str.
+ * The time string is kept between calls: the UTC offset is looked up
+ * only when the time leaves the interval of the clock (once per session
+ * unless DST changes), the date and the zone are rewritten when the day
+ * changes, and otherwise only the time of day and the fraction digits
+ * are updated.
+ */
+static void time_stamp(struct tdr_decoder *dec, const time_t st, 
+		       double seconds) {
+  struct tdr_clock *ck = &dec->clock;
+  char *s = dec->time_str;
+  time_t tsec, local;
+  long int fsec, day, sod, y, m, d, z;
+  double tmp;
+
+  tsec = st + seconds;
+  fsec = (long int)(modf(seconds, &tmp)*100);
+
+  if ((tsec < ck->lo) || (tsec >= ck->hi)) {
+    clock_window(ck, tsec);
+  }
+  if ((ck->lo == ck->hi) || (fsec < 0)) {
+    if (time2str(s, st, seconds) < 0) {
+      s[0] = '\0';
+      decoder_failed(dec, "Time to string conversion error");
+    }
+    ck->day = -1;
+    return;
+  }
+
+  local = tsec + ck->off;
+  day = local / 86400;
+  sod = local % 86400;
+
+  /* "YYYY-MM-DD HH:MM:SS.ff+zzzz" */
+  if (day != ck->day) {
+    civil_date(day, &y, &m, &d);
+    put_2digits(s, y / 100);
+    put_2digits(s + 2, y % 100);
+    s[4] = '-';
+    put_2digits(s + 5, m);
+    s[7] = '-';
+    put_2digits(s + 8, d);
+    s[10] = ' ';
+    s[13] = ':';
+    s[16] = ':';
+    s[19] = '.';
+    z = (ck->off < 0) ? -ck->off : ck->off;
+    s[22] = (ck->off < 0) ? '-' : '+';
+    put_2digits(s + 23, z / 3600);
+    put_2digits(s + 25, (z / 60) % 60);
+    s[27] = '\0';
+    ck->day = day;
+  }
+
+  put_2digits(s + 11, sod / 3600);
+  put_2digits(s + 14, (sod / 60) % 60);
+  put_2digits(s + 17, sod % 60);
+  put_2digits(s + 20, fsec);
+}
+
+/*
+ * Writes the buffered text of the decoder to the session output. Returns
+ * -1 once the output has failed; the text is dropped then.
+ */
+static int writer_flush(struct tdr_decoder *dec) {
+  struct tdr_writer *w = &dec->w;
+
+  if (!dec->err && w->len > 0 && fwrite(w->buf, w->len, 1, dec->fp) != 1) {
+    decoder_failed(dec, "Error writing to a file");
+  }
+  w->len = 0;
+  return dec->err;
+}
+
+/*
+ * Makes room for n more bytes in the output buffer of the decoder and
+ * returns where they go, or NULL if the buffer can't be allocated. n must
+ * not exceed TDR_WRITER_SIZE.
+ */
+static char *writer_room(struct tdr_decoder *dec, size_t n) {
+  struct tdr_writer *w = &dec->w;
+
+  if (!w->buf && !(w->buf = malloc(TDR_WRITER_SIZE))) {
+    decoder_failed(dec, "Couldn't allocate memory");
+    return NULL;
+  }
+  if (w->len + n > TDR_WRITER_SIZE) writer_flush(dec);
+  return w->buf + w->len;
+}
+
+/*
+ * Appends n bytes of s to the output.
+ */
+static void put_mem(struct tdr_decoder *dec, const char *s, size_t n) {
+  char *p;
+
+  if (n > TDR_WRITER_SIZE) {
+    writer_flush(dec);
+    if (!dec->err && (fwrite(s, n, 1, dec->fp) != 1)) {
+      decoder_failed(dec, "Error writing to a file");
+    }
+    return;
+  }
+  if (!(p = writer_room(dec, n))) return;
+  memcpy(p, s, n);
+  dec->w.len += n;
+}
+
+static void put_str(struct tdr_decoder *dec, const char *s) {
+  put_mem(dec, s, strlen(s));
+}
+
+/*
+ * Appends the digits of v right aligned in width characters like 
+ * printf's "%*ld", or "%0*ld" if zero is set.
+ */
+static void put_int(struct tdr_decoder *dec, long int v, int width, int zero) {
+  char d[24];
+  unsigned long int u = (v < 0) ? -(unsigned long int) v : v;
+  int n = 0, len;
+  char *s;
+
+  do {
+    d[n++] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+
+  len = n + (v < 0);
+  if (width < len) width = len;
+  if (!(s = writer_room(dec, width))) return;
+  dec->w.len += width;
+
+  if (zero) {
+    if (v < 0) *s++ = '-';
+    for (; width > len; width--) *s++ = '0';
+  } else {
+    for (; width > len; width--) *s++ = ' ';
+    if (v < 0) *s++ = '-';
+  }
+  while (n) *s++ = d[--n];
+}
+
+/*
+ * Appends x with prec decimals right aligned in width characters, the
+ * same text as printf's "%*.*f" (or "%0*.*f" if zero is set) gives. The
+ * exact binary value of x is scaled by 10^prec and rounded half to even
+ * in 128-bit integers; values that do not fit are left to snprintf().
+ */
+static void put_fixed(struct tdr_decoder *dec, double x, int width, int prec,
+		      int zero) {
+#ifdef __SIZEOF_INT128__
+  static const uint64_t pow10[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+    1000000000
+  };
+  unsigned __int128 v, q, half;
+  char d[48];
+  int e, n = 0, len, neg = signbit(x);
+  uint64_t m;
+  char *s;
+
+  if (isfinite(x) && fabs(x) < 1e15 && prec >= 0 && prec <= 9) {
+    m = (uint64_t) ldexp(frexp(fabs(x), &e), 53);
+    e -= 53;
+    v = (unsigned __int128) m * pow10[prec];
+    if (e >= 0) {
+      q = v << e;
+    } else if (e > -128) {
+      q = v >> -e;
+      half = (unsigned __int128) 1 << (-e - 1);
+      v &= (half << 1) - 1;
+      if (v > half || (v == half && (q & 1))) q++;
+    } else {
+      q = 0;
+    }
+
+    while (n < prec) {
+      d[n++] = '0' + (int)(q % 10);
+      q /= 10;
+    }
+    if (prec > 0) d[n++] = '.';
+    do {
+      d[n++] = '0' + (int)(q % 10);
+      q /= 10;
+    } while (q);
+
+    len = n + neg;
+    if (width < len) width = len;
+    if (!(s = writer_room(dec, width))) return;
+    dec->w.len += width;
+
+    if (zero) {
+      if (neg) *s++ = '-';
+      for (; width > len; width--) *s++ = '0';
+    } else {
+      for (; width > len; width--) *s++ = ' ';
+      if (neg) *s++ = '-';
+    }
+    while (n) *s++ = d[--n];
+    return;
+  }
+#endif
+  {
+    char t[512];
+    int k = snprintf(t, sizeof(t), zero ? "%0*.*f" : "%*.*f", width, prec, x);
+
+    if (k < 0) {
+      decoder_failed(dec, "Error writing to a file");
+      return;
+    }
+    put_mem(dec, t, ((size_t) k < sizeof(t)) ? (size_t) k : sizeof(t) - 1);
+  }
+}
+
+/* 
+ * Prints session header
+ */
+static void session_header(struct tdr_decoder *dec, char *sname, const struct tdr_header *hdr, 
+			   const struct tdr_header *ftr) {
+  
+  if (!dec->err && fprintf(dec->fp, "%s: %04u-%02u-%02u %02u:%02u:%02u - "
+	      "%04u-%02u-%02u %02u:%02u:%02u\n",
+	      sname, 
+	      hdr->year, hdr->month, hdr->day, hdr->hour, hdr->min, hdr->sec,
+	      ftr->year, ftr->month, ftr->day, ftr->hour, ftr->min, ftr->sec)
+      < 0) {
+    decoder_failed(dec, "Error writing to a file");
+  }
+}
+
+/*
+ * Prints information about a packet error
+ */
+static void packet_error(struct tdr_decoder *dec, time_t st, double split_time, 
+			unsigned char token) {
+  
+  time_stamp(dec, st, split_time);
+
+  switch (token) {
+  case MISSING_PACKET:
+    put_str(dec, dec->time_str);
+    put_str(dec, "\tMissing packet.\n");
+    break;
+  case CORRUPTED_PACKET:
+    put_str(dec, dec->time_str);
+    put_str(dec, "\tCorrupted packet.\n");
+    break;
+  default:
+    errno = 0;
+    decoder_failed(dec, "Unknown packet error");
+    break;
+  }
+
+}
+
+/* Suffixes of the compressed files, by TDR_COMPRESS_* */
+static const char *const compress_ext[] = { "", ".gz", ".zst" };
+
+static struct tdr_zstream *zstreams = NULL;   /* Open compressed files */
+static pthread_mutex_t zstreams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the compression method called name (none, gzip or zstd), or -1
+ * if it is unknown or was not built in.
+ */
+int tdr_compress_find(const char *name) {
+  if (strcmp(name, "none") == 0) return TDR_COMPRESS_NONE;
+#ifdef TDR_ZLIB
+  if ((strcmp(name, "gzip") == 0) || (strcmp(name, "gz") == 0)) {
+    return TDR_COMPRESS_GZIP;
+  }
+#endif
+#ifdef TDR_ZSTD
+  if ((strcmp(name, "zstd") == 0) || (strcmp(name, "zst") == 0)) {
+    return TDR_COMPRESS_ZSTD;
+  }
+#endif
+  return -1;
+}
+
+/*
+ * Returns the compression method given by the suffix of path.
+ */
+int tdr_compress_suffix(const char *path) {
+  size_t len = strlen(path);
+  int k;
+
+  for (k = TDR_COMPRESS_GZIP; k <= TDR_COMPRESS_ZSTD; k++) {
+    if ((len > strlen(compress_ext[k])) &&
+	(strcmp(path + len - strlen(compress_ext[k]), compress_ext[k]) == 0)) {
+      return k;
+    }
+  }
+  return TDR_COMPRESS_NONE;
+}
+
+static ssize_t zstream_read(int fd, void *buf, size_t len) {
+  ssize_t k;
+
+  while (((k = read(fd, buf, len)) < 0) && (errno == EINTR));
+  return k;
+}
+
+#if defined(TDR_ZLIB) || defined(TDR_ZSTD)
+static int zstream_write(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+  ssize_t k;
+
+  while (len) {
+    if ((k = write(fd, p, len)) < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += k;
+    len -= k;
+  }
+  return 0;
+}
+#endif
+
+#ifdef TDR_ZLIB
+/*
+ * Compresses the pipe of z into a gzip file until the pipe is closed.
+ */
+static int gzip_stream(struct tdr_zstream *z, unsigned char *in,
+		       unsigned char *out) {
+  z_stream s;
+  ssize_t n;
+  int ret = Z_OK;
+
+  memset(&s, 0, sizeof(s));
+  if (deflateInit2(&s, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return -1;
+  }
+  do {
+    if ((n = zstream_read(z->pipe, in, TDR_ZBUF_SIZE)) < 0) break;
+    s.next_in = in;
+    s.avail_in = n;
+    do {
+      s.next_out = out;
+      s.avail_out = TDR_ZBUF_SIZE;
+      ret = deflate(&s, n ? Z_NO_FLUSH : Z_FINISH);
+      if (zstream_write(z->fd, out, TDR_ZBUF_SIZE - s.avail_out) < 0) {
+	n = -1;
+	break;
+      }
+    } while (s.avail_out == 0);
+  } while (n > 0);
+  deflateEnd(&s);
+
+  return ((n < 0) || (ret != Z_STREAM_END)) ? -1 : 0;
+}
+#endif /* TDR_ZLIB */
+
+#ifdef TDR_ZSTD
+/*
+ * Compresses the pipe of z into a zstd file until the pipe is closed.
+ */
+static int zstd_stream(struct tdr_zstream *z, unsigned char *in,
+		       unsigned char *out) {
+  ZSTD_CCtx *cctx;
+  ZSTD_inBuffer i;
+  ZSTD_outBuffer o;
+  size_t left;
+  ssize_t n;
+
+  if (!(cctx = ZSTD_createCCtx())) return -1;
+  do {
+    if ((n = zstream_read(z->pipe, in, TDR_ZBUF_SIZE)) < 0) break;
+    i.src = in;
+    i.size = n;
+    i.pos = 0;
+    do {
+      o.dst = out;
+      o.size = TDR_ZBUF_SIZE;
+      o.pos = 0;
+      left = ZSTD_compressStream2(cctx, &o, &i, 
+				  n ? ZSTD_e_continue : ZSTD_e_end);
+      if (ZSTD_isError(left) || (zstream_write(z->fd, out, o.pos) < 0)) {
+	n = -1;
+	break;
+      }
+    } while (n ? (i.pos < i.size) : (left != 0));
+  } while (n > 0);
+  ZSTD_freeCCtx(cctx);
+
+  return (n < 0) ? -1 : 0;
+}
+#endif /* TDR_ZSTD */
+
+/*
+ * Compressor thread of a file opened by tdr_zopen().
+ */
+static void *zstream_worker(void *arg) {
+  struct tdr_zstream *z = arg;
+  unsigned char *in, *out, drain[4096];
+
+  in = malloc(TDR_ZBUF_SIZE);
+  out = malloc(TDR_ZBUF_SIZE);
+
+  /* Without its buffers the stream fails */
+  switch (in && out ? z->method : TDR_COMPRESS_NONE) {
+#ifdef TDR_ZLIB
+  case TDR_COMPRESS_GZIP:
+    z->err = gzip_stream(z, in, out);
+    break;
+#endif
+#ifdef TDR_ZSTD
+  case TDR_COMPRESS_ZSTD:
+    z->err = zstd_stream(z, in, out);
+    break;
+#endif
+  default:
+    z->err = -1;
+    break;
+  }
+
+  /* A failed stream is drained so that the writer is not blocked */
+  while (z->err && (zstream_read(z->pipe, drain, sizeof(drain)) > 0));
+  close(z->pipe);
+  if (close(z->fd) < 0) z->err = -1;
+
+  free(in);
+  free(out);
+  return NULL;
+}
+
+/*
+ * Opens path for writing, compressed by method on a thread of its own.
+ * Returns NULL and sets errno on failure.
+ */
+FILE *tdr_zopen(const char *path, int method) {
+  struct tdr_zstream *z;
+  int fd[2];
+
+  if (method == TDR_COMPRESS_NONE) return fopen(path, "w");
+  if (tdr_compress_find(compress_ext[method] + 1) != method) {
+    errno = ENOSYS;                   /* Not built in */
+    return NULL;
+  }
+
+  if (!(z = calloc(1, sizeof(*z)))) return NULL;
+  if ((z->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    free(z);
+    return NULL;
+  }
+  if (pipe(fd) < 0) {
+    close(z->fd);
+    free(z);
+    return NULL;
+  }
+#ifdef F_SETPIPE_SZ
+  fcntl(fd[1], F_SETPIPE_SZ, TDR_ZPIPE_SIZE);   /* Best effort */
+#endif
+  if (!(z->fp = fdopen(fd[1], "w"))) {
+    close(fd[0]);
+    close(fd[1]);
+    close(z->fd);
+    free(z);
+    return NULL;
+  }
+  z->pipe = fd[0];
+  z->method = method;
+
+  if ((errno = pthread_create(&z->thread, NULL, zstream_worker, z)) != 0) {
+    fclose(z->fp);
+    close(z->pipe);
+    close(z->fd);
+    unlink(path);
+    free(z);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&zstreams_lock);
+  z->next = zstreams;
+  zstreams = z;
+  pthread_mutex_unlock(&zstreams_lock);
+
+  return z->fp;
+}
+
+/*
+ * Closes a stream of tdr_zopen() and waits for its compressor. Returns
+ * EOF if the file could not be written, as fclose().
+ */
+int tdr_zclose(FILE *fp) {
+  struct tdr_zstream **p, *z;
+  int ret;
+
+  pthread_mutex_lock(&zstreams_lock);
+  for (p = &zstreams; *p && ((*p)->fp != fp); p = &((*p)->next));
+  if ((z = *p)) *p = z->next;
+  pthread_mutex_unlock(&zstreams_lock);
+
+  ret = fclose(fp);
+  if (z) {
+    pthread_join(z->thread, NULL);
+    if (z->err) ret = EOF;
+    free(z);
+  }
+  return ret;
+}
+
+/*
+ * Open output file for a session. Returns -1 if it can't be opened.
+ */
+static int open_session_file(struct tdr_decoder *dec, char *sname, 
+			     const struct tdr_header *hdr, 
+			     const struct tdr_header *ftr) {
+  char s[2 * TIMEXDR_STRLEN];
+
+  if (dec->err) return -1;
+  if (dec->files) {
+    snprintf(s, sizeof(s), "%s%s%04u%02u%02u_%02u%02u%02u-%02u%02u%02u.%s%s",
+	     dec->dir ? dec->dir : "", dec->dir ? "/" : "",
+	     hdr->year, hdr->month, hdr->day, hdr->hour, hdr->min, hdr->sec,
+	     ftr->hour, ftr->min, ftr->sec, sname, 
+	     compress_ext[dec->compress]);
+  
+    if (dec->opt->verbosity) fprintf(dec->out, "File name: %s\tSession: %s\n", s,sname);
+
+    if ((dec->fp = tdr_zopen(s, dec->compress)) == NULL) {
+      fprintf(stderr, "%s: Can't open session file %s (%m).\n", tdr_progname, s);
+      return dec->err = -1;
+    } 
+  } else {
+    dec->fp = dec->out;
+  }
+  return 0;
+}
+
+/*
+ * Close the output session file
+ */
+static int close_session_file(struct tdr_decoder *dec, 
+			      const struct tdr_session *ses) {
+  writer_flush(dec);
+  if (dec->files && dec->fp && (tdr_zclose(dec->fp) != 0)) {
+    decoder_failed(dec, "Error writing to a file");
+  }
+  if (dec->files) dec->fp = NULL;
+  return dec->err;
+}
+
+/*
+ * Opens the output of an HRM or GPS session and prints its header.
+ */
+static int open_session(struct tdr_decoder *dec, 
+			const struct tdr_session *ses) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+
+  if (open_session_file(dec, gps ? GPS_FILE_EXT : HRM_FILE_EXT, 
+			&(ses->header), &(ses->footer)) < 0) {
+    return -1;
+  }
+  session_header(dec, gps ? "GPS session" : "HRM session", 
+		 &(ses->header), &(ses->footer));
+
+  if (!gps && !dec->err &&
+      (fprintf(dec->fp, "             Time             HR[bpm]\n") < 0)) {
+    decoder_failed(dec, "Error writing to a file");
+  }
+  return dec->err;
+}
+
+/*
+ * Hands the start and the end of a session to the sink of the decoder.
+ * Return -1 once the output has failed.
+ */
+static int sink_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  if (dec->err) return -1;
+  return dec->sink->begin ? dec->sink->begin(dec, ses) : 0;
+}
+
+static int sink_end(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  if (dec->sink->end && (dec->sink->end(dec, ses) < 0)) return -1;
+  return dec->err;
+}
+
+/*
+ * Sets the bits of the HRM samples in bpm[0..n) that are packet error codes
+ * (MISSING_PACKET or CORRUPTED_PACKET), 64 samples per error word.
+ */
+static void hrm_classify(const unsigned char *bpm, unsigned long int n,
+			 uint64_t *error) {
+  unsigned long int i = 0, k;
+  uint64_t mask;
+
+#if defined(__AVX2__)
+  const __m256i missing = _mm256_set1_epi8(MISSING_PACKET);
+  const __m256i corrupted = _mm256_set1_epi8(CORRUPTED_PACKET);
+  __m256i x;
+
+  for (; i + 64 <= n; i += 64) {
+    x = _mm256_loadu_si256((const __m256i *)(bpm + i));
+    mask = (uint32_t) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, missing),
+		      _mm256_cmpeq_epi8(x, corrupted)));
+    x = _mm256_loadu_si256((const __m256i *)(bpm + i + 32));
+    mask |= (uint64_t)(uint32_t) _mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(x, missing),
+		      _mm256_cmpeq_epi8(x, corrupted))) << 32;
+    error[i / 64] = mask;
+  }
+#elif defined(__SSE2__)
+  const __m128i missing = _mm_set1_epi8(MISSING_PACKET);
+  const __m128i corrupted = _mm_set1_epi8(CORRUPTED_PACKET);
+  __m128i x;
+  int j;
+
+  for (; i + 64 <= n; i += 64) {
+    mask = 0;
+    for (j = 0; j < 4; j++) {
+      x = _mm_loadu_si128((const __m128i *)(bpm + i + 16 * j));
+      mask |= (uint64_t)(uint16_t) _mm_movemask_epi8(
+	_mm_or_si128(_mm_cmpeq_epi8(x, missing),
+		     _mm_cmpeq_epi8(x, corrupted))) << (16 * j);
+    }
+    error[i / 64] = mask;
+  }
+#endif
+
+  /* Scalar tail (or everything without vector instructions) */
+  for (; i < n; i += 64) {
+    mask = 0;
+    for (k = 0; (k < 64) && (i + k < n); k++) {
+      if ((bpm[i + k] == MISSING_PACKET) || (bpm[i + k] == CORRUPTED_PACKET)) {
+	mask |= (uint64_t) 1 << k;
+      }
+    }
+    error[i / 64] = mask;
+  }
+}
+
+/*
+ * Makes room for n records in the record batch, with the GPS field
+ * columns if gps is set. Returns -1 if memory can't be allocated.
+ */
+static int records_reserve(struct tdr_records *r, unsigned long int n,
+			   int gps) {
+  int k;
+
+  if (n > r->size) {
+    free(r->sec);
+    free(r->bpm);
+    free(r->error);
+    free(r->layout);
+    free(r->first);
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      free(r->field[k]);
+      r->field[k] = NULL;
+    }
+    r->sec = malloc(n * sizeof(*r->sec));
+    r->bpm = malloc(n);
+    r->error = malloc(num_of_pages(n, 64) * sizeof(*r->error));
+    r->layout = malloc(n * sizeof(*r->layout));
+    r->first = malloc(n);
+    if (!r->sec || !r->bpm || !r->error || !r->layout || !r->first) {
+      r->size = 0;
+      return failed("Couldn't allocate memory");
+    }
+    r->size = n;
+  }
+
+  /* The GPS columns are only allocated once a GPS session needs them */
+  for (k = 0; gps && (k < GPS_NFIELDS) && r->size; k++) {
+    if (!r->field[k] &&
+	!(r->field[k] = malloc(r->size * sizeof(*r->field[k])))) {
+      return failed("Couldn't allocate memory");
+    }
+  }
+  return 0;
+}
+
+/*
+ * Classifies and stamps the n samples in the bpm column in bulk.
+ */
+static void hrm_finish(struct tdr_records *r, unsigned long int n) {
+  unsigned long int i;
+
+  r->n = n;
+  hrm_classify(r->bpm, n, r->error);
+
+  for (i = 0; i < n; i++) {
+    r->sec[i] = i * TIME_STEP_HRM;
+  }
+}
+
+/*
+ * Decodes an HRM session into the record batch of the decoder: the samples
+ * are copied out of the EEPROM pages a page at a time, then classified and
+ * stamped in bulk. Returns -1 if memory can't be allocated.
+ */
+static int hrm_decode(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  struct tdr_records *r = &dec->rec;
+  const unsigned char *p;
+  unsigned long int i, run, n = ses->nbytes;
+
+  if (records_reserve(r, n, 0) < 0) return dec->err = -1;
+
+  for (i = 0; i < n; i += run) {
+    p = view_run(&ses->data, i, &run);
+    if (run > n - i) run = n - i;
+    memcpy(r->bpm + i, p, run);
+  }
+
+  hrm_finish(r, n);
+  return 0;
+}
+
+/*
+ * Prints HRM records from to to.
+ */
+static void hrm_print(struct tdr_decoder *dec, const struct tdr_session *ses,
+		      const struct tdr_records *r, unsigned long int from,
+		      unsigned long int to) {
+  unsigned long int i;
+
+  for (i = from; i < to; i++) {
+    if ((r->error[i / 64] >> (i % 64)) & 1) {
+      packet_error(dec, ses->start, r->sec[i], r->bpm[i]);
+    } else {
+      time_stamp(dec, ses->start, r->sec[i]);
+      put_str(dec, dec->time_str);
+      put_str(dec, "\t");
+      put_int(dec, r->bpm[i], 3, 0);
+      put_str(dec, "\n");
+    }
+  }
+}
+
+/*
+ * Convert distance units
+ */
+static double unit_conv(const struct tdr_decoder *dec, const double dist) {
+  return (dec->units == 0) ? dist : MILES_TO_KM(dist);
+}
+
+/*
+ * Adjust the distance (in DIST_UNIT) for odometer quirks
+ */
+static void dist_corrections(struct tdr_decoder *dec, long int *dist){
+
+  /* First add any rollovers */
+  *dist += dec->dist_base;
+
+  if (dec->dist_offset < 0) {
+    dec->dist_offset = *dist;
+  }
+
+  /* Remove session offset */
+  *dist -= dec->dist_offset;
+
+  /* Check for a rollover: We assume that the distance can fall back
+   * by more than 0.5 * ODO_MAX only when a rollover occured.
+   */
+  if ((dec->dist_prev - *dist) > (ODO_MAX / 2)) {
+    *dist += ODO_MAX;
+    dec->dist_base += ODO_MAX;
+  }
+
+  /* Don't allow a decrease in distance. Such decrease can happen when
+   * the GPS suddenly stops because it normally anticipates where its
+   * location will be at the time of packet transmission. After a sudden
+   * stop, it may need to correct, i.e. decrease, the distance. */
+  if (*dist < dec->dist_prev) {
+    *dist = dec->dist_prev;
+  } else {
+    dec->dist_prev = *dist;
+  }
+}
+
+/* Column headings and formats of the GPS fields printed in GPS_ROW_FIX
+ * rows. The headings are in imperial and in SI units.
+ */
+static const struct {
+  const char *name[2];
+} gps_columns[GPS_NFIELDS] = {
+  [GPS_STATUS]  = { { "Status", "Status" } },
+  [GPS_ACQ]     = { { "ACQ", "ACQ" } },
+  [GPS_BATTERY] = { { "BAT", "BAT" } },
+  [GPS_SPEED]   = { { "V [mph]", "V [kph]" } },
+  [GPS_DIST]    = { { "D [miles]", "   D [km]" } },
+  [GPS_ALT]     = { { "Alt[ft]", "Alt [m]" } },
+  [GPS_HTRUE]   = { { "Ht", "Ht" } },
+  [GPS_HMAG]    = { { "Hm", "Hm" } },
+  [GPS_LAT]     = { { "Latitude [deg]", "Latitude [deg]" } },
+  [GPS_LON]     = { { "Longitude [deg]", "Longitude [deg]" } },
+  [GPS_SEC]     = { { "sec", "sec" } }
+};
+
+/*
+ * Returns the layout of the GPS packet starting with type, or NULL if the
+ * packet type is unknown.
+ */
+static const struct gps_packet *gps_lookup(unsigned char type) {
+  return gps_packet_index[type] ? &gps_packets[gps_packet_index[type] - 1]
+    : NULL;
+}
+
+/*
+ * Extracts the raw value of a packet field from the packet at offset i of
+ * the session data.
+ */
+static long int gps_field(const struct tdr_session *ses, unsigned long int i,
+			  const struct gps_field *f) {
+  const struct gps_bits *b;
+  long int value = 0, bits;
+  int k;
+
+  for (k = 0; (k < GPS_MAX_BITS) && f->bits[k].mask; k++) {
+    b = &f->bits[k];
+    bits = (long int)(SES_DATA(ses, i + b->byte) & b->mask);
+    value += (b->shift >= 0) ? (bits << b->shift) : (bits >> -b->shift);
+  }
+
+  return value;
+}
+
+/*
+ * Prints the column headings of a GPS_ROW_FIX packet.
+ */
+static void gps_heading(struct tdr_decoder *dec, const struct gps_packet *pk) {
+  int k;
+
+  put_str(dec, "             Time\t");
+  for (k = 0; k < pk->nfields; k++) {
+    put_str(dec, "\t");
+    put_str(dec, gps_columns[pk->field[k].id].name[dec->units ? 1 : 0]);
+  }
+  put_str(dec, "\n");
+}
+
+/*
+ * Converts field id of record i to the output units and prints it.
+ */
+static void gps_column(struct tdr_decoder *dec, const struct tdr_records *r,
+		       unsigned long int i, int id) {
+  long int raw = r->field[id][i];
+  double x;
+
+  switch (id) {
+  case GPS_STATUS:
+  case GPS_ACQ:
+  case GPS_BATTERY:
+    put_str(dec, "\t");
+    put_int(dec, (unsigned int) raw, 0, 0);
+    break;
+  case GPS_SPEED:
+    x = (double) raw * SPEED_UNIT;
+    put_str(dec, "\t");
+    put_fixed(dec, unit_conv(dec, x), 5, 1, 0);
+    break;
+  case GPS_DIST:
+    x = (double) raw * DIST_UNIT;
+    put_str(dec, "\t");
+    put_fixed(dec, unit_conv(dec, x), 9, 3, 0);
+    break;
+  case GPS_ALT:
+    x = (double)(raw - ALT_OFFSET) * ALT_UNIT;
+    put_str(dec, "\t");
+    put_fixed(dec, (dec->units == 0) ? x : FT_TO_M(x), 7, 1, 0);
+    break;
+  case GPS_HTRUE:
+  case GPS_HMAG:
+    put_str(dec, "\t");
+    put_int(dec, raw * HEADING_UNIT, 4, 0);
+    break;
+  case GPS_LAT:
+    x = (double) raw * LL_UNIT_DEG;
+    put_str(dec, "\t");
+    put_fixed(dec, x, 14, 9, 0);
+    break;
+  case GPS_LON:
+    x = (double) raw * LL_UNIT_DEG;
+    x = ( x < 180 ) ? x : x - 360 ; /* Westerly long. is negative */
+    put_str(dec, "\t");
+    put_fixed(dec, x, 15, 9, 0);
+    break;
+  case GPS_SEC:
+    put_str(dec, "\t");
+    put_fixed(dec, (double) raw * 0.25, 5, 2, 0);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Prints GPS records from to to. The column headings are printed before
+ * the first packet of each type.
+ */
+static void gps_print(struct tdr_decoder *dec, const struct tdr_session *ses,
+		      const struct tdr_records *r, unsigned long int from,
+		      unsigned long int to) {
+  const struct gps_packet *pk;
+  unsigned long int i;
+  int k;
+
+  for (i = from; i < to; i++) {
+    pk = r->layout[i];
+
+    switch (pk->row) {
+    case GPS_ROW_ERROR:
+      packet_error(dec, ses->start, r->sec[i], r->bpm[i]);
+      break;
+
+    case GPS_ROW_TIME:
+      /* Note: Year in GPS time packets is 2001 based in contrary to the
+       * 2000 year base in headers/footers of sessions. The time is GMT.
+       */
+      time_stamp(dec, ses->start, r->sec[i]);
+      put_str(dec, dec->time_str);
+      put_str(dec, "\t");
+      put_int(dec, (int) r->field[GPS_YEAR][i] + 2001, 0, 0);
+      put_str(dec, "-");
+      put_int(dec, (int) r->field[GPS_MONTH][i], 2, 1);
+      put_str(dec, "-");
+      put_int(dec, (int) r->field[GPS_DAY][i], 2, 1);
+      put_str(dec, " ");
+      put_int(dec, (int) r->field[GPS_HOUR][i], 2, 0);
+      put_str(dec, ":");
+      put_int(dec, (int) r->field[GPS_MIN][i], 2, 1);
+      put_str(dec, ":");
+      put_fixed(dec, (float) r->field[GPS_SEC][i] * 0.25, 5, 2, 1);
+      put_str(dec, " GMT\n");
+      break;
+
+    case GPS_ROW_FIX:
+    default:
+      if (r->first[i]) gps_heading(dec, pk);
+      time_stamp(dec, ses->start, r->sec[i]);
+      put_str(dec, dec->time_str);
+      for (k = 0; k < pk->nfields; k++) {
+	gps_column(dec, r, i, pk->field[k].id);
+      }
+      put_str(dec, "\n");
+      break;
+    }
+  }
+}
+
+/*
+ * Prints the records from to to of an HRM or GPS session.
+ */
+static int print_records(struct tdr_decoder *dec,
+			 const struct tdr_session *ses,
+			 const struct tdr_records *r, unsigned long int from,
+			 unsigned long int to) {
+  if ((ses->header.dev & SESSION_MASK) == GPS_SESSION) {
+    gps_print(dec, ses, r, from, to);
+  } else {
+    hrm_print(dec, ses, r, from, to);
+  }
+  return writer_flush(dec);
+}
+
+/* The text listing: one file or stdout section per session */
+const struct tdr_sink tdr_text_sink = {
+  "text", 1, open_session, print_records, close_session_file
+};
+/*
+ * Returns 1 if the GPS packet layout pk has field id.
+ */
+static int packet_has(const struct gps_packet *pk, int id) {
+  int k;
+
+  for (k = 0; k < pk->nfields; k++) {
+    if (pk->field[k].id == id) return 1;
+  }
+  return 0;
+}
+
+/*
+ * Converts a raw latitude or longitude to a signed value, negative for
+ * south and west.
+ */
+static int32_t gps_signed(int32_t raw) {
+  return (raw < (1 << 23)) ? raw : raw - (1 << 24);
+}
+
+/*
+ * Returns 1 if GPS record i is a position fix: it has a position and,
+ * if the packet reports it, an acquisition.
+ */
+static int gps_fix(const struct tdr_records *r, unsigned long int i) {
+  const struct gps_packet *pk = r->layout[i];
+
+  return (packet_has(pk, GPS_LAT) && packet_has(pk, GPS_LON) &&
+	  (!packet_has(pk, GPS_ACQ) || (r->field[GPS_ACQ][i] > 0)));
+}
+
+/*
+ * Adds GPS record i to the summary of the position fixes.
+ */
+static void fixes_update(struct tdr_records *r, unsigned long int i) {
+  const struct gps_packet *pk = r->layout[i];
+  struct tdr_fixes *f = &r->fix;
+  int32_t lat, lon;
+
+  if (packet_has(pk, GPS_SPEED) && (r->field[GPS_SPEED][i] > f->speed_max)) {
+    f->speed_max = r->field[GPS_SPEED][i];
+  }
+  if (packet_has(pk, GPS_DIST)) f->dist = r->field[GPS_DIST][i];
+
+  if (!gps_fix(r, i)) return;
+
+  lat = gps_signed(r->field[GPS_LAT][i]);
+  lon = gps_signed(r->field[GPS_LON][i]);
+  if (f->n++ == 0) {
+    f->first = i;
+    f->lat_min = f->lat_max = lat;
+    f->lon_min = f->lon_max = lon;
+  }
+  if (lat < f->lat_min) f->lat_min = lat;
+  if (lat > f->lat_max) f->lat_max = lat;
+  if (lon < f->lon_min) f->lon_min = lon;
+  if (lon > f->lon_max) f->lon_max = lon;
+  f->last = i;
+}
+
+/*
+ * Writes n bytes of p to the session output, padded with zeros to a
+ * multiple of 8 bytes.
+ */
+static void bin_write(struct tdr_decoder *dec, const void *p, size_t n) {
+  static const char zero[8];
+
+  if (dec->err) return;
+  if (((n > 0) && (fwrite(p, n, 1, dec->fp) != 1)) ||
+      ((n % 8) && (fwrite(zero, 8 - n % 8, 1, dec->fp) != 1))) {
+    decoder_failed(dec, "Error writing to a file");
+  }
+}
+
+/*
+ * Returns the size of a column of n bytes in a binary session file.
+ */
+static uint64_t bin_align(uint64_t n) {
+  return (n + 7) & ~(uint64_t) 7;
+}
+
+static void bin_time(uint32_t *t, const struct tdr_header *hdr) {
+  t[0] = (unsigned char) hdr->dev;
+  t[1] = hdr->year;
+  t[2] = hdr->month;
+  t[3] = hdr->day;
+  t[4] = hdr->hour;
+  t[5] = hdr->min;
+  t[6] = hdr->sec;
+}
+
+/*
+ * Opens the binary file of an HRM or GPS session.
+ */
+static int bin_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+
+  return open_session_file(dec, gps ? GPS_FILE_EXT "." TDR_BIN_EXT : 
+			   HRM_FILE_EXT "." TDR_BIN_EXT,
+			   &(ses->header), &(ses->footer));
+}
+
+/*
+ * Fills the header of the file of a session of n records, except for the
+ * column offsets.
+ */
+static void bin_header(struct tdr_bin_header *h, const char *magic,
+		       const struct tdr_session *ses, uint64_t n) {
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, magic, sizeof(h->magic));
+  h->order = TDR_BIN_ORDER;
+  h->index_step = TDR_BIN_INDEX_STEP;
+  h->start = ses->start;
+  bin_time(h->header, &ses->header);
+  bin_time(h->footer, &ses->footer);
+  h->n = n;
+}
+
+/*
+ * Sets the column offsets of the binary file of a session of n records
+ * and returns the size of the file.
+ */
+static uint64_t bin_layout(struct tdr_bin_header *h, uint64_t n, int gps) {
+  uint64_t off = sizeof(*h);
+  int k;
+
+  h->sec = off;
+  off += bin_align(n * sizeof(double));
+  h->bpm = off;
+  off += bin_align(n);
+  h->error = off;
+  off += num_of_pages(n, 64) * sizeof(uint64_t);
+  if (gps) {
+    h->type = off;
+    off += bin_align(n);
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      h->field[k] = off;
+      off += bin_align(n * sizeof(int32_t));
+    }
+  }
+  h->index = off;
+
+  return off + num_of_pages(n, TDR_BIN_INDEX_STEP) * sizeof(double);
+}
+
+/*
+ * Writes the records of a session (the binary sink is not buffered, so
+ * from is always 0) as a binary session file.
+ */
+static int bin_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to) {
+  struct tdr_bin_header h;
+  unsigned long int i, n = to, nerr = num_of_pages(to, 64);
+  unsigned long int nindex = num_of_pages(to, TDR_BIN_INDEX_STEP);
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+  unsigned char *type = NULL;
+  int32_t *col = NULL;
+  uint64_t *error;
+  double *index;
+  int k;
+
+  bin_header(&h, TDR_BIN_MAGIC, ses, n);
+  bin_layout(&h, n, gps);
+
+  error = malloc(nerr * sizeof(*error) + 1);
+  index = malloc(nindex * sizeof(*index) + 1);
+  if (gps) {
+    type = malloc(n + 1);
+    col = malloc(n * sizeof(*col) + 1);
+  }
+  if (!error || !index || (gps && (!type || !col))) {
+    decoder_failed(dec, "Couldn't allocate memory");
+    free(error);
+    free(index);
+    free(type);
+    free(col);
+    return -1;
+  }
+
+  /* Bits past the last record are cleared */
+  memcpy(error, r->error, nerr * sizeof(*error));
+  if (n % 64) error[nerr - 1] &= ((uint64_t) 1 << (n % 64)) - 1;
+
+  for (i = 0; i < nindex; i++) {
+    index[i] = r->sec[i * TDR_BIN_INDEX_STEP];
+  }
+
+  bin_write(dec, &h, sizeof(h));
+  bin_write(dec, r->sec, n * sizeof(*r->sec));
+  bin_write(dec, r->bpm, n);
+  bin_write(dec, error, nerr * sizeof(*error));
+
+  if (gps) {
+    for (i = 0; i < n; i++) {
+      type[i] = r->layout[i]->type;
+    }
+    bin_write(dec, type, n);
+
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      for (i = 0; i < n; i++) {
+	col[i] = packet_has(r->layout[i], k) ? r->field[k][i] : 0;
+      }
+      bin_write(dec, col, n * sizeof(*col));
+    }
+  }
+
+  bin_write(dec, index, nindex * sizeof(*index));
+
+  free(error);
+  free(index);
+  free(type);
+  free(col);
+  return dec->err;
+}
+
+/* Binary session files YYYYMMDD_HHMMSS-HHMMSS.{gps,hrm}.tdb */
+const struct tdr_sink tdr_binary_sink = {
+  "binary", 0, bin_begin, bin_records, close_session_file
+};
+
+/*
+ * Packed session files: the header of a binary session file followed by
+ * the columns coded as described in libtimexdr.h.
+ */
+
+/* A growing output buffer of the packed columns, and the pending run of
+ * zero values. bad is set if the buffer could not grow.
+ */
+struct pack_buf {
+  unsigned char *p;
+  size_t len, size;
+  uint64_t zeros;
+  int bad;
+};
+
+static uint64_t zigzag(int64_t v) {
+  return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static int64_t unzigzag(uint64_t u) {
+  return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
+
+static void pack_varint(struct pack_buf *b, uint64_t v) {
+  unsigned char *p;
+
+  if (b->bad) return;
+  if (b->len + 10 > b->size) {
+    if (!(p = realloc(b->p, b->size ? 2 * b->size : TDR_ZBUF_SIZE))) {
+      b->bad = 1;
+      return;
+    }
+    b->p = p;
+    b->size = b->size ? 2 * b->size : TDR_ZBUF_SIZE;
+  }
+  while (v >= 0x80) {
+    b->p[b->len++] = (unsigned char) v | 0x80;
+    v >>= 7;
+  }
+  b->p[b->len++] = (unsigned char) v;
+}
+
+/*
+ * Ends the pending run of zeros: a zero followed by the length - 1.
+ */
+static void pack_flush(struct pack_buf *b) {
+  if (b->zeros) {
+    pack_varint(b, 0);
+    pack_varint(b, b->zeros - 1);
+    b->zeros = 0;
+  }
+}
+
+static void pack_value(struct pack_buf *b, uint64_t v) {
+  if (v == 0) {
+    b->zeros++;
+  } else {
+    pack_flush(b);
+    pack_varint(b, v);
+  }
+}
+
+/*
+ * Sets the fields of the packets of every GPS packet type as bit masks.
+ */
+static void packet_masks(uint32_t *fields) {
+  const struct gps_packet *pk;
+  int t, k;
+
+  for (t = 0; t < 256; t++) {
+    fields[t] = 0;
+    if (!gps_packet_index[t]) continue;
+    pk = &gps_packets[gps_packet_index[t] - 1];
+    for (k = 0; k < pk->nfields; k++) {
+      fields[t] |= (uint32_t) 1 << pk->field[k].id;
+    }
+  }
+}
+
+/*
+ * Opens the packed file of an HRM or GPS session.
+ */
+static int pack_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+
+  return open_session_file(dec, gps ? GPS_FILE_EXT "." TDR_PACK_EXT : 
+			   HRM_FILE_EXT "." TDR_PACK_EXT,
+			   &(ses->header), &(ses->footer));
+}
+
+/*
+ * Writes the records of a session (the packed sink is not buffered, so
+ * from is always 0) as a packed session file.
+ */
+static int pack_records(struct tdr_decoder *dec,
+			const struct tdr_session *ses,
+			const struct tdr_records *r, unsigned long int from,
+			unsigned long int to) {
+  struct tdr_bin_header h;
+  struct pack_buf b;
+  unsigned long int i, n = to, nerr = num_of_pages(to, 64);
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+  uint64_t bits, prev = 0, delta = 0, word;
+  uint32_t fields[256];
+  int64_t last, step;
+  int k;
+
+  memset(&b, 0, sizeof(b));
+  bin_header(&h, TDR_PACK_MAGIC, ses, n);
+
+  /* Bit patterns of the times, as the sums of the steps are not exact */
+  h.sec = sizeof(h);
+  for (i = 0; i < n; i++) {
+    memcpy(&bits, &r->sec[i], sizeof(bits));
+    pack_value(&b, zigzag((int64_t) (bits - prev - delta)));
+    delta = bits - prev;
+    prev = bits;
+  }
+  pack_flush(&b);
+
+  h.bpm = sizeof(h) + b.len;
+  for (i = 0, last = 0; i < n; i++) {
+    pack_value(&b, zigzag(r->bpm[i] - last));
+    last = r->bpm[i];
+  }
+  pack_flush(&b);
+
+  /* Bits past the last record are cleared */
+  h.error = sizeof(h) + b.len;
+  for (i = 0; i < nerr; i++) {
+    word = r->error[i];
+    if ((i == nerr - 1) && (n % 64)) word &= ((uint64_t) 1 << (n % 64)) - 1;
+    pack_value(&b, word);
+  }
+  pack_flush(&b);
+
+  if (gps) {
+    h.type = sizeof(h) + b.len;
+    for (i = 0, last = 0; i < n; i++) {
+      pack_value(&b, zigzag(r->layout[i]->type - last));
+      last = r->layout[i]->type;
+    }
+    pack_flush(&b);
+
+    /* Only the packets holding the field */
+    packet_masks(fields);
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      h.field[k] = sizeof(h) + b.len;
+      for (i = 0, last = 0, step = 0; i < n; i++) {
+	if (!(fields[r->layout[i]->type] & ((uint32_t) 1 << k))) continue;
+	if (k == GPS_SEC) {
+	  pack_value(&b, zigzag(r->field[k][i] - last - step));
+	  step = r->field[k][i] - last;
+	} else {
+	  pack_value(&b, zigzag(r->field[k][i] - last));
+	}
+	last = r->field[k][i];
+      }
+      pack_flush(&b);
+    }
+  }
+  h.index = sizeof(h) + b.len;        /* End of the columns */
+
+  if (b.bad) {
+    free(b.p);
+    return decoder_failed(dec, "Couldn't allocate memory");
+  }
+  bin_write(dec, &h, sizeof(h));
+  bin_write(dec, b.p, b.len);
+  free(b.p);
+  return dec->err;
+}
+
+/* Packed session files YYYYMMDD_HHMMSS-HHMMSS.{gps,hrm}.tdp */
+const struct tdr_sink tdr_packed_sink = {
+  "packed", 0, pack_begin, pack_records, close_session_file
+};
+
+/*
+ * Returns the column of n bytes at offset off of a binary session file,
+ * or NULL if it is not within the file.
+ */
+static const void *bin_column(const struct tdr_bin *bin, uint64_t off,
+			      uint64_t n) {
+  if ((off < sizeof(struct tdr_bin_header)) || (off % 8) ||
+      (off > bin->size) || (n > bin->size - off)) {
+    return NULL;
+  }
+  return bin->map + off;
+}
+
+/*
+ * Reports a corrupted session file and releases buf. Returns NULL.
+ */
+static void *bin_corrupted(const char *path, void *buf) {
+  fprintf(stderr, "%s: %s is not a valid session file.\n", tdr_progname, path);
+  free(buf);
+  return NULL;
+}
+
+/*
+ * Reports a session file that can't be read and releases buf. Returns
+ * NULL.
+ */
+static void *bin_unreadable(const char *path, void *buf) {
+  fprintf(stderr, "%s: Can't open session file %s (%m).\n", 
+	  tdr_progname, path);
+  free(buf);
+  return NULL;
+}
+
+#if defined(TDR_ZLIB) || defined(TDR_ZSTD)
+/*
+ * Grows the buffer of zload() to hold at least len + TDR_ZBUF_SIZE bytes.
+ * Returns -1 if it can't be grown.
+ */
+static int zload_grow(unsigned char **buf, size_t *size, size_t len) {
+  unsigned char *p;
+  size_t n = *size;
+
+  while (len + TDR_ZBUF_SIZE > n) n = n ? 2 * n : TDR_ZBUF_SIZE;
+  if (n == *size) return 0;
+  if (!(p = realloc(*buf, n))) {
+    return failed("Couldn't allocate memory");
+  }
+  *buf = p;
+  *size = n;
+  return 0;
+}
+#endif
+
+/*
+ * Reads the compressed session file path into memory. Returns NULL if the
+ * file can't be read or is corrupted, which is reported.
+ */
+static unsigned char *zload(const char *path, int method, size_t *len) {
+  unsigned char *buf = NULL;
+#if defined(TDR_ZLIB) || defined(TDR_ZSTD)
+  size_t size = 0;
+#endif
+#ifdef TDR_ZLIB
+  gzFile gz;
+  int k;
+#endif
+#ifdef TDR_ZSTD
+  unsigned char in[TDR_ZBUF_SIZE];
+  ZSTD_DCtx *dctx;
+  ZSTD_inBuffer i;
+  ZSTD_outBuffer o;
+  size_t left = 1;
+  FILE *fp;
+#endif
+
+  *len = 0;
+  switch (method) {
+#ifdef TDR_ZLIB
+  case TDR_COMPRESS_GZIP:
+    if (!(gz = gzopen(path, "rb"))) return bin_unreadable(path, NULL);
+    do {
+      if (zload_grow(&buf, &size, *len) < 0) {
+	gzclose_r(gz);
+	free(buf);
+	return NULL;
+      }
+      if ((k = gzread(gz, buf + *len, TDR_ZBUF_SIZE)) < 0) {
+	gzclose_r(gz);
+	return bin_corrupted(path, buf);
+      }
+      *len += k;
+    } while (k > 0);
+    gzclose_r(gz);
+    break;
+#endif
+#ifdef TDR_ZSTD
+  case TDR_COMPRESS_ZSTD:
+    if (!(fp = fopen(path, "rb"))) return bin_unreadable(path, NULL);
+    if (!(dctx = ZSTD_createDCtx())) {
+      failed("Couldn't allocate memory");
+      fclose(fp);
+      return NULL;
+    }
+    while ((i.size = fread(in, 1, sizeof(in), fp)) > 0) {
+      i.src = in;
+      i.pos = 0;
+      do {
+	if (zload_grow(&buf, &size, *len) < 0) {
+	  ZSTD_freeDCtx(dctx);
+	  fclose(fp);
+	  free(buf);
+	  return NULL;
+	}
+	o.dst = buf + *len;
+	o.size = TDR_ZBUF_SIZE;
+	o.pos = 0;
+	left = ZSTD_decompressStream(dctx, &o, &i);
+	if (ZSTD_isError(left)) {
+	  ZSTD_freeDCtx(dctx);
+	  fclose(fp);
+	  return bin_corrupted(path, buf);
+	}
+	*len += o.pos;
+      } while ((i.pos < i.size) || (o.pos == o.size));
+    }
+    ZSTD_freeDCtx(dctx);
+    if (ferror(fp)) {
+      fclose(fp);
+      return bin_unreadable(path, buf);
+    }
+    fclose(fp);
+    if (left != 0) return bin_corrupted(path, buf);   /* Truncated */
+    break;
+#endif
+  default:
+    errno = ENOSYS;                   /* Not built in */
+    return bin_unreadable(path, NULL);
+  }
+
+  return buf;
+}
+
+/* Reads a column of a packed session file */
+struct pack_reader {
+  const unsigned char *p, *end;
+  uint64_t zeros;                     /* Left of a run of zeros */
+  int bad;
+};
+
+/*
+ * Starts reading the column at from up to to of the packed file of size
+ * bytes at map.
+ */
+static void unpack_start(struct pack_reader *rd, const unsigned char *map,
+			 size_t size, uint64_t from, uint64_t to) {
+  rd->bad = (from < sizeof(struct tdr_bin_header)) || (from > to) || 
+    (to > size);
+  rd->p = map + (rd->bad ? 0 : from);
+  rd->end = map + (rd->bad ? 0 : to);
+  rd->zeros = 0;
+}
+
+static uint64_t unpack_varint(struct pack_reader *rd) {
+  uint64_t v = 0;
+  int shift;
+
+  for (shift = 0; (rd->p < rd->end) && (shift < 64); shift += 7) {
+    v |= (uint64_t) (*rd->p & 0x7f) << shift;
+    if (!(*rd->p++ & 0x80)) return v;
+  }
+  rd->bad = 1;
+  return 0;
+}
+
+static uint64_t unpack_value(struct pack_reader *rd) {
+  uint64_t v;
+
+  if (rd->zeros) {
+    rd->zeros--;
+    return 0;
+  }
+  if ((v = unpack_varint(rd)) == 0) rd->zeros = unpack_varint(rd);
+  return v;
+}
+
+/*
+ * Checks that the column was read to its end. Returns -1 if it was not.
+ */
+static int unpack_end(struct pack_reader *rd) {
+  return (rd->bad || rd->zeros || (rd->p != rd->end)) ? -1 : 0;
+}
+
+/*
+ * Decodes the packed session file path of psize bytes at map into a
+ * binary session file of *size bytes, which is returned. Returns NULL if
+ * the file is corrupted.
+ */
+static unsigned char *unpack(const char *path, const unsigned char *map,
+			     size_t psize, size_t *size) {
+  const struct tdr_bin_header *p = (const struct tdr_bin_header *) map;
+  struct tdr_bin_header l, *h;
+  struct pack_reader rd;
+  unsigned char *bin, *bpm, *type = NULL;
+  double *sec, *index;
+  uint64_t *error, bits, prev = 0, delta = 0, i, n;
+  uint32_t fields[256];
+  int32_t *col;
+  int64_t last, step;
+  int k, gps;
+
+  if ((psize < sizeof(*p)) || (p->order != TDR_BIN_ORDER) || 
+      (p->n > UINT32_MAX)) {
+    return bin_corrupted(path, NULL);
+  }
+  n = p->n;
+  gps = ((p->header[0] & SESSION_MASK) == GPS_SESSION);
+
+  /* The padding of the columns stays zero */
+  *size = bin_layout(&l, n, gps);
+  if (!(bin = calloc(1, *size))) {
+    failed("Couldn't allocate memory");
+    return NULL;
+  }
+  h = (struct tdr_bin_header *) bin;
+  *h = l;
+  memcpy(h->magic, TDR_BIN_MAGIC, sizeof(h->magic));
+  h->order = TDR_BIN_ORDER;
+  h->index_step = TDR_BIN_INDEX_STEP;
+  h->start = p->start;
+  memcpy(h->header, p->header, sizeof(h->header));
+  memcpy(h->footer, p->footer, sizeof(h->footer));
+  h->n = n;
+
+  sec = (double *) (bin + h->sec);
+  unpack_start(&rd, map, psize, p->sec, p->bpm);
+  for (i = 0; i < n; i++) {
+    bits = prev + delta + (uint64_t) unzigzag(unpack_value(&rd));
+    delta = bits - prev;
+    prev = bits;
+    memcpy(&sec[i], &bits, sizeof(bits));
+  }
+  if (unpack_end(&rd) < 0) return bin_corrupted(path, bin);
+
+  bpm = bin + h->bpm;
+  unpack_start(&rd, map, psize, p->bpm, p->error);
+  for (i = 0, last = 0; i < n; i++) {
+    bpm[i] = last += unzigzag(unpack_value(&rd));
+  }
+  if (unpack_end(&rd) < 0) return bin_corrupted(path, bin);
+
+  error = (uint64_t *) (bin + h->error);
+  unpack_start(&rd, map, psize, p->error, gps ? p->type : p->index);
+  for (i = 0; i < num_of_pages(n, 64); i++) {
+    error[i] = unpack_value(&rd);
+  }
+  if (unpack_end(&rd) < 0) return bin_corrupted(path, bin);
+
+  if (gps) {
+    type = bin + h->type;
+    unpack_start(&rd, map, psize, p->type, p->field[0]);
+    for (i = 0, last = 0; i < n; i++) {
+      type[i] = last += unzigzag(unpack_value(&rd));
+    }
+    if (unpack_end(&rd) < 0) return bin_corrupted(path, bin);
+
+    packet_masks(fields);
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      col = (int32_t *) (bin + h->field[k]);
+      unpack_start(&rd, map, psize, p->field[k], 
+		   (k + 1 < GPS_NFIELDS) ? p->field[k + 1] : p->index);
+      for (i = 0, last = 0, step = 0; i < n; i++) {
+	if (!(fields[type[i]] & ((uint32_t) 1 << k))) continue;
+	if (k == GPS_SEC) {
+	  step += unzigzag(unpack_value(&rd));
+	  col[i] = last += step;
+	} else {
+	  col[i] = last += unzigzag(unpack_value(&rd));
+	}
+      }
+      if (unpack_end(&rd) < 0) return bin_corrupted(path, bin);
+    }
+  }
+
+  index = (double *) (bin + h->index);
+  for (i = 0; i < num_of_pages(n, TDR_BIN_INDEX_STEP); i++) {
+    index[i] = sec[i * TDR_BIN_INDEX_STEP];
+  }
+
+  return bin;
+}
+
+/*
+ * Maps the binary session file path, or reads it into memory if it ends
+ * in .gz or .zst. A packed session file is decoded into memory. Only the
+ * packet layouts of a GPS session are looked up; the columns are used in
+ * place. Returns NULL if the file can't be read or is corrupted.
+ */
+struct tdr_bin *tdr_bin_open(const char *path) {
+  const struct tdr_bin_header *h;
+  struct tdr_records *r;
+  struct tdr_bin *bin;
+  struct stat st;
+  unsigned long int i;
+  const unsigned char *type = NULL;
+  void *map, *packed;
+  size_t size, psize;
+  int fd, k, gps, method = tdr_compress_suffix(path);
+  int loaded = (method != TDR_COMPRESS_NONE);
+
+  if (method != TDR_COMPRESS_NONE) {
+    if (!(map = zload(path, method, &size))) return NULL;
+  } else if (((fd = open(path, O_RDONLY)) < 0) || (fstat(fd, &st) < 0) ||
+	     ((map = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, 
+			  MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+    bin_unreadable(path, NULL);
+    if (fd >= 0) close(fd);
+    return NULL;
+  } else {
+    close(fd);
+    size = st.st_size;
+  }
+
+  if ((size >= sizeof(*h)) && 
+      (memcmp(map, TDR_PACK_MAGIC, sizeof(h->magic)) == 0)) {
+    packed = map;
+    psize = size;
+    map = unpack(path, packed, psize, &size);
+    if (loaded) {
+      free(packed);
+    } else {
+      munmap(packed, psize);
+    }
+    if (!map) return NULL;
+    loaded = 1;
+  }
+
+  if (!(bin = calloc(1, sizeof(*bin)))) {
+    failed("Couldn't allocate memory");
+    if (loaded) {
+      free(map);
+    } else {
+      munmap(map, size ? size : 1);
+    }
+    return NULL;
+  }
+  bin->map = map;
+  bin->size = size;
+  bin->loaded = loaded;
+  bin->hdr = h = map;
+  r = &bin->rec;
+
+  if ((bin->size < sizeof(*h)) ||
+      memcmp(h->magic, TDR_BIN_MAGIC, sizeof(h->magic)) ||
+      (h->order != TDR_BIN_ORDER) || (h->index_step == 0) ||
+      (h->n > bin->size)) {
+    tdr_bin_close(bin);
+    return bin_corrupted(path, NULL);
+  }
+
+  bin->ses.start = h->start;
+  bin->ses.header.dev = h->header[0];
+  bin->ses.header.year = h->header[1];
+  bin->ses.header.month = h->header[2];
+  bin->ses.header.day = h->header[3];
+  bin->ses.header.hour = h->header[4];
+  bin->ses.header.min = h->header[5];
+  bin->ses.header.sec = h->header[6];
+  bin->ses.footer.dev = h->footer[0];
+  bin->ses.footer.year = h->footer[1];
+  bin->ses.footer.month = h->footer[2];
+  bin->ses.footer.day = h->footer[3];
+  bin->ses.footer.hour = h->footer[4];
+  bin->ses.footer.min = h->footer[5];
+  bin->ses.footer.sec = h->footer[6];
+  gps = ((bin->ses.header.dev & SESSION_MASK) == GPS_SESSION);
+
+  r->n = r->size = h->n;
+  bin->nindex = num_of_pages(r->n, h->index_step);
+  r->sec = (double *) bin_column(bin, h->sec, r->n * sizeof(*r->sec));
+  r->bpm = (unsigned char *) bin_column(bin, h->bpm, r->n);
+  r->error = (uint64_t *) bin_column(bin, h->error, 
+				     num_of_pages(r->n, 64) * 
+				     sizeof(*r->error));
+  bin->index = bin_column(bin, h->index, bin->nindex * sizeof(*bin->index));
+  if (!r->sec || !r->bpm || !r->error || !bin->index) {
+    tdr_bin_close(bin);
+    return bin_corrupted(path, NULL);
+  }
+
+  if (gps) {
+    type = bin_column(bin, h->type, r->n);
+    for (k = 0; k < GPS_NFIELDS; k++) {
+      r->field[k] = (int32_t *) bin_column(bin, h->field[k], 
+					   r->n * sizeof(*r->field[k]));
+      if (!r->field[k]) {
+	tdr_bin_close(bin);
+	return bin_corrupted(path, NULL);
+      }
+    }
+
+    r->layout = malloc(r->n * sizeof(*r->layout) + 1);
+    r->first = malloc(r->n + 1);
+    if (!r->layout || !r->first) {
+      failed("Couldn't allocate memory");
+      tdr_bin_close(bin);
+      return NULL;
+    }
+    for (i = 0; type && (i < r->n); i++) {
+      if (gps_packet_index[type[i]] == 0) break;
+      r->layout[i] = &gps_packets[gps_packet_index[type[i]] - 1];
+      fixes_update(r, i);
+    }
+    if (!type || (i < r->n)) {
+      tdr_bin_close(bin);
+      return bin_corrupted(path, NULL);
+    }
+  }
+
+  return bin;
+}
+
+/*
+ * Unmaps or frees a binary session file.
+ */
+void tdr_bin_close(struct tdr_bin *bin) {
+  if (bin->loaded) {
+    free((void *) bin->map);
+  } else {
+    munmap((void *) bin->map, bin->size ? bin->size : 1);
+  }
+  free(bin->rec.layout);
+  free(bin->rec.first);
+  free(bin);
+}
+
+/*
+ * Returns the first record of a binary session file at or after sec
+ * seconds from the session start. The time index narrows the search
+ * down to index_step records.
+ */
+unsigned long int tdr_bin_seek(const struct tdr_bin *bin, double sec) {
+  unsigned long int lo = 0, hi = bin->nindex, mid, i;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (bin->index[mid] < sec) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  i = (lo > 0) ? (lo - 1) * bin->hdr->index_step : 0;
+  while ((i < bin->rec.n) && (bin->rec.sec[i] < sec)) i++;
+  return i;
+}
+
+/*
+ * Hands the records from to to of a binary session file to the sink of
+ * the decoder, as if the session had just been decoded. Returns -1 if the
+ * output failed.
+ */
+int tdr_bin_output(struct tdr_decoder *dec, struct tdr_bin *bin,
+		   unsigned long int from, unsigned long int to) {
+  struct tdr_records *r = &bin->rec;
+  unsigned char seen[GPS_NPACKETS];
+  unsigned long int i;
+
+  if (to > r->n) to = r->n;
+  if (from > to) from = to;
+
+  /* Column headings are printed before the first packet of each type */
+  if (r->layout) {
+    memset(seen, 0, sizeof(seen));
+    for (i = from; i < to; i++) {
+      r->first[i] = !seen[r->layout[i] - gps_packets];
+      seen[r->layout[i] - gps_packets] = 1;
+    }
+  }
+
+  if ((sink_begin(dec, &bin->ses) < 0) ||
+      (dec->sink->records && 
+       (dec->sink->records(dec, &bin->ses, r, from, to) < 0))) {
+    sink_end(dec, &bin->ses);
+    return -1;
+  }
+  return sink_end(dec, &bin->ses);
+}
+
+/*
+ * Appends the time stamp of a record as an XML date and time,
+ * "YYYY-MM-DDTHH:MM:SS.ff+zz:zz".
+ */
+static void put_xml_time(struct tdr_decoder *dec, const time_t st,
+			 double seconds) {
+  const char *s = dec->time_str;
+
+  time_stamp(dec, st, seconds);
+  if (strlen(s) != TIME_STR_LENGTH - 1) {
+    put_str(dec, s);
+    return;
+  }
+  put_mem(dec, s, 10);
+  put_str(dec, "T");
+  put_mem(dec, s + 11, 14);
+  put_str(dec, ":");
+  put_mem(dec, s + 25, 2);
+}
+
+/*
+ * Appends a time as an XML date and time in UTC.
+ */
+static void put_utc_time(struct tdr_decoder *dec, const time_t t) {
+  char s[TIME_STR_LENGTH];
+  struct tm tm;
+
+  gmtime_r(&t, &tm);
+  strftime(s, sizeof(s), "%Y-%m-%dT%H:%M:%SZ", &tm);
+  put_str(dec, s);
+}
+
+/*
+ * Appends a raw latitude or longitude in degrees.
+ */
+static void put_degrees(struct tdr_decoder *dec, int32_t raw) {
+  put_fixed(dec, (double) gps_signed(raw) * LL_UNIT_DEG, 0, 9, 0);
+}
+
+/*
+ * Opens the XML document of a GPS session; HRM sessions are skipped.
+ */
+static int xml_open(struct tdr_decoder *dec, const struct tdr_session *ses,
+		    char *ext) {
+  if ((ses->header.dev & SESSION_MASK) == GPS_SESSION) {
+    return open_session_file(dec, ext, &(ses->header), &(ses->footer));
+  }
+  return dec->err;
+}
+
+static int gpx_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  return xml_open(dec, ses, "gpx");
+}
+
+static int tcx_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  return xml_open(dec, ses, "tcx");
+}
+
+static int hst_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  return xml_open(dec, ses, "hst");
+}
+
+static int xml_close(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  if ((ses->header.dev & SESSION_MASK) == GPS_SESSION) {
+    return close_session_file(dec, ses);
+  }
+  return dec->err;
+}
+
+/*
+ * Writes the position fixes among the records from to to of a GPS
+ * session as a GPX 1.1 track. The bounds were gathered by the decoder.
+ */
+static int gpx_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to) {
+  static const char *fix_type[] = { "none", "none", "2d", "3d" };
+  const struct tdr_fixes *f = &r->fix;
+  const struct tdr_header *hdr = &ses->header;
+  unsigned long int i;
+  long int alt = -1;
+
+  if ((hdr->dev & SESSION_MASK) != GPS_SESSION) return dec->err;
+
+  put_str(dec, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n"
+	  "<gpx xmlns=\"http://www.topografix.com/GPX/1/1\" version=\"1.1\" "
+	  "creator=\"" PACKAGE " " VERSION "\" "
+	  "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+	  "xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 "
+	  "http://www.topografix.com/GPX/1/1/gpx.xsd\">\n"
+	  "<metadata>\n"
+	  "<desc>Recorded by Timex Data Recorder</desc>\n"
+	  "<time>");
+  put_utc_time(dec, ses->start);
+  put_str(dec, "</time>\n");
+  if (f->n) {
+    put_str(dec, "<bounds minlat=\"");
+    put_degrees(dec, f->lat_min);
+    put_str(dec, "\" minlon=\"");
+    put_degrees(dec, f->lon_min);
+    put_str(dec, "\" maxlat=\"");
+    put_degrees(dec, f->lat_max);
+    put_str(dec, "\" maxlon=\"");
+    put_degrees(dec, f->lon_max);
+    put_str(dec, "\"/>\n");
+  }
+  put_str(dec, "</metadata>\n<trk>\n<name>GPS session ");
+  put_int(dec, hdr->year, 4, 1);
+  put_str(dec, "-");
+  put_int(dec, hdr->month, 2, 1);
+  put_str(dec, "-");
+  put_int(dec, hdr->day, 2, 1);
+  put_str(dec, " ");
+  put_int(dec, hdr->hour, 2, 1);
+  put_str(dec, ":");
+  put_int(dec, hdr->min, 2, 1);
+  put_str(dec, ":");
+  put_int(dec, hdr->sec, 2, 1);
+  put_str(dec, "</name>\n<src>Timex Data Recorder</src>\n<trkseg>\n");
+
+  for (i = from; i < to; i++) {
+    if (packet_has(r->layout[i], GPS_ALT)) alt = r->field[GPS_ALT][i];
+    if (!gps_fix(r, i)) continue;
+
+    put_str(dec, "<trkpt lat=\"");
+    put_degrees(dec, r->field[GPS_LAT][i]);
+    put_str(dec, "\" lon=\"");
+    put_degrees(dec, r->field[GPS_LON][i]);
+    put_str(dec, "\">\n");
+    if (alt >= 0) {
+      put_str(dec, " <ele>");
+      put_fixed(dec, FT_TO_M((double)(alt - ALT_OFFSET) * ALT_UNIT), 0, 1, 0);
+      put_str(dec, "</ele>\n");
+    }
+    put_str(dec, " <time>");
+    put_xml_time(dec, ses->start, r->sec[i]);
+    put_str(dec, "</time>\n");
+    if (packet_has(r->layout[i], GPS_ACQ)) {
+      put_str(dec, " <fix>");
+      put_str(dec, fix_type[r->field[GPS_ACQ][i] & 3]);
+      put_str(dec, "</fix>\n");
+    }
+    put_str(dec, "</trkpt>\n");
+  }
+
+  put_str(dec, "</trkseg>\n</trk>\n</gpx>\n");
+  return writer_flush(dec);
+}
+
+/*
+ * Writes the position fixes among the records from to to of a GPS
+ * session as one lap of a Garmin Training Center document, either a
+ * TCX (v2) activity or an HST (v1) run.
+ */
+static int tcd_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to, int v2) {
+  const struct tdr_fixes *f = &r->fix;
+  unsigned long int i;
+  long int alt = -1, dist = -1;
+
+  if ((ses->header.dev & SESSION_MASK) != GPS_SESSION) return dec->err;
+
+  put_str(dec, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n"
+	  "<TrainingCenterDatabase xmlns=\"http://www.garmin.com/xmlschemas/");
+  put_str(dec, v2 ? "TrainingCenterDatabase/v2" : "TrainingCenterDatabase/v1");
+  put_str(dec, "\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+	  "xsi:schemaLocation=\"http://www.garmin.com/xmlschemas/");
+  put_str(dec, v2 ? "TrainingCenterDatabase/v2 http://www.garmin.com/"
+	  "xmlschemas/TrainingCenterDatabasev2.xsd\">\n" :
+	  "TrainingCenterDatabase/v1 http://www.garmin.com/"
+	  "xmlschemas/TrainingCenterDatabasev1.xsd\">\n");
+  if (v2) {
+    put_str(dec, "<Activities>\n<Activity Sport=\"Running\">\n<Id>");
+    put_utc_time(dec, ses->start);
+    put_str(dec, "</Id>\n");
+  } else {
+    put_str(dec, "<History>\n<Running Name=\"Running\">\n<Run>\n");
+  }
+
+  put_str(dec, "<Lap StartTime=\"");
+  if (f->n) {
+    put_xml_time(dec, ses->start, r->sec[f->first]);
+  } else {
+    put_utc_time(dec, ses->start);
+  }
+  put_str(dec, "\">\n <TotalTimeSeconds>");
+  put_fixed(dec, f->n ? r->sec[f->last] - r->sec[f->first] : 0, 0, 2, 0);
+  put_str(dec, "</TotalTimeSeconds>\n <DistanceMeters>");
+  put_fixed(dec, MILES_TO_KM((double) f->dist * DIST_UNIT) * 1000, 0, 1, 0);
+  put_str(dec, "</DistanceMeters>\n <MaximumSpeed>");
+  put_fixed(dec, MILES_TO_KM((double) f->speed_max * SPEED_UNIT) / 3.6, 
+	    0, 2, 0);
+  put_str(dec, "</MaximumSpeed>\n"
+	  " <Calories>0</Calories>\n"
+	  " <Intensity>Active</Intensity>\n"
+	  " <TriggerMethod>Manual</TriggerMethod>\n");
+  if (f->n) put_str(dec, " <Track>\n");
+
+  for (i = from; i < to; i++) {
+    if (packet_has(r->layout[i], GPS_ALT)) alt = r->field[GPS_ALT][i];
+    if (packet_has(r->layout[i], GPS_DIST)) dist = r->field[GPS_DIST][i];
+    if (!gps_fix(r, i)) continue;
+
+    put_str(dec, "<Trackpoint>\n\t<Time>");
+    put_xml_time(dec, ses->start, r->sec[i]);
+    put_str(dec, "</Time>\n\t<Position>\n\t\t<LatitudeDegrees>");
+    put_degrees(dec, r->field[GPS_LAT][i]);
+    put_str(dec, "</LatitudeDegrees>\n\t\t<LongitudeDegrees>");
+    put_degrees(dec, r->field[GPS_LON][i]);
+    put_str(dec, "</LongitudeDegrees>\n\t</Position>\n");
+    if (alt >= 0) {
+      put_str(dec, "\t<AltitudeMeters>");
+      put_fixed(dec, FT_TO_M((double)(alt - ALT_OFFSET) * ALT_UNIT), 0, 1, 0);
+      put_str(dec, "</AltitudeMeters>\n");
+    }
+    if (dist >= 0) {
+      put_str(dec, "\t<DistanceMeters>");
+      put_fixed(dec, MILES_TO_KM((double) dist * DIST_UNIT) * 1000, 0, 1, 0);
+      put_str(dec, "</DistanceMeters>\n");
+    }
+    put_str(dec, "\t<SensorState>Present</SensorState>\n</Trackpoint>\n");
+  }
+
+  if (f->n) put_str(dec, " </Track>\n");
+  put_str(dec, "</Lap>\n");
+  put_str(dec, v2 ? "</Activity>\n</Activities>\n" :
+	  "</Run>\n</Running>\n</History>\n");
+  put_str(dec, "</TrainingCenterDatabase>\n");
+  return writer_flush(dec);
+}
+
+static int tcx_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to) {
+  return tcd_records(dec, ses, r, from, to, 1);
+}
+
+static int hst_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to) {
+  return tcd_records(dec, ses, r, from, to, 0);
+}
+
+/* GPS sessions as YYYYMMDD_HHMMSS-HHMMSS.{gpx,tcx,hst} */
+const struct tdr_sink tdr_gpx_sink = {
+  "gpx", 0, gpx_begin, gpx_records, xml_close
+};
+
+const struct tdr_sink tdr_tcx_sink = {
+  "tcx", 0, tcx_begin, tcx_records, xml_close
+};
+
+const struct tdr_sink tdr_hst_sink = {
+  "hst", 0, hst_begin, hst_records, xml_close
+};
+
+/* Fields of the csv and ndjson records: the GPS_* fields, and */
+#define REC_SESSION         GPS_NFIELDS         /* Session start */
+#define REC_DEVICE          (GPS_NFIELDS + 1)   /* "hrm" or "gps" */
+#define REC_TIME            (GPS_NFIELDS + 2)   /* Local date and time */
+#define REC_SEC             (GPS_NFIELDS + 3)   /* Since the session start */
+#define REC_HR              (GPS_NFIELDS + 4)
+#define REC_ERROR           (GPS_NFIELDS + 5)   /* Packet error */
+#define REC_GMT             (GPS_NFIELDS + 6)   /* GPS time packets */
+
+static const struct {
+  const char *name;
+  int id;
+} rec_columns[] = {
+  { "session", REC_SESSION }, { "device", REC_DEVICE }, { "time", REC_TIME },
+  { "sec", REC_SEC }, { "hr", REC_HR }, { "error", REC_ERROR },
+  { "status", GPS_STATUS }, { "acq", GPS_ACQ }, { "battery", GPS_BATTERY },
+  { "speed", GPS_SPEED }, { "dist", GPS_DIST }, { "alt", GPS_ALT },
+  { "htrue", GPS_HTRUE }, { "hmag", GPS_HMAG }, { "lat", GPS_LAT },
+  { "lon", GPS_LON }, { "gps_sec", GPS_SEC }, { "gmt", REC_GMT }
+};
+
+#define REC_NCOLUMNS  (sizeof(rec_columns) / sizeof(rec_columns[0]))
+
+/* The fields chosen by tdr_set_fields(), all of them by default */
+static int rec_field[TDR_MAX_FIELDS];
+static int rec_nfields = -1;
+
+/*
+ * Chooses the fields of the csv and ndjson records from a comma separated
+ * list of their names. Returns -1 if a name is unknown.
+ */
+int tdr_set_fields(const char *list) {
+  const char *p = list, *e;
+  size_t len;
+  unsigned int k;
+
+  rec_nfields = 0;
+  while (*p) {
+    e = strchr(p, ',');
+    len = e ? (size_t)(e - p) : strlen(p);
+    for (k = 0; k < REC_NCOLUMNS; k++) {
+      if ((strlen(rec_columns[k].name) == len) &&
+	  (strncmp(rec_columns[k].name, p, len) == 0)) {
+	break;
+      }
+    }
+    if ((k == REC_NCOLUMNS) || (rec_nfields == TDR_MAX_FIELDS)) return -1;
+    rec_field[rec_nfields++] = k;
+    p += len + (e ? 1 : 0);
+  }
+  return rec_nfields ? 0 : -1;
+}
+
+/*
+ * Returns the number of fields of the records.
+ */
+static int rec_count(void) {
+  return (rec_nfields < 0) ? (int) REC_NCOLUMNS : rec_nfields;
+}
+
+/*
+ * Returns field k of the records as an index into rec_columns[].
+ */
+static int rec_column(int k) {
+  return (rec_nfields < 0) ? k : rec_field[k];
+}
+
+/*
+ * Returns 1 if record i of a session has field id.
+ */
+static int rec_has(const struct tdr_session *ses, const struct tdr_records *r,
+		   unsigned long int i, int id) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+  int err = (r->error[i / 64] >> (i % 64)) & 1;
+
+  switch (id) {
+  case REC_SESSION:
+  case REC_DEVICE:
+  case REC_TIME:
+  case REC_SEC:
+    return 1;
+  case REC_HR:
+    return !gps && !err;
+  case REC_ERROR:
+    return err;
+  case REC_GMT:
+    return gps && (r->layout[i]->row == GPS_ROW_TIME);
+  default:
+    return gps && (r->layout[i]->row == GPS_ROW_FIX) &&
+      packet_has(r->layout[i], id);
+  }
+}
+
+/*
+ * Appends field id of record i, in the units of the text listing. Text
+ * values are quoted if quote is set.
+ */
+static void rec_value(struct tdr_decoder *dec, const struct tdr_session *ses,
+		      const struct tdr_records *r, unsigned long int i, int id,
+		      int quote) {
+  const struct tdr_header *hdr = &ses->header;
+  long int raw = (id < GPS_NFIELDS) ? r->field[id][i] : 0;
+  double x;
+
+  if (quote && ((id == REC_SESSION) || (id == REC_DEVICE) ||
+		(id == REC_TIME) || (id == REC_ERROR) || (id == REC_GMT))) {
+    put_str(dec, "\"");
+  }
+
+  switch (id) {
+  case REC_SESSION:
+    put_int(dec, hdr->year, 4, 1);
+    put_str(dec, "-");
+    put_int(dec, hdr->month, 2, 1);
+    put_str(dec, "-");
+    put_int(dec, hdr->day, 2, 1);
+    put_str(dec, "T");
+    put_int(dec, hdr->hour, 2, 1);
+    put_str(dec, ":");
+    put_int(dec, hdr->min, 2, 1);
+    put_str(dec, ":");
+    put_int(dec, hdr->sec, 2, 1);
+    break;
+  case REC_DEVICE:
+    put_str(dec, ((hdr->dev & SESSION_MASK) == GPS_SESSION) ? "gps" : "hrm");
+    break;
+  case REC_TIME:
+    put_xml_time(dec, ses->start, r->sec[i]);
+    break;
+  case REC_SEC:
+    put_fixed(dec, r->sec[i], 0, 2, 0);
+    break;
+  case REC_HR:
+    put_int(dec, r->bpm[i], 0, 0);
+    break;
+  case REC_ERROR:
+    put_str(dec, (r->bpm[i] == MISSING_PACKET) ? "missing" : "corrupted");
+    break;
+  case REC_GMT:
+    put_int(dec, r->field[GPS_YEAR][i] + 2001, 4, 1);
+    put_str(dec, "-");
+    put_int(dec, r->field[GPS_MONTH][i], 2, 1);
+    put_str(dec, "-");
+    put_int(dec, r->field[GPS_DAY][i], 2, 1);
+    put_str(dec, "T");
+    put_int(dec, r->field[GPS_HOUR][i], 2, 1);
+    put_str(dec, ":");
+    put_int(dec, r->field[GPS_MIN][i], 2, 1);
+    put_str(dec, ":");
+    put_fixed(dec, r->field[GPS_SEC][i] * 0.25, 5, 2, 1);
+    put_str(dec, "Z");
+    break;
+  case GPS_SPEED:
+    put_fixed(dec, unit_conv(dec, (double) raw * SPEED_UNIT), 0, 1, 0);
+    break;
+  case GPS_DIST:
+    put_fixed(dec, unit_conv(dec, (double) raw * DIST_UNIT), 0, 3, 0);
+    break;
+  case GPS_ALT:
+    x = (double)(raw - ALT_OFFSET) * ALT_UNIT;
+    put_fixed(dec, (dec->units == 0) ? x : FT_TO_M(x), 0, 1, 0);
+    break;
+  case GPS_HTRUE:
+  case GPS_HMAG:
+    put_int(dec, raw * HEADING_UNIT, 0, 0);
+    break;
+  case GPS_LAT:
+  case GPS_LON:
+    put_degrees(dec, raw);
+    break;
+  case GPS_SEC:
+    put_fixed(dec, (double) raw * 0.25, 0, 2, 0);
+    break;
+  default:
+    put_int(dec, raw, 0, 0);
+    break;
+  }
+
+  if (quote && ((id == REC_SESSION) || (id == REC_DEVICE) ||
+		(id == REC_TIME) || (id == REC_ERROR) || (id == REC_GMT))) {
+    put_str(dec, "\"");
+  }
+}
+
+/*
+ * Prints the names of the chosen fields as the CSV heading.
+ */
+static int csv_heading(struct tdr_decoder *dec) {
+  int k, n = rec_count();
+
+  for (k = 0; k < n; k++) {
+    if (k) put_str(dec, ",");
+    put_str(dec, rec_columns[rec_column(k)].name);
+  }
+  put_str(dec, "\n");
+  return writer_flush(dec);
+}
+
+static int csv_begin(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+
+  if (open_session_file(dec, gps ? GPS_FILE_EXT ".csv" : HRM_FILE_EXT ".csv",
+			&(ses->header), &(ses->footer)) < 0) {
+    return -1;
+  }
+  return dec->files ? csv_heading(dec) : 0;
+}
+
+/*
+ * Prints the records from to to as CSV rows. Fields a record does not have
+ * are left empty.
+ */
+static int csv_records(struct tdr_decoder *dec, const struct tdr_session *ses,
+		       const struct tdr_records *r, unsigned long int from,
+		       unsigned long int to) {
+  unsigned long int i;
+  int k, n = rec_count(), col;
+
+  for (i = from; i < to; i++) {
+    for (k = 0; k < n; k++) {
+      col = rec_column(k);
+      if (k) put_str(dec, ",");
+      if (rec_has(ses, r, i, rec_columns[col].id)) {
+	rec_value(dec, ses, r, i, rec_columns[col].id, 0);
+      }
+    }
+    put_str(dec, "\n");
+  }
+  return writer_flush(dec);
+}
+
+static int ndjson_begin(struct tdr_decoder *dec,
+			const struct tdr_session *ses) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+
+  return open_session_file(dec, gps ? GPS_FILE_EXT ".ndjson" : 
+			   HRM_FILE_EXT ".ndjson", &(ses->header), 
+			   &(ses->footer));
+}
+
+/*
+ * Prints the records from to to as JSON objects, one per line, holding
+ * the chosen fields the record has.
+ */
+static int ndjson_records(struct tdr_decoder *dec,
+			  const struct tdr_session *ses,
+			  const struct tdr_records *r, unsigned long int from,
+			  unsigned long int to) {
+  unsigned long int i;
+  int k, n = rec_count(), col, sep;
+
+  for (i = from; i < to; i++) {
+    put_str(dec, "{");
+    for (k = 0, sep = 0; k < n; k++) {
+      col = rec_column(k);
+      if (!rec_has(ses, r, i, rec_columns[col].id)) continue;
+      put_str(dec, sep++ ? ",\"" : "\"");
+      put_str(dec, rec_columns[col].name);
+      put_str(dec, "\":");
+      rec_value(dec, ses, r, i, rec_columns[col].id, 1);
+    }
+    put_str(dec, "}\n");
+  }
+  return writer_flush(dec);
+}
+
+/* Session files YYYYMMDD_HHMMSS-HHMMSS.{gps,hrm}.{csv,ndjson}, or one
+ * listing of all sessions */
+const struct tdr_sink tdr_csv_sink = {
+  "csv", 1, csv_begin, csv_records, close_session_file, csv_heading
+};
+
+const struct tdr_sink tdr_ndjson_sink = {
+  "ndjson", 1, ndjson_begin, ndjson_records, close_session_file, NULL
+};
+
+const struct tdr_sink *const tdr_sinks[] = {
+  &tdr_text_sink, &tdr_binary_sink, &tdr_packed_sink, &tdr_gpx_sink, 
+  &tdr_tcx_sink, &tdr_hst_sink, &tdr_csv_sink, &tdr_ndjson_sink, NULL
+};
+
+/*
+ * Returns the sink called name, or NULL if there is none.
+ */
+const struct tdr_sink *tdr_sink_find(const char *name) {
+  int k;
+
+  for (k = 0; tdr_sinks[k]; k++) {
+    if (strcmp(tdr_sinks[k]->name, name) == 0) return tdr_sinks[k];
+  }
+  return NULL;
+}
+
+static struct tdr_fanout fanout = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .cond = PTHREAD_COND_INITIALIZER
+};
+
+/*
+ * Adds an output of the fan-out given as FORMAT:PATH. PATH is a file
+ * receiving the listing of all sessions, "-" for stdout, or a directory
+ * for the session files; binary and packed session files always go to a
+ * directory, which is created if needed. A file ending in .gz or .zst is
+ * compressed. Returns -1 with errno set to EINVAL if the format is
+ * unknown, or if binary or packed files are to go to stdout or to a path
+ * that is not a directory, and -1 if the output can't be created.
+ */
+int tdr_output_add(struct tdr_options *opt, const char *spec) {
+  struct fanout_target *t = &fanout.target[fanout.n];
+  const char *path = strchr(spec, ':');
+  char name[TIMEXDR_STRLEN];
+  struct stat st;
+  int binary;
+
+  errno = EINVAL;
+  if (!path || (path - spec >= TIMEXDR_STRLEN) || !path[1] ||
+      (fanout.n == TDR_MAX_OUTPUTS)) {
+    return -1;
+  }
+  memcpy(name, spec, path - spec);
+  name[path - spec] = '\0';
+  if (!(t->sink = tdr_sink_find(name))) return -1;
+  snprintf(t->path, sizeof(t->path), "%s", path + 1);
+
+  /* Binary and packed session files can't go to stdout or a file */
+  binary = (t->sink == &tdr_binary_sink) || (t->sink == &tdr_packed_sink);
+
+  if (strcmp(t->path, "-") == 0) {
+    if (binary) return -1;
+    t->out = stdout;
+  } else if (stat(t->path, &st) == 0) {
+    errno = EINVAL;
+    if (S_ISDIR(st.st_mode)) {
+      t->files = 1;
+      t->out = stdout;                /* Messages only */
+    } else if (binary) {
+      return -1;
+    }
+  } else if (binary) {
+    if (mkdir(t->path, 0777) < 0) {
+      fprintf(stderr, "%s: Can't create directory %s (%m).\n", 
+	      tdr_progname, t->path);
+      if (errno == EINVAL) errno = EIO;
+      return -1;
+    }
+    t->files = 1;
+    t->out = stdout;
+  }
+
+  if (!t->out && !(t->out = tdr_zopen(t->path, 
+				      tdr_compress_suffix(t->path)))) {
+    fprintf(stderr, "%s: Can't open output file %s (%m).\n", 
+	    tdr_progname, t->path);
+    if (errno == EINVAL) errno = EIO;
+    return -1;
+  }
+
+  fanout.n++;
+  fanout.opt = opt;
+  opt->sink = &tdr_fanout_sink;
+  return 0;
+}
+
+/*
+ * Writer thread of a fan-out target: hands the queued sessions to the
+ * sink of the target in order. Once the target has failed the sessions
+ * are only released.
+ */
+static void *fanout_writer(void *arg) {
+  struct fanout_target *t = arg;
+  struct fanout_batch *b;
+  char dir[2 * TIMEXDR_STRLEN];
+
+  if (!t->files && t->sink->heading && (t->sink->heading(&t->dec) < 0)) {
+    t->dec.err = -1;
+  }
+
+  pthread_mutex_lock(&fanout.lock);
+  while (1) {
+    while ((t->head == t->tail) && !fanout.done) {
+      pthread_cond_wait(&fanout.cond, &fanout.lock);
+    }
+    if (t->head == t->tail) break;
+    b = t->queue[t->tail % TDR_FANOUT_QUEUE];
+    pthread_mutex_unlock(&fanout.lock);
+
+    /* Session files of each recorder go to a directory of their own */
+    if (t->files && b->dir[0]) {
+      snprintf(dir, sizeof(dir), "%s/%s", t->path, b->dir);
+      if (!t->dec.err && (mkdir(dir, 0777) < 0) && (errno != EEXIST)) {
+	fprintf(stderr, "%s: Can't create directory %s (%m).\n", 
+		tdr_progname, dir);
+	t->dec.err = -1;
+      }
+      t->dec.dir = dir;
+    } else {
+      t->dec.dir = t->files ? t->path : NULL;
+    }
+
+    if (!t->dec.err) {
+      if ((sink_begin(&t->dec, &b->ses) == 0) && t->sink->records) {
+	t->sink->records(&t->dec, &b->ses, &b->rec, 0, b->rec.n);
+      }
+      sink_end(&t->dec, &b->ses);
+    }
+
+    pthread_mutex_lock(&fanout.lock);
+    if (t->dec.err) fanout.err = -1;
+    t->tail++;
+    if (--b->refs == 0) {
+      records_free(&b->rec);
+      free(b);
+    }
+    pthread_cond_broadcast(&fanout.cond);
+  }
+  pthread_mutex_unlock(&fanout.lock);
+
+  return NULL;
+}
+
+/*
+ * Starts the writer threads. The decoders are set up only now, once all
+ * the settings are known. Returns -1 if a thread couldn't be started.
+ */
+static int fanout_start(void) {
+  struct fanout_target *t;
+  int k;
+
+  for (k = 0; k < fanout.n; k++) {
+    t = &fanout.target[k];
+    tdr_decoder_init(&t->dec, t->out, t->sink, NULL, fanout.opt);
+    t->dec.files = t->files;
+  }
+  for (k = 0; k < fanout.n; k++) {
+    if ((errno = pthread_create(&fanout.target[k].thread, NULL, 
+				fanout_writer, &fanout.target[k])) != 0) {
+      fanout.err = -1;
+      return failed("Couldn't start a writer thread");
+    }
+    fanout.started++;
+  }
+  return 0;
+}
+
+/*
+ * Copies the records of a session (the fan-out sink is not buffered, so
+ * from is always 0) and queues them for every target. Waits only if the
+ * queue of a target is full. Returns -1 once an output has failed.
+ */
+static int fanout_records(struct tdr_decoder *dec,
+			  const struct tdr_session *ses,
+			  const struct tdr_records *r, unsigned long int from,
+			  unsigned long int to) {
+  int gps = ((ses->header.dev & SESSION_MASK) == GPS_SESSION);
+  struct fanout_batch *b;
+  int k;
+
+  if (!(b = calloc(1, sizeof(*b)))) {
+    return decoder_failed(dec, "Couldn't allocate memory");
+  }
+  b->ses = *ses;
+  b->ses.data.base = NULL;            /* The payload is not kept */
+  if (dec->dir) snprintf(b->dir, sizeof(b->dir), "%s", dec->dir);
+
+  if (records_reserve(&b->rec, to, gps) < 0) {
+    free(b);
+    return dec->err = -1;
+  }
+  b->rec.n = to;
+  b->rec.fix = r->fix;
+  if (to) {
+    memcpy(b->rec.sec, r->sec, to * sizeof(*r->sec));
+    memcpy(b->rec.bpm, r->bpm, to);
+    memcpy(b->rec.error, r->error, num_of_pages(to, 64) * sizeof(*r->error));
+    if (gps) {
+      memcpy(b->rec.layout, r->layout, to * sizeof(*r->layout));
+      memcpy(b->rec.first, r->first, to);
+      for (k = 0; k < GPS_NFIELDS; k++) {
+	memcpy(b->rec.field[k], r->field[k], to * sizeof(*r->field[k]));
+      }
+    }
+  }
+
+  pthread_mutex_lock(&fanout.lock);
+  if (fanout.err || (!fanout.started && (fanout_start() < 0))) {
+    pthread_mutex_unlock(&fanout.lock);
+    records_free(&b->rec);
+    free(b);
+    return dec->err = -1;
+  }
+  b->refs = fanout.n;
+  for (k = 0; k < fanout.n; k++) {
+    while (fanout.target[k].head - fanout.target[k].tail >= TDR_FANOUT_QUEUE) {
+      pthread_cond_wait(&fanout.cond, &fanout.lock);
+    }
+    fanout.target[k].queue[fanout.target[k].head++ % TDR_FANOUT_QUEUE] = b;
+  }
+  pthread_cond_broadcast(&fanout.cond);
+  pthread_mutex_unlock(&fanout.lock);
+  return 0;
+}
+
+/* Queues every session for the outputs of tdr_output_add() */
+const struct tdr_sink tdr_fanout_sink = {
+  "fanout", 0, NULL, fanout_records, NULL
+};
+
+/*
+ * Waits for the writers of the fan-out to finish and closes the outputs.
+ * Returns -1 if an output has failed.
+ */
+int tdr_outputs_close(void) {
+  struct fanout_target *t;
+  int k, ret = fanout.err;
+
+  pthread_mutex_lock(&fanout.lock);
+  fanout.done = 1;
+  pthread_cond_broadcast(&fanout.cond);
+  pthread_mutex_unlock(&fanout.lock);
+
+  for (k = 0; k < fanout.n; k++) {
+    t = &fanout.target[k];
+    if (k < fanout.started) {
+      pthread_join(t->thread, NULL);
+      if (t->dec.err) ret = -1;
+    }
+    if (fanout.started || fanout.err) tdr_decoder_free(&t->dec);
+    if ((t->out == stdout) ? (fflush(stdout) != 0) : 
+	(tdr_zclose(t->out) != 0)) {
+      ret = failed("Error writing to a file");
+    }
+  }
+  fanout.n = 0;
+  fanout.started = 0;
+  fanout.done = 0;
+  fanout.err = 0;
+  return ret;
+}
+
+/*
+ * Formatting thread: hands a run of the records of a session to the sink,
+ * which prints them into the buffer of the run.
+ */
+static void *chunk_worker(void *arg) {
+  struct tdr_chunk *ck = arg;
+  struct tdr_decoder dec;
+
+  tdr_decoder_init(&dec, open_memstream(&ck->buf, &ck->len),
+		   ck->parent->sink, ck->parent->arg, ck->parent->opt);
+  if (!dec.out) {
+    ck->err = failed("Couldn't allocate memory");
+    return NULL;
+  }
+
+  ck->err = dec.sink->records(&dec, ck->ses, &ck->parent->rec, 
+			      ck->from, ck->to);
+
+  if (fclose(dec.out) != 0) {
+    ck->err = failed("Error writing to a file");
+  }
+  tdr_decoder_free(&dec);
+  return NULL;
+}
+
+/*
+ * Formats the record batch of the decoder on as many threads as the jobs
+ * option of the decoder asks for, each
+ * taking an equal run of the records. The runs are written out in order.
+ * Returns -1 if a run couldn't be formatted or written.
+ */
+static int records_parallel(struct tdr_decoder *dec,
+			    const struct tdr_session *ses) {
+  struct tdr_chunk chunk[TDR_MAX_WORKERS];
+  unsigned long int per, n = dec->rec.n;
+  int c, started, jobs = dec->opt->jobs;
+
+  per = (n + jobs - 1) / jobs;
+
+  for (c = 0; c < jobs; c++) {
+    chunk[c].parent = dec;
+    chunk[c].ses = ses;
+    chunk[c].from = (c * per < n) ? c * per : n;
+    chunk[c].to = ((c + 1) * per < n) ? (c + 1) * per : n;
+    chunk[c].buf = NULL;
+    chunk[c].len = 0;
+    chunk[c].err = 0;
+
+    if ((errno = pthread_create(&chunk[c].thread, NULL, chunk_worker,
+				&chunk[c])) != 0) {
+      decoder_failed(dec, "Couldn't start a decoder thread");
+      break;
+    }
+  }
+  started = c;
+
+  for (c = 0; c < started; c++) {
+    pthread_join(chunk[c].thread, NULL);
+    if (chunk[c].err) {
+      dec->err = -1;
+    } else if (!dec->err && chunk[c].len &&
+	       (fwrite(chunk[c].buf, chunk[c].len, 1, dec->fp) != 1)) {
+      decoder_failed(dec, "Error writing to a file");
+    }
+    free(chunk[c].buf);
+  }
+  return dec->err;
+}
+
+/*
+ * Hands a decoded session to the sink: its start, the record batch of the
+ * decoder and its end. Returns -1 if the output failed.
+ */
+static int session_output(struct tdr_decoder *dec,
+			  const struct tdr_session *ses) {
+  if (sink_begin(dec, ses) < 0) {
+    /* Nothing more to do but to release the output */
+  } else if (!dec->sink->records) {
+    /* Nothing to format */
+  } else if ((dec->opt->jobs > 1) && dec->sink->buffered &&
+	     (dec->rec.n >= TDR_PARALLEL_MIN)) {
+    records_parallel(dec, ses);
+  } else {
+    dec->sink->records(dec, ses, &dec->rec, 0, dec->rec.n);
+  }
+
+  return sink_end(dec, ses);
+}
+
+/*
+ * Decodes an HRM session.
+ */
+static int hr_session(struct tdr_decoder *dec,
+		      const struct tdr_session *ses) {
+  if (hrm_decode(dec, ses) < 0) return -1;
+  return session_output(dec, ses);
+}
+
+/*
+ * Decodes the GPS packet at offset i of the session data as described by
+ * its layout into the next record of the batch. gs keeps track of the
+ * time and of the packet types seen.
+ */
+static void gps_packet(struct tdr_decoder *dec, struct gps_state *gs,
+		       const struct tdr_session *ses, unsigned long int i,
+		       const struct gps_packet *pk) {
+  struct tdr_records *r = &dec->rec;
+  unsigned long int n = r->n++;
+  long int raw;
+  int k;
+
+  r->sec[n] = gs->split_time;
+  r->layout[n] = pk;
+  r->first[n] = !gs->seen[pk - gps_packets];
+  r->bpm[n] = 0;
+  gs->seen[pk - gps_packets] = 1;
+
+  for (k = 0; k < pk->nfields; k++) {
+    raw = gps_field(ses, i, &pk->field[k]);
+    if (pk->field[k].id == GPS_DIST) dist_corrections(dec, &raw);
+    r->field[pk->field[k].id][n] = raw;
+  }
+
+  if (pk->row == GPS_ROW_ERROR) {
+    r->bpm[n] = (unsigned char) r->field[GPS_TOKEN][n];
+    r->error[n / 64] |= (uint64_t) 1 << (n % 64);
+  }
+
+  fixes_update(r, n);
+  gs->split_time += TIME_STEP_GPS;
+}
+
+/*
+ * Starts decoding a GPS session into an empty record batch with room for
+ * n packets. Returns -1 if there is no room.
+ */
+static int gps_begin(struct tdr_decoder *dec, struct gps_state *gs,
+		     unsigned long int n) {
+  gs->split_time = 0.0;
+  memset(gs->seen, 0, sizeof(gs->seen));
+
+  dec->dist_offset = -1;
+  dec->dist_prev = -1;
+  dec->dist_base = 0;
+
+  if (records_reserve(&dec->rec, n, 1) < 0) return dec->err = -1;
+  dec->rec.n = 0;
+  memset(&dec->rec.fix, 0, sizeof(dec->rec.fix));
+  if (n) memset(dec->rec.error, 0, num_of_pages(n, 64) * sizeof(uint64_t));
+  return 0;
+}
+
+/*
+ * Returns the length of the GPS packet at offset i of the session data
+ * and its layout in *pk (NULL for unknown packet types). Zero means that
+ * the packet is truncated or has no length.
+ */
+static unsigned long int gps_length(const struct tdr_session *ses,
+				    unsigned long int i,
+				    const struct gps_packet **pk) {
+  unsigned char type = SES_DATA(ses, i);
+  unsigned long int psize;
+
+  *pk = gps_lookup(type);
+  psize = *pk ? (*pk)->length : (type & PACKET_LENGTH_MASK);
+
+  return (psize > ses->nbytes - i) ? 0 : psize;
+}
+
+/*
+ * Decodes the packets of the GPS packet index of the decoder into its
+ * record batch, skipping unknown packet types. Returns -1 if there is no
+ * room for the records.
+ */
+static int gps_records(struct tdr_decoder *dec,
+		       const struct tdr_session *ses) {
+  const struct gps_packet *pk;
+  struct gps_state gs;
+  unsigned long int k;
+
+  if (gps_begin(dec, &gs, dec->ngps) < 0) return -1;
+
+  for (k = 0; k < dec->ngps; k++) {
+    gps_length(ses, dec->gps[k], &pk);
+    if (!pk) {
+      fprintf(stderr, "Skipping unknown GPS packet type: %02x\n",
+	      SES_DATA(ses, dec->gps[k]));
+      continue;
+    }
+    gps_packet(dec, &gs, ses, dec->gps[k], pk);
+  }
+  return 0;
+}
+
+/*
+ * Decodes a GPS session. The packet boundaries are found first, then the
+ * packets are decoded.
+ */
+static int gps_session(struct tdr_decoder *dec,
+		       const struct tdr_session *ses) {
+  const struct gps_packet *pk;
+  unsigned long int i, psize;
+
+  if ( ses->nbytes < GPS_PACKET_MIN_LENGTH ) {
+    fprintf(stderr, "Skipping GPS session: Packet too short.");
+    return 0;
+  }
+
+  dec->ngps = 0;
+  for (i=0; (i < ses->nbytes) && (psize = gps_length(ses, i, &pk));
+       i += psize) {
+    if (decoder_gps(dec, i) < 0) return dec->err = -1;
+  }
+
+  if (gps_records(dec, ses) < 0) return -1;
+  return session_output(dec, ses);
+}
+
+/*
+ * Process and print a multi-device session. A single pass over the
+ * interleaved records hands every HRM sample to the record batch and notes
+ * where every GPS packet is; the packets are decoded once the HRM samples
+ * are out. Each stream keeps its own clock, as in separate sessions.
+ */
+static int multi_session(struct tdr_decoder *dec,
+			 const struct tdr_session *session) {
+  struct tdr_session hrm_ses, gps_ses;
+  struct tdr_records *r = &dec->rec;
+  const struct gps_packet *pk;
+  unsigned long int i, n = 0, plen;
+
+  hrm_ses = *session;
+  gps_ses = *session;
+  hrm_ses.header.dev = (hrm_ses.footer.dev = HRM_SESSION);
+  gps_ses.header.dev = (gps_ses.footer.dev = GPS_SESSION);
+
+  if (records_reserve(r, session->nbytes / 2, 0) < 0) return dec->err = -1;
+  dec->ngps = 0;
+
+  for (i = 0; i + 1 < session->nbytes; i += plen + 1) {
+    switch (SES_DATA(session, i) & SESSION_MASK) {
+
+    case HRM_SESSION:
+      r->bpm[n++] = SES_DATA(session, i+1);
+      plen = 1;
+      break;
+
+    case GPS_SESSION:
+      if ((plen = gps_length(session, i+1, &pk)) == 0) {
+	fprintf(stderr, "Truncated GPS packet in multi-device session\n");
+	plen = session->nbytes - i;
+	break;
+      }
+      if (decoder_gps(dec, i+1) < 0) return dec->err = -1;
+      break;
+
+    default:
+      fprintf(stderr, "Unknown device %02x in multi-device session, "
+	      "skipping the rest\n", SES_DATA(session, i));
+      plen = session->nbytes - i;
+      break;
+    }
+  }
+
+  hrm_finish(r, n);
+  if (session_output(dec, &hrm_ses) < 0) return -1;
+
+  if (dec->ngps == 0) {
+    fprintf(stderr, "Skipping GPS session: Packet too short.");
+    return 0;
+  }
+
+  if (gps_records(dec, &gps_ses) < 0) return -1;
+  return session_output(dec, &gps_ses);
+}
+
+/*
+ * Decodes a session into the sink of the decoder. Returns 1 if the session
+ * was decoded, 0 if it is older than the initial time of the options and
+ * -1 if it couldn't be decoded or output.
+ */
+int tdr_decode(struct tdr_decoder *dec, const struct tdr_session *ses) {
+  int ret;
+
+  if (dec->err) return -1;
+
+  if (!newer_session(dec->opt, &ses->header)) {
+    return 0;
+  }
+
+  switch (ses->header.dev & SESSION_MASK) {
+  case HRM_SESSION:
+    ret = hr_session(dec, ses);
+    break;
+  case GPS_SESSION:
+    ret = gps_session(dec, ses);
+    break;
+  case MULTI_DEVICE_SESSION & SESSION_MASK:
+    ret = multi_session(dec, ses);
+    break;
+  default:
+    errno = 0;
+    ret = decoder_failed(dec, "Unknown session");
+    break;
+  }
+
+  return (ret < 0) ? -1 : 1;
+}
+
+/*
+ * Returns 1 unless an earlier incremental run has exported the i-th
+ * session of the EEPROM already.
+ */
+static int export_wanted(struct tdr_arena *arena, int i) {
+
+  if (arena->sync && sync_known(arena->sync, i, &arena->ses[i].header)) {
+    if (arena->dec.opt->verbosity > 1) printf("Session %d exported before, skipped\n", i);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Prints the i-th session of the EEPROM unless an earlier incremental run
+ * has exported it already. Returns -1 if it couldn't be printed.
+ */
+static int export_session(struct tdr_arena *arena, int i) {
+  const struct tdr_session *ses = &arena->ses[i];
+  int ret;
+
+  if (!export_wanted(arena, i)) {
+    return 0;
+  }
+
+  if ((ret = tdr_decode(&arena->dec, ses)) < 0) return -1;
+  if (ret && arena->sync) {
+    sync_mark(arena->sync, i, &ses->header);
+  }
+  return 0;
+}
+
+/*
+ * Session decoding thread: takes the next session of the pool, prints it
+ * into the session's buffer and reports it done. Once a session has failed
+ * the rest are only reported done.
+ */
+static void *decode_worker(void *arg) {
+  struct tdr_pool *pool = arg;
+  struct tdr_decoder dec;
+  int i;
+
+  tdr_decoder_init(&dec, NULL, pool->arena->dec.sink, pool->arena->dec.arg,
+		   pool->arena->dec.opt);
+  dec.dir = pool->arena->dec.dir;
+
+  while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->arena->nses) {
+    if (pool->selected[i] && !pool->err && !dec.err) {
+      dec.out = open_memstream(&pool->buf[i], &pool->len[i]);
+      if (!dec.out) {
+	decoder_failed(&dec, "Couldn't allocate memory");
+      } else {
+	dec.fp = dec.out;
+	tdr_decode(&dec, &pool->arena->ses[i]);
+	if (fclose(dec.out) != 0) {
+	  decoder_failed(&dec, "Error writing to a file");
+	}
+      }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (dec.err) pool->err = -1;
+    pool->done[i] = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  tdr_decoder_free(&dec);
+  return NULL;
+}
+
+/*
+ * Prints the sessions of the session table with the worker threads of the
+ * jobs option. The output of each session is written as soon as it and all
+ * sessions before it are decoded. Returns -1 if a session couldn't be
+ * printed; the sessions after it are not.
+ */
+static int print_sessions_parallel(struct tdr_arena *arena) {
+  struct tdr_pool *pool;
+  pthread_t worker[TDR_MAX_WORKERS];
+  int i, n, started;
+
+  if (!(pool = calloc(1, sizeof(*pool)))) {
+    return decoder_failed(&arena->dec, "Couldn't allocate memory");
+  }
+  pool->arena = arena;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  for (i = 0; i < arena->nses; i++) {
+    pool->selected[i] = export_wanted(arena, i) && 
+      newer_session(arena->dec.opt, &arena->ses[i].header);
+  }
+
+  n = (arena->dec.opt->jobs < arena->nses) ? arena->dec.opt->jobs : arena->nses;
+  for (started = 0; started < n; started++) {
+    if ((errno = pthread_create(&worker[started], NULL, decode_worker, 
+				pool)) != 0) {
+      decoder_failed(&arena->dec, "Couldn't start a decoder thread");
+      break;
+    }
+  }
+
+  /* Without workers nothing gets done */
+  for (i = 0; started && (i < arena->nses); i++) {
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->done[i]) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if (pool->err) arena->dec.err = -1;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!pool->selected[i] || arena->dec.err) continue;
+
+    if (pool->len[i] && (fwrite(pool->buf[i], pool->len[i], 1, arena->dec.out) != 1)) {
+      decoder_failed(&arena->dec, "Error writing to a file");
+      continue;
+    }
+    if (arena->sync) {
+      sync_mark(arena->sync, i, &arena->ses[i].header);
+    }
+  }
+
+  for (i = 0; i < started; i++) {
+    pthread_join(worker[i], NULL);
+  }
+  for (i = 0; i < arena->nses; i++) {
+    free(pool->buf[i]);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+  return arena->dec.err;
+}
+
+/*
+ * Prints all sessions of the session table. Returns -1 if a session
+ * couldn't be printed; the sessions after it are not.
+ */
+static int print_sessions(struct tdr_arena *arena) {
+  int i;
+
+  if ((arena->dec.opt->jobs > 1) && arena->dec.sink->buffered && 
+      (arena->nses > 1)) {
+    return print_sessions_parallel(arena);
+  }
+
+  for (i = 0; i < arena->nses; i++) {
+    if (export_session(arena, i) < 0) return -1;
+  }
+  return 0;
+}
+
+/*
+ * Appends a page number to the page queue (reader side). The ring only
+ * fills up if the decoder falls behind the USB transfer.
+ */
+static void page_queue_put(struct page_queue *q, unsigned long int page) {
+  while (q->head - q->tail >= PAGE_QUEUE_LEN) {
+    sched_yield();
+  }
+  q->page[q->head % PAGE_QUEUE_LEN] = page;
+  __sync_synchronize();        /* Publish the slot before the new head */
+  q->head++;
+  sem_post(&q->ready);
+}
+
+/*
+ * Removes the oldest page number from the page queue (decoder side). The
+ * wait is retried until the reader has posted.
+ */
+static unsigned long int page_queue_get(struct page_queue *q) {
+  unsigned long int page;
+
+  while (sem_wait(&q->ready) < 0) {
+    if (errno != EINTR) sched_yield();
+  }
+  __sync_synchronize();
+  page = q->page[q->tail % PAGE_QUEUE_LEN];
+  __sync_synchronize();        /* Consume the slot before releasing it */
+  q->tail++;
+
+  return page;
+}
+
+/*
+ * Passes a received page to the decoder of the streamed download.
+ */
+static void stream_page_done(unsigned long int page, void *arg) {
+  page_queue_put((struct page_queue *)arg, page);
+}
+
+/*
+ * Reader thread of the streamed download: receives the EEPROM in
+ * EEPROM_PAGESIZE units and queues each complete page for the decoder.
+ * The end of the queue is posted even if the download fails.
+ */
+static void *stream_reader(void *arg) {
+  struct tdr_stream *st = (struct tdr_stream *)arg;
+
+  st->err = timex_data_read(st->dev, st->dl);
+  page_queue_put(&st->queue, PAGE_QUEUE_END);
+
+  return NULL;
+}
+
+/*
+ * Downloads the EEPROM and prints its sessions while the transfer is still
+ * running. The decoder reads the pages in place as they arrive and prints each
+ * session as soon as the access table and the session's last byte are in.
+ * Returns -1 if the download or the output failed; after an output error
+ * the rest of the EEPROM is still received but not printed.
+ */
+static int stream_sessions(struct tdr_job *job, struct tdr_download *dl) {
+  struct tdr_dev *dev = job->dev;
+  struct tdr_stream st;
+  struct tdr_arena *arena;
+  pthread_t reader;
+  struct tdr_view v;
+  unsigned long int page, pages, avail = 0, pstart = TIMEXDR_FIRSTSESSION, pend;
+  unsigned long int bytes = dl->size;
+  int done = 0, ret;
+
+  if (!(arena = arena_new(dev->opt))) return -1;
+  arena_job(arena, job);
+  pages = num_of_pages(bytes, EEPROM_PAGESIZE);
+
+  st.dev = dev;
+  st.dl = dl;
+  st.err = 0;
+  dl->page_done = stream_page_done;
+  dl->arg = &st.queue;
+  st.queue.head = 0;
+  st.queue.tail = 0;
+  if (sem_init(&st.queue.ready, 0, 0) < 0) {
+    dl->page_done = NULL;
+    tdr_sessions_free(arena);
+    return failed("Couldn't initialize the page queue");
+  }
+
+  view_init(&v, dl->buf, 1);
+
+  /* Pages read before the stream started */
+  for (page = 0; page < pages; page++) {
+    if (dl->received[page]) page_queue_put(&st.queue, page);
+  }
+
+  if ((errno = pthread_create(&reader, NULL, stream_reader, &st)) != 0) {
+    dl->page_done = NULL;
+    sem_destroy(&st.queue.ready);
+    tdr_sessions_free(arena);
+    return failed("Couldn't start the reader thread");
+  }
+
+  while ((page = page_queue_get(&st.queue)) != PAGE_QUEUE_END) {
+    avail = (page == pages - 1) ? 
+      view_size(&v, bytes) : (page + 1) * DATA_PAGESIZE;
+
+    /* Print every session that is complete by now */
+    while (!done && (avail >= TIMEXDR_ATABLESIZE)) {
+      if ((arena->nses >= TDR_MAX_SESSIONS) || 
+	  ((pend = session_end(&v, arena->nses)) == 0)) {
+	done = 1;
+      } else if (pend <= avail) {
+	parse_session(&v, pstart, pend, &arena->ses[arena->nses]);
+	if (export_session(arena, arena->nses++) < 0) done = 1;
+	pstart = pend;
+      } else {
+	break;
+      }
+    }
+  }
+
+  pthread_join(reader, NULL);
+  sem_destroy(&st.queue.ready);
+  ret = (st.err < 0) ? -1 : arena->dec.err;
+  tdr_sessions_free(arena);
+  return ret;
+}
+
+/* 
+ * Releases the interface and closes the device. The EEPROM is not cleared
+ * after a failed download or export. Returns -1 if clearing or closing
+ * failed.
+ */
+int tdr_close(struct tdr_dev *dev) {
+  unsigned char buf[RESPONSE_BUFSIZE];
+  int ret = 0;
+
+  if (dev->opt->clear_eeprom && dev->failed) {
+    fprintf(stderr, "%s: Download failed, EEPROM not deleted.\n", 
+	    tdr_progname);
+  } else if (dev->opt->clear_eeprom) {
+    if (dev->opt->verbosity) printf("Deleting all data stored in EEPROM\n");
+    if (timex_ctrl(dev, EEPROM_CLEAR, DEFAULT_MICRO, buf, 
+		   RESPONSE_BUFSIZE) < 0) {
+      ret = -1;
+    }
+  }
+
+  if (dev->transport->close(dev) < 0) ret = -1;
+
+  free(dev);
+  return ret;
+}
+
+/*
+ * Ends a failed job: nothing is exported and the EEPROM is kept. Returns
+ * -1.
+ */
+int tdr_job_failed(struct tdr_job *job) {
+  job->dev->failed = 1;
+  job->status = JOB_FAILED;
+  free(job->buf);
+  job->buf = NULL;
+  return -1;
+}
+
+/*
+ * Downloads the EEPROM of an open recorder for the command job->choice.
+ * Sets job->status to JOB_EMPTY if there is nothing to download, or to
+ * JOB_SYNCED if the incremental sync finds no new sessions. Returns -1
+ * and sets it to JOB_FAILED if the download failed.
+ */
+int tdr_download(struct tdr_job *job) {
+  struct tdr_dev *dev = job->dev;
+  const struct tdr_options *opt = dev->opt;
+  struct tdr_download dl;
+  struct timespec t0;
+  unsigned char buf[RESPONSE_BUFSIZE];
+  unsigned long int bytes, bufsize;
+  long int used;
+  double dt;
+  int ret;
+
+  job->status = JOB_DONE;
+  job->buf = NULL;
+
+  if ((opt->time_sync && (tdr_sync_time(dev) < 0)) || 
+      (get_fw_version(dev) < 0) || (get_eeprom_size(dev) < 0) ||
+      ((used = eeprom_usage(dev)) < 0)) {
+    return tdr_job_failed(job);
+  }
+
+  job->bytes = bytes = used;
+
+  if (opt->verbosity >= 3) {
+    printf("Expecting a transfer of %lu (0x%lx) bytes in %lu packets\n", 
+	   bytes, bytes, num_of_pages(bytes, EEPROM_PAGESIZE));
+  }
+
+  if (timex_ctrl(dev, DATA_UPLOAD, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE) < 0) {
+    return tdr_job_failed(job);
+  }
+
+  if (bytes == (TIMEXDR_ATABLESIZE + num_of_pages(bytes, EEPROM_PAGESIZE))) {
+    if (timex_ctrl(dev, UPLOAD_CANCEL, DEFAULT_MICRO, buf, 
+		   RESPONSE_BUFSIZE) < 0) {
+      return tdr_job_failed(job);
+    }
+    job->status = JOB_EMPTY;
+    return 0;
+  }
+
+  bufsize = EEPROM_PAGESIZE * num_of_pages(bytes, EEPROM_PAGESIZE); 
+  job->buf = (unsigned char *)calloc(bufsize, sizeof(unsigned char));
+  if (job->buf == 0) {
+    failed("Couldn't allocate memory");
+    return tdr_job_failed(job);
+  }
+
+  /* Read the data from the recorder. The page timeout adapts to the
+   * observed throughput and a failed transfer restarts the upload.
+   */
+  if (download_init(&dl, job->buf, bytes) < 0) return tdr_job_failed(job);
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  /* Incremental sync: the access table and the first session header
+   * tell whether there is anything new before the rest is read */
+  if (opt->sync && (job->choice != 'e')) {
+    struct tdr_view v;
+    struct tdr_header first;
+
+    if (dl.limit > 2 * EEPROM_PAGESIZE) dl.limit = 2 * EEPROM_PAGESIZE;
+    if (timex_data_read(dev, &dl) < 0) {
+      free(dl.received);
+      return tdr_job_failed(job);
+    }
+    dl.limit = bytes;
+
+    view_init(&v, job->buf, 1);
+    parse_header(&v, TIMEXDR_FIRSTSESSION, &first);
+
+    if (sync_load(&job->sync, job->info.serial) < 0) {
+      free(dl.received);
+      return tdr_job_failed(job);
+    }
+    if (sync_compare(&job->sync, &v, &first, opt) == 0) {
+      free(dl.received);
+      if (download_cancel(dev) < 0) return tdr_job_failed(job);
+      free(job->buf);
+      job->buf = NULL;
+      job->status = JOB_SYNCED;
+      return 0;
+    }
+  }
+
+  if (opt->stream && (job->choice != 'e')) {
+    ret = stream_sessions(job, &dl);
+  } else {
+    ret = timex_data_read(dev, &dl);
+  }
+  free(dl.received);
+  if (ret < 0) return tdr_job_failed(job);
+  dt = elapsed_time(&t0);
+      
+  if (opt->verbosity) printf("Data transfer time was %.2f seconds (%.0f bytes/s)\n", 
+			dt, (dt > 0) ? bytes / dt : 0.0);
+  if (dl.restarts) {
+    fprintf(stderr, "Download recovered after %d restart(s): %lu page(s) "
+	    "retried, %.2f seconds lost.\n", 
+	    dl.restarts, dl.retried, dl.retry_time);
+  }
+    
+  if (timex_ctrl(dev, UPLOAD_DONE, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE) < 0) {
+    return tdr_job_failed(job);
+  }
+  return 0;
+}
+
+/*
+ * Formats the downloaded EEPROM of a job as specified by the command line
+ * options. Returns -1 if the job failed or its sessions couldn't be
+ * printed; the sync state is then left as it was.
+ */
+int tdr_export(struct tdr_job *job, int full_eeprom_listing) {
+  const struct tdr_options *opt = job->dev->opt;
+  struct tdr_arena *arena;
+  struct tdr_view v;
+  int ret = 0;
+
+  const char *name = job->dir[0] ? job->dir : NULL;
+
+  switch (job->status) {
+  case JOB_EMPTY:
+    fprintf(stderr, "%s%sEEPROM empty.\n", name ? name : "", name ? ": " : "");
+    return 0;
+  case JOB_SYNCED:
+    printf("%s%sNo new sessions.\n", name ? name : "", name ? ": " : "");
+    return 0;
+  case JOB_FAILED:
+    return -1;
+  default:
+    break;
+  }
+
+  switch (job->choice) {
+  case 'e': 
+    view_init(&v, job->buf, !full_eeprom_listing);
+    print_eeprom(&v, view_size(&v, job->bytes));
+    break;
+  case 'a':
+  case 'd':
+    if (opt->stream) break;           /* Printed while streaming */
+    if (!(arena = tdr_sessions(job->buf, opt))) {
+      ret = -1;
+      break;
+    }
+    arena_job(arena, job);
+    ret = print_sessions(arena);
+    tdr_sessions_free(arena);
+    break;
+  default:
+    break;
+  }
+
+  if (ret < 0) {
+    job->dev->failed = 1;
+  } else if (opt->sync && (job->choice != 'e')) {
+    if (opt->clear_eeprom) {
+      unlink(job->sync.path);         /* Nothing left to sync with */
+    } else {
+      ret = sync_save(&job->sync, job->info.serial);
+    }
+  }
+
+  free(job->buf);
+  job->buf = NULL;
+  return ret;
+}
@@ -0,0 +1,136 @@
+/* 
+ * Prints binary session files of the Timex Data Recorder as text
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *      
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *      
+ */   
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include "common.h"
+#include "libtimexdr.h"
+
+/*
+ * Prints the program usage.
+ *
+ *      program: program filename
+ */
+static void tdb2txt_usage(const char *program) {
+  
+  fprintf(stderr,
+	  "Usage: %s [OPTION]... FILE...\n"
+	  "Print the binary session files written by timexdr -b, or the\n"
+	  "packed ones of timexdr -F packed, as the text of timexdr -f.\n"
+	  "Files ending in .gz or .zst (timexdr -z) are decompressed.\n"
+	  "\nOptions:\n"
+	  "  -F FORMAT, --format=FORMAT\n"
+	  "\t\t\tPrint the sessions as text (default), gpx, tcx, hst,\n"
+	  "\t\t\tcsv or ndjson like timexdr -F does.\n"
+	  "  -h, --help\t\tDisplay this usage information.\n"
+	  "  -L LIST, --fields=LIST\n"
+	  "\t\t\tComma separated fields of the csv and ndjson records,\n"
+	  "\t\t\tas for timexdr.\n"
+	  "  -m, --miles\t\tShow distance and speed in miles and mph, respectively.\n"
+	  "\t\t\tThe default units are kilometers and kph.\n"
+	  "  -r FROM[,TO], --range=FROM[,TO]\n"
+	  "\t\t\tPrint only the records from FROM to TO seconds after\n"
+	  "\t\t\tthe session start.\n"
+	  "  -V, --version\t\tPrint version information and exit.\n",
+	  program);
+
+  exit(EXIT_FAILURE);
+}
+
+/* -------------------------------------------------------------------------
+ *   Main program.
+ * -------------------------------------------------------------------------
+ */
+int main(int argc, char *argv[])
+{
+  const struct tdr_sink *sink = &tdr_text_sink;
+  struct tdr_options opt;
+  struct tdr_decoder dec;
+  struct tdr_bin *bin;
+  double from = 0, to = -1;
+  char *p;
+  int c;
+  static struct option long_options[] = {
+    {"fields", 1, NULL, 'L'},
+    {"format", 1, NULL, 'F'},
+    {"help",  0, NULL, 'h'},
+    {"miles", 0, NULL, 'm'},
+    {"range", 1, NULL, 'r'},
+    {"version", 0, NULL, 'V'},
+    {NULL, 0, NULL, 0}
+  };
+
+  tdr_progname = argv[0];
+  tdr_options_init(&opt);
+
+  while ((c = getopt_long(argc, argv, "F:hL:mr:V", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'F':
+      if (!(sink = tdr_sink_find(optarg))) tdb2txt_usage(argv[0]);
+      break;
+
+    case 'L':
+      if (tdr_set_fields(optarg) < 0) tdb2txt_usage(argv[0]);
+      break;
+
+    case 'm':
+      opt.units = 0;
+      break;
+
+    case 'r':
+      from = strtod(optarg, &p);
+      if (*p == ',') to = strtod(p + 1, &p);
+      if (*p) tdb2txt_usage(argv[0]);
+      break;
+
+    case 'V':
+      fprintf(stdout, "tdb2txt (" PACKAGE ") " VERSION "\n");
+      exit(EXIT_SUCCESS);
+
+    case 'h':
+    default:
+      tdb2txt_usage(argv[0]);
+      break;
+    }
+  }
+
+  if (optind >= argc) tdb2txt_usage(argv[0]);
+
+  tdr_decoder_init(&dec, stdout, sink, NULL, &opt);
+  if (sink->heading && (sink->heading(&dec) < 0)) exit(EXIT_FAILURE);
+
+  for (; optind < argc; optind++) {
+    if (!(bin = tdr_bin_open(argv[optind]))) exit(EXIT_FAILURE);
+    if (tdr_bin_output(&dec, bin, tdr_bin_seek(bin, from), 
+		       (to < 0) ? bin->rec.n : tdr_bin_seek(bin, to)) < 0) {
+      exit(EXIT_FAILURE);
+    }
+    tdr_bin_close(bin);
+  }
+
+  tdr_decoder_free(&dec);
+
+  if (fflush(stdout) != 0) {
+    fprintf(stderr, "%s: Error writing to a file (%m).\n", tdr_progname);
+    exit(EXIT_FAILURE);
+  }
+  return 0;
+}
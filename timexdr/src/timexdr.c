@@ -24,24 +24,16 @@
 #endif
 
 #include "common.h"
-#include "timexdr.h"
+#include "tdrjob.h"
 
 static const char *version = "version " VERSION;
 
-int clear_eeprom = 0;      /* Clear the EEPROM on device close if set */
+static struct tdr_options opt;      /* Settings of the command line */
+static const char *capture_file = NULL;   /* Record the USB traffic */
+static int all_devices = 0;         /* Download every attached recorder */
 
-/* Odometer quirks: 
- *   dist_offset - to eliminate non-zero session offset
- *   dist_prev   - remember the previous value in order to control
- *                 rollovers at ODO_MAX (4.096 miles) and to disallow
- *                 any decrease in distance
- *   dist_base   - increment this on each rollover by ODO_MAX
- */
-static double dist_offset = -1, dist_prev = -1, dist_base = 0;
-
-static char *progname;
-
-static void print_session(const struct tdr_session *session);
+static struct tdr_info tdr_info = {vendor:"", product:"", serial:"",
+				   eeprom_size:0, fw_main:0, fw_usb:0};
 
 /*
  * Print version information and exit
@@ -64,1061 +56,337 @@ static void timexdr_usage(const char *program) {
 	  "Usage: %s [COMMAND] [OPTION]...\n"
 	  "\nCommands:\n"
 	  "  -a, --all-sessions\tPrint all sessions.\n"
+	  "  -b, --binary\t\tWrite the sessions into binary files\n"
+	  "\t\t\tYYYYMMDD_HHMMSS-HHMMSS.{gps,hrm}.tdb instead of text\n"
+	  "\t\t\t(implies -f). tdb2txt prints them as text.\n"
+	  "  -C FILE, --capture=FILE\n"
+	  "\t\t\tRecord all USB traffic with timestamps into FILE.\n"
 	  "  -c, --clear-eeprom\tClear the EEPROM memory (delete all stored sessions).\n"
 	  "  -dNUM, --days=NUM\tPrint sessions recorded within the last NUM days.\n"
 	  "\t\t\tIf NUM is omitted or zero, today's sessions are printed.\n"
+	  "  -D, --daemon\t\tStay resident and run the other commands (-t, -a, -d,\n"
+	  "\t\t\t-n, -c) on every recorder as soon as it is attached.\n"
+	  "\t\t\tSession files go to a directory per recorder.\n"
 	  "  -e, --eeprom-dump\tDump the content of EEPROM (for debugging).\n"
+	  "  -F FORMAT, --format=FORMAT\n"
+	  "\t\t\tWrite the sessions as text (default), binary (as -b),\n"
+	  "\t\t\tpacked (delta coded .tdp files, read by tdb2txt),\n"
+	  "\t\t\tgpx (GPX 1.1 tracks), tcx or hst (Garmin Training\n"
+	  "\t\t\tCenter v2 or v1 laps), csv or ndjson (one record per\n"
+	  "\t\t\tline). The gpx, tcx and hst formats hold the position\n"
+	  "\t\t\tfixes of the GPS sessions only.\n"
 	  "  -f, --file\t\tCreate file(s) YYYYMMDD_HHMMSS-HHMMSS.{gps,hrm} for the\n"
 	  "\t\t\tsession data in the working directory.\n" 
 	  "  -h, --help\t\tDisplay this usage information.\n"
 	  "  -i, --info\t\tDisplay information about the device.\n"
+	  "  -jNUM, --jobs=NUM\tDecode sessions with NUM threads (all processors\n"
+	  "\t\t\tif NUM is omitted). The output stays in session order.\n"
+	  "  -L LIST, --fields=LIST\n"
+	  "\t\t\tComma separated fields of the csv and ndjson records\n"
+	  "\t\t\t(default all): session, device, time, sec, hr, error,\n"
+	  "\t\t\tstatus, acq, battery, speed, dist, alt, htrue, hmag,\n"
+	  "\t\t\tlat, lon, gps_sec, gmt.\n"
 	  "  -m, --miles\t\tShow distance and speed in miles and mph, respectively.\n"
 	  "\t\t\tThe default units are kilometers and kph.\n"
+	  "  -M, --all-recorders\tDownload all attached recorders at once. The session\n"
+	  "\t\t\tfiles of each recorder are written to a directory\n"
+	  "\t\t\tnamed after its serial number (implies -f).\n"
+	  "  -n, --new-sessions\tPrint only sessions not printed by an earlier run\n"
+	  "\t\t\twith this option. The state of each recorder is kept\n"
+	  "\t\t\tin ~/" SYNC_STATE_DIR ".\n"
+	  "  -o FORMAT:PATH, --output=FORMAT:PATH\n"
+	  "\t\t\tWrite the sessions in FORMAT (see -F) to PATH: a\n"
+	  "\t\t\tfile for the listing of all sessions, - for stdout, or\n"
+	  "\t\t\ta directory for session files. May be repeated; every\n"
+	  "\t\t\toutput is written by a thread of its own. Replaces\n"
+	  "\t\t\t-F, -b and -f.\n"
+	  "  -R FILE[,NUM], --replay=FILE[,NUM]\n"
+	  "\t\t\tReplay the traffic of recorder NUM (default 0) from the\n"
+	  "\t\t\tcapture FILE instead of using a device, and print the\n"
+	  "\t\t\tlatency histogram of each command type to stderr.\n"
+	  "  -s, --stream\t\tPrint sessions while the download is still running.\n"
+	  "  -S IMAGE[,LATENCY[,RATE[,FAIL]]], --simulate=...\n"
+	  "\t\t\tTalk to a simulated recorder holding the EEPROM image\n"
+	  "\t\t\tIMAGE (binary, or a dump printed by -e). Each page is\n"
+	  "\t\t\tdelayed by LATENCY ms and sent at RATE bytes/s; the\n"
+	  "\t\t\tfirst read of page FAIL times out.\n"
 	  "  -t, --time-sync\tSynchronize device's clock with system local time.\n"
 	  "  -vNUM, --verbose=NUM\tIncrease the verbosity of program output for higher\n"
 	  "\t\t\tNUM. Roughly, NUM<5 provides more information about\n"
 	  "\t\t\tthe current action, higher NUM values show also some\n"
 	  "\t\t\tdebugging information. If NUM is ommitted, value 1 is\n"
 	  "\t\t\tassumed.\n"
-	  "  -V, --version\t\tPrint version information and exit.\n", 
-	  program);
+	  "  -V, --version\t\tPrint version information and exit.\n"
+	  "  -xNUM, --transfers=NUM\tKeep NUM interrupt transfers in flight during\n"
+	  "\t\t\tthe download (libusb-1.0 only, default %d). Zero selects\n"
+	  "\t\t\tthe blocking libusb-0.1 calls.\n"
+	  "  -z METHOD, --compress=METHOD\n"
+	  "\t\t\tCompress the session files with gzip or zstd (adds\n"
+	  "\t\t\t.gz or .zst) on a thread of their own. Files of -o\n"
+	  "\t\t\tending in .gz or .zst are always compressed.\n", 
+	  program, TDR_ASYNC_TRANSFERS);
 
   exit(EXIT_FAILURE);
 }
 
-
 /*
  * Prints an error message and exits the program.
  */
 static void fatal (const char *message) {
-  fprintf(stderr, "%s: %s (%m).\n", progname, message);
+  fprintf(stderr, "%s: %s (%m).\n", tdr_progname, message);
   exit(EXIT_FAILURE);
 }
- 
-/* 
- * Finds the Timex Data Recorder device.
+
+/*
+ * Prints the latency histogram of the replayed capture on exit.
  */
-static int find_timexdr(struct usb_device *tdr) {
-  struct usb_bus *bus;
-  struct usb_device *dev;
-  int count = 0;
-  
-  for (bus = usb_get_busses(); bus; bus = bus->next) {
-    for (dev = bus->devices; dev; dev = dev->next) {
-      if ((dev->descriptor.idVendor == TIMEXDR_VENDOR_ID) &&
-	  ((dev->descriptor.idProduct == TIMEXDR_PRODUCT_ID1) ||
-	   (dev->descriptor.idProduct == TIMEXDR_PRODUCT_ID2))) {
-	*tdr = *dev;
-	count++;
-      }
-    }
-  }
-  return count;
+static void replay_report(void) {
+  tdr_replay_report(opt.replay_file);
 }
 
-/* Maximum length of the device name string */
-#define DNAMELEN                50 
-
 /*
- * Opens and initializes the device.
+ * Opens and initializes the device, whose information goes to info.
+ * Exits if there is none.
  */ 
-static usb_dev_handle *timexdr_open(void) {
-  struct usb_dev_handle *udev;
-  struct usb_device *dev;
-  char dname[DNAMELEN];
-  int count, ret;
+static struct tdr_dev *timexdr_open(struct tdr_info *info) {
+  struct tdr_dev *tdr;
 
-  usb_init();
-
-  usb_find_busses();
-  usb_find_devices();
-  
-  dev = malloc(sizeof(*dev));
- 
-  if ( (count = find_timexdr(dev)) == 0) {
-    fatal("Device not found. Check the connection");
-  }
-
-  if (verbosity > 5) printf("Found %d device(s).\n", count);
-
-  if ((udev = usb_open(dev))) {
-
-    ret = usb_get_string_simple(udev, TIMEXDR_STR_VENDOR, tdr_info.vendor, 
-				sizeof(tdr_info.vendor));
-    ret = usb_get_string_simple(udev, TIMEXDR_STR_PRODUCT, tdr_info.product, 
-				sizeof(tdr_info.product));
-
-    if (verbosity) {
-      printf("Vendor:  [0x%04x] %s\nProduct: [0x%04x] %s\n", 
-	     dev->descriptor.idVendor, tdr_info.vendor, 
-	     dev->descriptor.idProduct, tdr_info.product);
-    }
-
-/* Non-portable Linux-only code */
-#if defined(LIBUSB_HAS_GET_DRIVER_NP) && defined (LIBUSB_HAS_DETACH_KERNEL_DRIVER_NP)
-    if ( usb_get_driver_np(udev, TIMEXDR_INTERFACE, dname, DNAMELEN) == 0 ) {
-      if ( usb_detach_kernel_driver_np(udev, TIMEXDR_INTERFACE) < 0 ) {
-	fprintf(stderr, "Couldn't detach kernel driver %s (%s).\n", dname, 
-		usb_strerror());
-	exit(EXIT_FAILURE);
-      }
-    } /* Don't stop here if usb_get_driver_np fails because that only 
-	 means there is no kernel driver to be detached */
-#endif
-
-    if ( usb_set_configuration(udev, TIMEXDR_CONFIG) < 0 ) {
-      fatal("Couldn't set configuration");
-      }
-
-    if ( usb_claim_interface(udev, TIMEXDR_INTERFACE) < 0 ) {
-      fatal("Couldn't claim interface");
-    }
-
-  } else {
-    fatal("Couldn't open the device. Check your access rights");
-  }
+  if (!(tdr = tdr_open(-1, info, NULL, &opt))) exit(EXIT_FAILURE);
 
   /* Drop (root) privileges to UID */
   setuid(getuid());
 
-  return udev;
+  return tdr;
 }
-
 /*
- * Interrupt read from the device
+ * Creates the output directory of a job, named after the serial number of
+ * the recorder (or its index n if it has none). Returns -1 on failure.
  */
-static int timex_int_read(usb_dev_handle *dev, unsigned char *buf, int size, 
-			  int timeout) {
-  int ret;
-
-  errno = 0;
+static int job_dir(struct tdr_job *job, int n) {
+  char *p;
 
-  ret = usb_interrupt_read(dev, TIMEXDR_EP, buf, size, timeout);
-  if (ret < 0) {
-    /* The return code is often negative when reading the main data from the
-     * device. It seems to be related to the length of the timeout. 
-     * Try setting it larger.
-     */
-    //printf("Interrupt read (%d: %m) (%s).\n", errno, usb_strerror());
-    fatal("Interrupt read timeout");
-  } 
-
-  if ((verbosity > 5) && (ret <= TIMEXDR_CTRL_SIZE)) {
-    printf("Received: \t", ret);
-    {
-      int i;
-      
-      for (i=0; (ret<10) && (i<ret); i++) {
-	printf("%02x ", buf[i] & 0xff);
-      }
-      printf("\n");
+  if (job->info.serial[0]) {
+    snprintf(job->dir, sizeof(job->dir), "%s", job->info.serial);
+    for (p = job->dir; *p; p++) {
+      if (!isalnum(*p) && (*p != '.') && (*p != '-')) *p = '_';
     }
-  }
-
-  return ret;
-}
-
-/*
- * Check the response to a control command for command failure or command type
- * mismatch.
- */
-static void check_response(char cmdtype, unsigned char *buf) {
-  if ((buf[1] & 0xff) != CTRL_COMMAND_SUCCESS) {
-    fprintf(stderr, "Error: Control command %u failed with code %02x.\n", 
-	    cmdtype, buf[1] & 0xff);
-    exit(EXIT_FAILURE);
-  }
-  if (((buf[2] & 0xff) >> 4) != cmdtype) {
-    fprintf(stderr, "Error: Return message command type mismatch.\n");
-    fprintf(stderr, "Error: Sent command %u, received response from command %u.\n", 
-	    cmdtype, (buf[2] & 0xff) >> 4);
-    exit(EXIT_FAILURE);
-  }
-}
-
-/*
- * Prepare the control command (output report) to be sent to the device
- * Inputs: cmdtype - specify command type as defined in the header file
- *         micro - optional, specify which microcontroller is the recipient. 
- *                 If cmdtype=MODIFY_BOND_OPTION, then micro contains the settings
- *                 data that will be passed to the device.
- */
-
-static void prepare_cmd(char cmdtype, char micro) {
-  int n = 1;   // number of bytes to send
-  int cs= 0;   // checksum
-
-  /* Report number */
-  ctrl_cmd[0] = 0x01;
-  /* Most of the commands send only 1 byte so this is a good default */
-  ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n); 
-
-  switch (cmdtype) {
-  case EEPROM_USAGE:
-    ctrl_cmd[1] = CMD_EEPROM_USAGE; 
-    break;
-  case EEPROM_CLEAR:
-  case UPLOAD_CANCEL:
-  case UPLOAD_DONE:
-  case SW_TIMEOUT:
-  case EEPROM_TEST:
-  case RESTORE_BOND_OPTION:
-    /* Command 0x40 */
-    ctrl_cmd[1] = CMD_EEPROM_CLEAR;
-    break;
-  case DATA_UPLOAD:
-    ctrl_cmd[1] = CMD_DATA_UPLOAD;
-    break;
-  case SYNC_TIME:
-    /* Synchronize device's clock with PC (use localtime) */
-    ctrl_cmd[1] = CMD_SYNC_TIME;
-    n = 7;   // Send 7 bytes
-    {
-      struct tm *sys_time;
-      time_t tp;
-
-      tp = time(NULL);
-      sys_time = localtime(&tp);
-      
-      ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n);
-      ctrl_cmd[3] = (char) sys_time->tm_sec;
-      ctrl_cmd[4] = (char) sys_time->tm_min;
-      ctrl_cmd[5] = (char) sys_time->tm_hour;
-      ctrl_cmd[6] = (char) (sys_time->tm_mday - 1);
-      ctrl_cmd[7] = (char) sys_time->tm_mon;
-      ctrl_cmd[8] = (char) (sys_time->tm_year - 100);
-      cs = ctrl_cmd[3] + ctrl_cmd[4] + ctrl_cmd[5] 
-	+ ctrl_cmd[6] + ctrl_cmd[7] + ctrl_cmd[8] ;
-    }
-    break;
-  case FW_VERSION:
-    /* Default microcontroller is MAIN_MICRO */
-    ctrl_cmd[1] = (micro == USB_MICRO) ? 
-      CMD_FW_VERSION_USB_MICRO : CMD_FW_VERSION_MAIN_MICRO;
-    break;
-  case ROM_TEST:
-  case RAM_TEST:
-    ctrl_cmd[1] = (micro == USB_MICRO) ?
-      CMD_ROM_TEST_USB_MICRO : CMD_ROM_TEST_MAIN_MICRO;
-    break;
-  case READ_BOND_OPTION:
-    ctrl_cmd[1] = CMD_READ_BOND_OPTION;
-    break;
-  case MODIFY_BOND_OPTION:
-    /* Note that micro contains the data to pass to the device */
-    n = 2;                      // bytes to send
-    ctrl_cmd[1] = CMD_MODIFY_BOND_OPTION;
-    ctrl_cmd[2] = ENC_CMD_TYPE(cmdtype, n);
-    ctrl_cmd[3] = 3 + micro;    // first two bits must be set
-    cs += ctrl_cmd[3];
-    break;
-  case EEPROM_CAPACITY:
-    ctrl_cmd[1] = CMD_EEPROM_CAPACITY;
-    break;
-  case RAM_ROM_DEBUG:
-    ctrl_cmd[1] = CMD_RAM_ROM_DEBUG;
-    break;
-  default:
-    fatal("prepare_cmd: Unknown command type");
-    break;
-  }
-
-  /* Calculate the checksum */
-  cs += (int) ctrl_cmd[2];
-  ctrl_cmd[n+2] = ( ~cs + 1 ) % 256;
-
-  /* Fill up the rest of ctrl_cmd with zeros */
-  /* Not needed for functionality but convenient for debugging */
-  { 
-    int i;
-    for (i=n+3; i<TIMEXDR_CTRL_SIZE; i++) {
-      ctrl_cmd[i] = 0x0; 
-    }
-  }
-}
-
-/*
- * Sends a control message of cmdtype to the device's microcontroller micro.
- */
-static int timex_ctrl(usb_dev_handle *dev, char cmdtype, char micro,  
-		      unsigned char *buf, int bufsize) {
-  int ret;
-
-  /* Prepare the control message (output report) */
-  prepare_cmd(cmdtype, micro);
-
-  /* Send the report */
-  ret = usb_control_msg(dev, 
-			USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE, 
-			USB_REQ_SET_CONFIGURATION, 
-			0x201, 
-			0, 
-			ctrl_cmd, 
-			TIMEXDR_CTRL_SIZE, 
-			TIMEXDR_CTRL_TIMEOUT);
-  if (verbosity > 5) {
-    printf("Cmd sent:\t", ret,  
-	   (ret < 0) ? usb_strerror() : NULL);
-    if (ret > 0) {
-      {
-	int i;
-	
-	for (i=0; i<ret; i++) {
-	  printf("%02x ", ctrl_cmd[i] & 0xff);
-	}
-	printf("\n");
-      }
-    }
-  }
-
-  if (ret == TIMEXDR_CTRL_SIZE) {
-    if ((ret = timex_int_read(dev, buf, bufsize, TIMEXDR_CTRL_TIMEOUT)) != 7) {
-      fprintf(stderr, "Error: Expected response size 7 bytes, received %i.\n", 
-	      ret);
-      exit(EXIT_FAILURE);
-    }
-    check_response(cmdtype, buf);
   } else {
-    fprintf(stderr, "Error: Sent only %i of %i bytes.\n", ret, TIMEXDR_CTRL_SIZE);
-    exit(EXIT_FAILURE);
-  }
-
-  return ret;
-}
-
-/*
- * Get the firmware version of the device's main microcontroller and write it
- * into the global variable tdr_info
- */
-static void get_fw_version(usb_dev_handle *dev) {
-  unsigned char buf[RESPONSE_BUFSIZE];
-
-  if (timex_ctrl(dev, FW_VERSION, MAIN_MICRO, buf, RESPONSE_BUFSIZE)) {
-    tdr_info.fw_main = DEC_FW_VER(buf[3], buf[4], buf[5]);
-  }
-  if (timex_ctrl(dev, FW_VERSION, USB_MICRO, buf, RESPONSE_BUFSIZE)) {
-    tdr_info.fw_usb = DEC_FW_VER(buf[3], buf[4], buf[5]);
+    snprintf(job->dir, sizeof(job->dir), "recorder%d", n);
   }
 
-  if (verbosity) printf("Firmware version:\tMain:\t%li\n\t\t\tUSB:\t%li\n", 
-			tdr_info.fw_main, tdr_info.fw_usb);
-}
-
-/*
- * Get the EEPROM size and write it into the global variable tdr_info
- */
-static void get_eeprom_size(usb_dev_handle *dev) {
-  unsigned char buf[RESPONSE_BUFSIZE];
-
-  if (timex_ctrl(dev, EEPROM_CAPACITY, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE)) {
-    tdr_info.eeprom_size = (long int) (buf[3] + (buf[4] << 8) + 
-				       (buf[5] << 16)) + 1;
+  if ((mkdir(job->dir, 0777) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "%s: Can't create %s (%m).\n", tdr_progname, job->dir);
+    return -1;
   }
-
-  if (verbosity) printf("EEPROM size:\t%li bytes (%li kB)\n", 
-			tdr_info.eeprom_size, tdr_info.eeprom_size/1024);
-}
-
-/*
- * Set the initial time for session download. The parameter is number
- * of days before now. The initial time is (now - days) adjusted
- * down to the midnight.
- */
-static void set_initial_time(time_t days) {
-  struct tm btime;
-
-  initial_time = time(NULL) - days*86400;
-  localtime_r(&initial_time, &btime);
-  btime.tm_sec = 0;
-  btime.tm_min = 0;
-  btime.tm_hour = 0;
-  initial_time = mktime(&btime);
-}
-
-/*
- * Return 1 if the session time stamp is newer than initial_time
- */
-static int newer_session(const struct tdr_header *ses_time) {
-  struct tm btime;
-  time_t sys_time;
-
-  if (initial_time == 0) {
-    return 1;
-  }
-  sys_time = time(NULL);
-  localtime_r(&sys_time, &btime); 
-  btime.tm_sec = ses_time->sec;
-  btime.tm_min = ses_time->min;
-  btime.tm_hour = ses_time->hour;
-  btime.tm_mday = ses_time->day;
-  btime.tm_mon = ses_time->month - 1;
-  btime.tm_year = ses_time->year - 1900;
-  
-  return mktime(&btime) >= initial_time;
-}
-
-/*
- * Calculates number of pages of size "psize" for given number of bytes.
- */
-static unsigned long int num_of_pages(const unsigned long int bytes, 
-				      const int psize) {
-  return bytes / psize
-    + ( (bytes % psize) == 0 ? 0 : 1);
-}
-
-/* 
- * Find how many bytes are used in the TDR's EEPROM for data. Note that
- * the address of last byte as returned by the control command is NOT the
- * total number of bytes transferred because there is an extra byte 0x02 at the 
- * beginning of each 255 bytes of data.
- */
-static long int eeprom_usage(usb_dev_handle *dev) {
-  unsigned char buf[RESPONSE_BUFSIZE];
-  unsigned long int bytes;
-  int ret;
-
-  ret = timex_ctrl(dev, EEPROM_USAGE, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE);
-  bytes = DEC_EEPROM_USAGE(buf[2], buf[3], buf[4]);
-
-  if (verbosity) {
-    printf("EEPROM used:\t%lu bytes (%lu%% in use)\n", bytes, 
-	   (bytes + 1)*100/tdr_info.eeprom_size);
-  }
-
-  return bytes + num_of_pages(bytes, DATA_PAGESIZE);
+  return 0;
 }
 
 /*
- * Dumps the EEPROM to stdout.
+ * Worker thread of the multi-device mode.
  */
-static void print_eeprom(unsigned char *buf, unsigned long int bytes) {
-  unsigned long int i, pages;
-
-  pages = num_of_pages(bytes, EEPROM_PAGESIZE);
-
-  for (i=0; i < (pages*EEPROM_PAGESIZE); i++) {
-    if ((i>0) && ((i % EEPROM_PAGESIZE) == 0)) printf("\n");
-    if ((i % 16) == 0) printf("\n%08lx:\t", i);
-    if (i < bytes) {
-      printf("%02x ", buf[i] & 0xff);
-    } else {
-      printf("00 ");
-    }
-  }
-  printf("\n");
+static void *download_worker(void *arg) {
+  tdr_download((struct tdr_job *)arg);
+  return NULL;
 }
 
 /*
- * Removes transfer control/status bytes from the received EEPROM data.
- */
-static void squeeze_data(unsigned char *databuf, 
-			 unsigned long int *bytes) {
-  unsigned char *newbuf, *pnew, *pold;
-  unsigned long int newbytes, bleft = *bytes, i, pages;
-  
-  pages = num_of_pages(*bytes, EEPROM_PAGESIZE);
-  newbytes = *bytes - pages;
-
-  if (!(newbuf = malloc(newbytes))) {
+ * Downloads all attached recorders at once, each on its own thread. The
+ * session files of every recorder are written to a directory named after
+ * its serial number. The recorders are exported one after another once
+ * all downloads are complete, so that their EEPROM dumps and messages on
+ * stdout are not interleaved. Returns -1 if a recorder failed; the others
+ * are still exported.
+ */
+static int download_all(int choice, int full_eeprom_listing) {
+  struct tdr_job *jobs;
+  int i, n, ret = 0;
+
+  if (!(jobs = calloc(TDR_MAX_DEVICES, sizeof(*jobs)))) {
     fatal("Couldn't allocate memory");
   }
 
-  pnew = newbuf;
-  pold = databuf + 1;
-
-  for (i=0; i<pages; i++) {
-    memcpy(pnew, pold, (bleft > EEPROM_PAGESIZE) ? DATA_PAGESIZE : bleft - 1);
-    pnew = pnew + DATA_PAGESIZE;
-    pold = pold + EEPROM_PAGESIZE;
-    bleft = bleft - EEPROM_PAGESIZE;
+  /* libusb-0.1 is not thread safe: open everything up front */
+  if (!(jobs[0].dev = tdr_open(0, &jobs[0].info, &n, &opt))) {
+    exit(EXIT_FAILURE);
   }
-
-  databuf = (unsigned char *)realloc((void *)databuf, newbytes);
-  memcpy(databuf, newbuf, newbytes);
-
-  free(newbuf);
-
-  *bytes = newbytes;
-}
-
-/*
- * Splits the EEPROM data into sessions.
- */
-static struct tdr_session *split_data(unsigned char *databuf) {
-  struct tdr_session *first, *prev, *next;
-  unsigned long int pstart=TIMEXDR_FIRSTSESSION, pend;
-  struct tm stm;
-  time_t tmp;
-  int i;
-
-  first = NULL;
-  prev = NULL;
-
-  /* ***FIXME*** There can be possibly 128 sessions but we don't know the
-   * maximum EEPROM address (or size of the EEPROM memory). Until we figure 
-   * that out, allow only up to 127 sessions.
-   */
-
-  for (i=0; 
-       (i<(TIMEXDR_ATABLESIZE/TDR_ASIZE - 1)) && 
-	 ((pend = TDR_ADDRESS(databuf[TDR_ASIZE*(i+1)], 
-			      databuf[TDR_ASIZE*(i+1) + 1], 
-			      databuf[TDR_ASIZE*(i+1) + 2])) > 0); 
-       i++) {
-
-    next = malloc(sizeof(*next));
-    if (!next) {
-      fatal("Couldn't allocate memory");
-    }
-
-    if (prev) {
-      prev->next = next;
-    }
-    next->prev = prev;
-    next->next = NULL;
-    next->header.dev = databuf[pstart];
-    next->header.year = (unsigned int) TDR_YR(databuf[pstart+6]);
-    next->header.month = (unsigned int) TDR_MD(databuf[pstart+5]);
-    next->header.day = (unsigned int) TDR_MD(databuf[pstart+4]);
-    next->header.hour = (unsigned int) databuf[pstart+3];
-    next->header.min = (unsigned int) databuf[pstart+2];
-    next->header.sec = (unsigned int) databuf[pstart+1];
-    
-    /* Calculate start time of the session in time_t format */
-    stm.tm_year = next->header.year - 1900;
-    stm.tm_mon = next->header.month - 1;
-    stm.tm_mday = next->header.day;
-    stm.tm_hour = next->header.hour;
-    stm.tm_min = next->header.min;
-    stm.tm_sec = next->header.sec;
-    /* Negative means that we don't know if daylight saving time is in effect */
-    stm.tm_isdst = -1;
-
-    next->start = mktime(&stm);
-    
-    next->footer.dev = databuf[pend-7];
-    next->footer.year = (unsigned int) TDR_YR(databuf[pend-1]);
-    next->footer.month = (unsigned int) TDR_MD(databuf[pend-2]);
-    next->footer.day = (unsigned int) TDR_MD(databuf[pend-3]);
-    next->footer.hour = (unsigned int) databuf[pend-4];
-    next->footer.min = (unsigned int) databuf[pend-5];
-    next->footer.sec = (unsigned int) databuf[pend-6];
-
-    next->nbytes = pend - pstart - 14;
-
-    next->data = (unsigned char *)malloc(next->nbytes);
-    memcpy(next->data, databuf+pstart+7, next->nbytes); 
-    
-    pstart = pend;
-
-    if (i == 0) {
-      first = next;
+  for (i = 1; i < n; i++) {
+    if (!(jobs[i].dev = tdr_open(i, &jobs[i].info, NULL, &opt))) {
+      exit(EXIT_FAILURE);
     }
-    prev = next;
   }
 
-  return (i == 0) ? NULL : first;
-}
+  /* Drop (root) privileges to UID */
+  setuid(getuid());
 
-#define TIME_STR_LENGTH                    28      /* in bytes */
-static char time_str[TIME_STR_LENGTH];
+  if (opt.verbosity) printf("Downloading %d recorder(s)\n", n);
 
-/*
- * Converts seconds into a time string 
- * *str_time - output string
- * st - session start time
- * seconds - elapsed session time in seconds
- */
-static void time2str(char *str_time, const time_t st, double seconds) {
-  double tmp;
-  time_t tsec;
-  struct tm t;
-  long int fsec; 
-  char s1[TIME_STR_LENGTH], s2[TIME_STR_LENGTH];
-
-  tsec = st + seconds;
-  fsec = (long int)(modf(seconds, &tmp)*100);
-
-  /* Convert from time_t to tm structure */
-  localtime_r(&tsec, &t);
-  
-  /* Date and time */
-  if (strftime(s1, sizeof(s1), "%F %T", &t) == 0) {
-	  fatal("Time to string conversion error");
-  }
+  for (i = 0; i < n; i++) {
+    jobs[i].choice = choice;
+    if (job_dir(&jobs[i], i) < 0) exit(EXIT_FAILURE);
 
-  /* Time zone */
-  if (strftime(s2, sizeof(s2), "%z", &t) == 0) {
-	  fatal("Time to string conversion error");
+    if (pthread_create(&jobs[i].thread, NULL, download_worker, &jobs[i])) {
+      fatal("Couldn't start a download thread");
+    }
   }
 
-  /* Final assembly */
-  sprintf(str_time, "%s.%02ld%s", s1, fsec, s2);
-}
-
-/* 
- * Prints session header
- */
-static void session_header(char *sname, const struct tdr_header *hdr, 
-			   const struct tdr_header *ftr) {
-  
-  if (fprintf(sfp, "%s: %04u-%02u-%02u %02u:%02u:%02u - "
-	      "%04u-%02u-%02u %02u:%02u:%02u\n",
-	      sname, 
-	      hdr->year, hdr->month, hdr->day, hdr->hour, hdr->min, hdr->sec,
-	      ftr->year, ftr->month, ftr->day, ftr->hour, ftr->min, ftr->sec)
-      < 0) {
-    fatal("Error writing to a file");
+  for (i = 0; i < n; i++) {
+    pthread_join(jobs[i].thread, NULL);
   }
-}
 
-/*
- * Prints information about a packet error
- */
-static void packet_error(time_t st, double split_time, 
-			unsigned char token) {
-  
-  time2str(time_str, st, split_time);
-
-  switch (token) {
-  case MISSING_PACKET:
-    if (fprintf(sfp, "%s\tMissing packet.\n", time_str) < 0) {
-      fatal("Error writing to a file");
-    }
-    break;
-  case CORRUPTED_PACKET:
-    if (fprintf(sfp, "%s\tCorrupted packet.\n", time_str) < 0) {
-      fatal("Error writing to a file");
+  for (i = 0; i < n; i++) {
+    if ((choice == 'e') || opt.verbosity) {
+      printf("Recorder %s:\n", jobs[i].dir);
     }
-    break;
-  default:
-    fatal("Unknown packet error");
-    break;
+    if (tdr_export(&jobs[i], full_eeprom_listing) < 0) ret = -1;
+    if (tdr_close(jobs[i].dev) < 0) ret = -1;
   }
 
+  free(jobs);
+  return ret;
 }
 
-/*
- * Open output file for a session
- */
-static void open_session_file(char *sname, 
-			      const struct tdr_header *hdr, 
-			      const struct tdr_header *ftr) {
-  char s[TIMEXDR_STRLEN];
-
-  if (write_session_to_file) {
-    sprintf(s, "%04u%02u%02u_%02u%02u%02u-%02u%02u%02u.%s",   
-	    hdr->year, hdr->month, hdr->day, hdr->hour, hdr->min, hdr->sec,
-	    ftr->hour, ftr->min, ftr->sec, sname);
-  
-    if (verbosity) printf("File name: %s\tSession: %s\n", s,sname);
+#if TDR_LIBUSB1
+static int hotplug_daemon = 0;      /* Stay resident, serve attached recorders */
+static volatile sig_atomic_t daemon_stop = 0;
 
-    if ((sfp = fopen(s, "w")) == NULL) {
-      fprintf(stderr, "%s: Can't open session file %s (%m).\n", progname, s);
-      exit(EXIT_FAILURE);
-    } 
-  } else {
-    sfp = stdout;
-  }
-}
+/* Recorders attached but not served yet */
+static libusb_device *attached[TDR_MAX_DEVICES];
+static int nattached = 0;
 
 /*
- * Close the output session file
+ * Stops the hotplug daemon after the current job.
  */
-static void close_session_file(void) {
-  if (write_session_to_file) fclose(sfp);
+static void daemon_signal(int sig) {
+  daemon_stop = 1;
 }
 
 /*
- * Prints HRM session data to stdout/file.
+ * Hotplug callback: remembers a newly attached recorder. No I/O may be
+ * done here, the job runs from the daemon loop.
  */
-static void hr_session(const struct tdr_session *ses) {
-  unsigned long int i;
+static int LIBUSB_CALL hotplug_attach(libusb_context *ctx, libusb_device *dev,
+				      libusb_hotplug_event event, void *arg) {
+  struct libusb_device_descriptor desc;
 
-  open_session_file(HRM_FILE_EXT, &(ses->header), &(ses->footer));
-
-  session_header("HRM session", &(ses->header), &(ses->footer));
-  if (fprintf(sfp, "             Time             HR[bpm]\n") < 0) {
-    fatal("Error writing to a file");
+  if ((libusb_get_device_descriptor(dev, &desc) == 0) && 
+      IS_TIMEXDR(desc.idVendor, desc.idProduct) && 
+      (nattached < TDR_MAX_DEVICES)) {
+    attached[nattached++] = libusb_ref_device(dev);
   }
 
-  for (i=0; i < ses->nbytes; i++) {
-    switch (ses->data[i]) {
-    case MISSING_PACKET:
-    case CORRUPTED_PACKET:
-      packet_error(ses->start, i * TIME_STEP_HRM, ses->data[i]);
-      break;
-    default:
-      time2str(time_str, ses->start, i * TIME_STEP_HRM);
-      if (fprintf(sfp, "%s\t%3u\n", time_str, ses->data[i]) < 0) {
-	fatal("Error writing to a file");
-      }
-      break;
-    }
-  }
-
-  close_session_file();
-}
-
-/*
- * Convert distance units
- */
-static double unit_conv(const double dist) {
-  return (dist_units == 0) ? dist : MILES_TO_KM(dist); 
+  return 0;
 }
 
 /*
- * Adjust the distance for odometer quirks
- */
-static void dist_corrections(double *dist){
-  
-  /* First add any rollovers */
-  *dist += dist_base;
+ * Serves one attached recorder: sets its clock, downloads and exports
+ * the sessions and clears the EEPROM as requested, all within a single
+ * claimed session. A failed recorder is reported and released; the
+ * daemon goes on serving the others.
+ */
+static void daemon_job(libusb_context *ctx, libusb_device *usbdev, 
+		       int choice, int full_eeprom_listing) {
+  struct tdr_job *job;
+  int ret;
 
-  if (dist_offset < 0) {
-    dist_offset = *dist;
+  if (!(job = calloc(1, sizeof(*job)))) {
+    fprintf(stderr, "%s: Couldn't allocate memory (%m).\n", tdr_progname);
+    return;
   }
 
-  /* Remove session offset */
-  *dist -= dist_offset;
-
-  /* Check for a rollover: We assume that the distance can fall back
-   * by more than 0.5 * ODO_MAX only when a rollover occured.
-   */
-  if ((dist_prev - *dist) > (ODO_MAX * 0.5)) {
-    *dist += ODO_MAX;
-    dist_base += ODO_MAX;
-  }
-  
-  /* Don't allow a decrease in distance. Such decrease can happen when
-   * the GPS suddenly stops because it normally anticipates where its 
-   * location will be at the time of packet transmission. After a sudden
-   * stop, it may need to correct, i.e. decrease, the distance. */
-  if (*dist < dist_prev) {
-    *dist = dist_prev;
-  } else {
-    dist_prev = *dist;
+  if (!(job->dev = tdr_attach(ctx, usbdev, &job->info, &opt))) {
+    fprintf(stderr, "%s: Recorder at address %d skipped.\n", tdr_progname,
+	    libusb_get_device_address(usbdev));
+    free(job);
+    return;
   }
-}
+  job->choice = choice;
 
-/*
- * Decodes and prints GPS packet type 1 (Status, Speed and Distance)
- */
-static void gps_packet_1(time_t st, double *split_time, 
-                         unsigned char status_byte, 
-			 unsigned char hsb, unsigned char lsb_speed, 
-			 unsigned char lsb_odo) {
-  
-  unsigned char status, acq, battery;
-  double speed, dist; 
-
-  if (dist_offset < 0) {
-    switch (dist_units) {
-    case 0:          /* Imperial units: miles */
-      if (fprintf(sfp, "             Time\t\tStatus\tACQ\tBAT\tV [mph]\tD [miles]\n")
-	  < 0) {
-	fatal("Error writing to a file");
-      }
-      break;
-    case 1:          /* SI units: kilometers */
-    default:
-      if (fprintf(sfp, "             Time\t\tStatus\tACQ\tBAT\tV [kph]\t   D [km]\n")
-	  < 0) {
-	fatal("Error writing to a file");
-      }
-      break;
-    }
-  }
+  ret = job_dir(job, libusb_get_device_address(usbdev));
+  printf("Recorder %s attached\n", job->dir);
 
-  status = ( status_byte & 0xf0 ) >> 4;
-  acq = ( status_byte & 0x0c) >> 2;
-  battery = ( status_byte & 0x03 );
-  speed = (double)((long int) lsb_speed + 
-		   ( ((long int) (hsb & 0xf0)) << 4 )) * SPEED_UNIT;
-  dist = (double)((long int) lsb_odo +
-		  ( ((long int) (hsb & 0x0f)) << 8 )) * DIST_UNIT;
-  dist_corrections(&dist);
-
-  time2str(time_str, st, *split_time);
-  if (fprintf(sfp, "%s\t%u\t%u\t%u\t%5.1f\t%9.3f\n", 
-	      time_str, status, acq, battery, 
-	      unit_conv(speed), unit_conv(dist)) < 0) {
-    fatal("Error writing to a file");
+  if (ret < 0) {
+    tdr_job_failed(job);
+  } else if ((choice == 'a') || (choice == 'd') || (choice == 'e')) {
+    if (tdr_download(job) < 0) ret = -1;
+    if (tdr_export(job, full_eeprom_listing) < 0) ret = -1;
+  } else if (opt.time_sync) {
+    ret = tdr_sync_time(job->dev);
   }
 
-  *split_time += TIME_STEP_GPS;
-}
-
-/*
- * Decodes and prints GPS packet type 4 (Time and Date)
- */
-static void gps_packet_4(time_t st, double *split_time, unsigned char mo_yr, 
-			 unsigned char mi_da, unsigned char da_hr, 
-			 unsigned char bsec) {
-  int year, month, day, hour, min;
-  float sec;
-
-  /* Note: Year in GPS time packets is 2001 based in contrary to the
-   * 2000 year base in headers/footers of sessions. The time is GMT.
-   */
-
-  year  = (int)(mo_yr & 0x0f) + 2001;
-  month = (int)(mo_yr & 0xf0) >> 4;
-  day   = ((int)(mi_da & 0x03) << 3) + ((int)(da_hr & 0xe0) >> 5);
-  hour  = (int)(da_hr & 0x1f);
-  min   = (int)(mi_da & 0xfc) >> 2;
-  sec   = (float)((int)(bsec & 0xfc) >> 2) + (float)((int)(bsec & 0x03))*0.25;
-  
-  time2str(time_str, st, *split_time);
-  if (fprintf(sfp, "%s\t%i-%02i-%02i %2i:%02i:%05.2f GMT\n", time_str, 
-	      year, month, day, hour, min, sec) < 0) {
-    fatal("Error writing to a file");
+  if (tdr_close(job->dev) < 0) ret = -1;
+  if (ret < 0) {
+    fprintf(stderr, "%s: Recorder %s failed.\n", tdr_progname, job->dir);
+  } else {
+    printf("Recorder %s done\n", job->dir);
   }
+  fflush(stdout);
 
-  *split_time += TIME_STEP_GPS;
+  free(job);
 }
 
 /*
- * Decodes and prints GPS packe type 15 (Full position data)
- * Input: split_time keeps track of the time, ses is the TDR session structure 
- * with data, bzero is the index of the zero byte of the packet in 
- * ses->data[].
- */
-static void gps_packet_15(time_t st, double *split_time, 
-		          const struct tdr_session *ses,
-			  unsigned long int bzero) {
-  unsigned char status, acq, battery;
-  /* htrue - true heading
-     hmag - magnetic heading */
-  long int htrue, hmag;
-  double speed, dist, alt, lat, lon, sec;
-
-  if (dist_offset < 0) {
-    switch (dist_units) {
-    case 0:          /* Imperial units: miles */
-      if (fprintf(sfp, "             Time\t\tStatus\tACQ\tBAT\tV [mph]\tD [miles]\tAlt[ft]\tHt\tHm\tLatitude [deg]\tLongitude [deg]\tsec\n")
-	  < 0) {
-	fatal("Error writing to a file");
-      }
-      break;
-    case 1:          /* SI units: kilometers */
-    default:
-      if (fprintf(sfp, "             Time\t\tStatus\tACQ\tBAT\tV [kph]\t   D [km]\tAlt [m]\tHt\tHm\tLatitude [deg]\tLongitude [deg]\tsec\n")
-	  < 0) {
-	fatal("Error writing to a file");
-      }
-      break;
-    }
-  }
+ * Stays resident and serves every recorder as soon as it is attached.
+ * Recorders already attached at startup are served first. Runs until
+ * SIGINT or SIGTERM.
+ */
+static void run_daemon(int choice, int full_eeprom_listing) {
+  libusb_context *ctx;
+  libusb_hotplug_callback_handle hotplug;
+  libusb_device *usbdev;
+  struct timeval tv;
+  int i;
 
-  status = ( ses->data[bzero+2] & 0xf0 ) >> 4;
-  acq = ( ses->data[bzero+2] & 0x0c) >> 2;
-  battery = ( ses->data[bzero+2] & 0x03 );
-  speed = (double)((long int) ses->data[bzero+4] + 
-		   ( ((long int) (ses->data[bzero+3] & 0xf0)) << 4 )
-		   ) * SPEED_UNIT;
-  dist = (double)((long int) ses->data[bzero+5] +
-		  ( ((long int) (ses->data[bzero+3] & 0x0f)) << 8 )
-		  ) * DIST_UNIT;
-  dist_corrections(&dist);
-  alt = (double)((long int) ses->data[bzero+7] +
-		 ((long int) ses->data[bzero+6] << 8 ) -
-		 ALT_OFFSET) * ALT_UNIT;
-  alt = (dist_units == 0) ? alt : FT_TO_M(alt); 
-  htrue = ((long int) ses->data[bzero+8]) * HEADING_UNIT;
-  hmag = ((long int) ses->data[bzero+9]) * HEADING_UNIT;
-  lat = (double)((long int) ses->data[bzero+12] +
-		 ((long int) ses->data[bzero+11] << 8 ) +
-		 ((long int) ses->data[bzero+10] << 16 ) ) * LL_UNIT_DEG;
-  lon = (double)((long int) ses->data[bzero+15] +
-		 ((long int) ses->data[bzero+14] << 8 ) +
-		 ((long int) ses->data[bzero+13] << 16 ) ) * LL_UNIT_DEG;
-  lon = ( lon < 180 ) ? lon : lon - 360 ; /* Westerly long. is negative */
-  sec   = (double)((int)(ses->data[bzero+16] & 0xfc) >> 2) + 
-    (double)((int)(ses->data[bzero+16] & 0x03))*0.25;
-
-  time2str(time_str, st, *split_time);
-  if (fprintf(sfp, "%s\t%u\t%u\t%u\t%5.1f\t%9.3f\t%7.1f\t%4ld\t%4ld\t%14.9f\t%15.9f\t%5.2f\n", 
-	      time_str, status, acq, battery, 
-	      unit_conv(speed), unit_conv(dist),
-	      alt, htrue, hmag, lat, lon, sec) < 0) {
-    fatal("Error writing to a file");
+  if (libusb_init(&ctx) < 0) {
+    fatal("Couldn't initialize libusb");
   }
-
-  *split_time += TIME_STEP_GPS;
-}
-
-/*
- * Prints GPS session data to stdout. 
- */
-static void gps_session(const struct tdr_session *ses) { 
-  unsigned long int i, psize, bytes = ses->nbytes;
-  double split_time = 0.0;
-  
-  if ( ses->nbytes < GPS_PACKET_MIN_LENGTH ) {
-    fprintf(stderr, "Skipping GPS session: Packet too short.");
-    return;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    errno = 0;
+    fatal("Hotplug is not supported on this system");
   }
 
-  dist_offset = -1;
-  dist_prev = -1;
-  dist_base = 0;
-
-  open_session_file(GPS_FILE_EXT, &(ses->header), &(ses->footer));
-
-  session_header("GPS session", &(ses->header), &(ses->footer));
- 
-  for (i=0; (i < bytes) && 
-	 (psize = ((ses->data[i] == PACKET_TYPE_15) ?
-		   PACKET_TYPE_15_LENGTH :
-		   ses->data[i] & PACKET_LENGTH_MASK)) <= (bytes - i); 
-       i += psize) {
-    
-    switch (ses->data[i]) {
-    case PACKET_TYPE_ERROR:
-      packet_error(ses->start, split_time, ses->data[i+1]);
-      split_time += TIME_STEP_GPS;
-      break;
-    case PACKET_TYPE_1:
-      gps_packet_1(ses->start, &split_time, ses->data[i+1], ses->data[i+2], 
-		   ses->data[i+3], ses->data[i+4]);
-      break;
-    case PACKET_TYPE_4:
-      gps_packet_4(ses->start, &split_time, ses->data[i+1], ses->data[i+2], 
-		   ses->data[i+3], ses->data[i+4]);
-      break;  
-    case PACKET_TYPE_15:
-      gps_packet_15(ses->start, &split_time, ses, i);
-      break;
-    case PACKET_TYPE_2:
-    case PACKET_TYPE_3:
-    case PACKET_TYPE_5:
-    default:
-      fprintf(stderr, "Packet type: %02x\n", ses->data[i]);
-      fatal("This GPS packet handling is not implemented yet");
-      break;
-    }
+  if (libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+				       LIBUSB_HOTPLUG_ENUMERATE, 
+				       TIMEXDR_VENDOR_ID, 
+				       LIBUSB_HOTPLUG_MATCH_ANY, 
+				       LIBUSB_HOTPLUG_MATCH_ANY, 
+				       hotplug_attach, NULL, &hotplug) < 0) {
+    fatal("Couldn't register the hotplug callback");
   }
 
-  close_session_file();
-  
-}
-
-/*
- * Process and print a multi-device session. First split the multi-device
- * session into HRM and GPS sessins.
- */
-static void multi_session(const struct tdr_session *session) {
-  struct tdr_session *hrm_ses, *gps_ses;
-  unsigned long int i=0, j, plen;
-
-  hrm_ses = malloc(sizeof(*hrm_ses));
-  gps_ses = malloc(sizeof(*gps_ses));
-
-  hrm_ses->start = (gps_ses->start = session->start);
-
-  hrm_ses->prev = (hrm_ses->next = NULL);
-  gps_ses->prev = (gps_ses->next = NULL);
-
-  hrm_ses->header = (gps_ses->header = session->header);
-  hrm_ses->footer = (gps_ses->footer = session->footer);
-  hrm_ses->header.dev = (hrm_ses->footer.dev = HRM_SESSION);
-  gps_ses->header.dev = (gps_ses->footer.dev = GPS_SESSION);
-  
-  hrm_ses->nbytes = (gps_ses->nbytes = 0);
-  
-  hrm_ses->data = malloc(session->nbytes);
-  gps_ses->data = malloc(session->nbytes);
-  
-  
-  while (1) {
-    switch (session->data[i] & SESSION_MASK) {
-
-    case HRM_SESSION:
-      hrm_ses->data[hrm_ses->nbytes++] = session->data[i+1];
-      i += 2;
-      break;
+  signal(SIGINT, daemon_signal);
+  signal(SIGTERM, daemon_signal);
 
-    case GPS_SESSION:
-      if (session->data[i+1] == PACKET_TYPE_15) {
-	plen = PACKET_TYPE_15_LENGTH;
-      } else {
-	plen = session->data[i+1] & PACKET_LENGTH_MASK;
-      }
-      for (j=0; j<plen; j++) {
-	gps_ses->data[gps_ses->nbytes + j] = session->data[i+1+j];
-      }
-      gps_ses->nbytes += plen;
-      i += plen + 1;
-      break;
+  /* Drop (root) privileges to UID */
+  setuid(getuid());
 
-    default:
-      fatal("Unknown device in multi-device session");
-      break;
-    }
-    
-    if (i >= session->nbytes ) break;
-  }
+  /* Every recorder writes its sessions into its own directory */
+  all_devices = 1;
+  opt.files = 1;
+  opt.stream = 0;
+  if (opt.async_transfers < 1) opt.async_transfers = 1;
 
-  print_session(hrm_ses);
-  print_session(gps_ses);
+  if (opt.verbosity) printf("Waiting for recorders\n");
 
-  free(hrm_ses->data);
-  free(hrm_ses);
-  free(gps_ses->data);
-  free(gps_ses);
-}
+  while (!daemon_stop) {
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    libusb_handle_events_timeout_completed(ctx, &tv, NULL);
 
+    while ((nattached > 0) && !daemon_stop) {
+      usbdev = attached[0];
+      for (i = 1; i < nattached; i++) attached[i - 1] = attached[i];
+      nattached--;
 
-/*
- * Prints session data.
- */
-static void print_session(const struct tdr_session *session) {
-  const struct tdr_session *ses;
-
-  for (ses = session; ses;  ses = ses->next) {
- 
-    if (newer_session(&ses->header)) {
-      switch (ses->header.dev & SESSION_MASK) {
-      case HRM_SESSION:
-	hr_session(ses);
-	break;
-      case GPS_SESSION:
-	gps_session(ses);
-	break;
-      case MULTI_DEVICE_SESSION & SESSION_MASK:
-	multi_session(ses);
-	break;
-      default:
-	errno = 0;
-	fatal("Unknown session");
-	break;
-      }
+      daemon_job(ctx, usbdev, choice, full_eeprom_listing);
+      libusb_unref_device(usbdev);
     }
-    
   }
-}
-
-/* 
- * Releases the interface and closes the device.
- */
-static void timexdr_close(usb_dev_handle *dev) {
-  int ret;
-  unsigned char buf[RESPONSE_BUFSIZE];
 
-  if (clear_eeprom) {
-    if (verbosity) printf("Deleting all data stored in EEPROM\n");
-    ret = timex_ctrl(dev, EEPROM_CLEAR, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE);
-    clear_eeprom = 0;
-  }
-
-  if ( (ret = usb_release_interface(dev, 0)) < 0 ) {
-    fatal("Couldn't release device");
-  }
-  if (verbosity > 5) printf("Release interface status: %d\n", ret);
-
-  usb_close(dev);
+  libusb_hotplug_deregister_callback(ctx, hotplug);
+  while (nattached > 0) libusb_unref_device(attached[--nattached]);
+  libusb_exit(ctx);
 }
+#endif
 
 /* -------------------------------------------------------------------------
  *   Main program.
@@ -1126,36 +394,50 @@ static void timexdr_close(usb_dev_handle *dev) {
  */
 int main(int argc, char *argv[])
 {
-  struct usb_dev_handle *dev;
-  int i, full_eeprom_listing=0;
-  unsigned long int bytes, bufsize, timeout;
-  unsigned char buf[RESPONSE_BUFSIZE], *databuf;
-  char c, choice='h';                   /* Default choice='h' */
-  struct tdr_session  *session;
+  struct tdr_dev *dev;
+  struct tdr_job job;
+  int full_eeprom_listing=0;
+  int c, status = EXIT_SUCCESS;
+  char choice='h';                      /* Default choice='h' */
   static struct option long_options[] = {
     {"all-sessions", 0, NULL, 'a'},
+    {"binary", 0, NULL, 'b'},
+    {"capture", 1, NULL, 'C'},
     {"clear-eeprom", 0, NULL, 'c'},
+    {"daemon", 0, NULL, 'D'},
     {"days", 2, NULL, 'd'},             /* Takes an optional argument */
     {"eeprom-dump", 2, NULL, 'e'},
     {"file", 0, NULL, 'f'},
+    {"fields", 1, NULL, 'L'},
+    {"format", 1, NULL, 'F'},
     {"help",  0, NULL, 'h'},
     {"info",  0, NULL, 'i'},
+    {"jobs", 2, NULL, 'j'},             /* Takes an optional argument */
+    {"all-recorders", 0, NULL, 'M'},
     {"miles", 0, NULL, 'm'},
+    {"replay", 1, NULL, 'R'},
+    {"new-sessions", 0, NULL, 'n'},
+    {"output", 1, NULL, 'o'},
+    {"simulate", 1, NULL, 'S'},
+    {"stream", 0, NULL, 's'},
     {"time-sync", 0, NULL, 't'},
+    {"transfers", 1, NULL, 'x'},
     {"verbose", 2, NULL, 'v'},          /* Takes an optional argument */
     {"version", 0, NULL, 'V'},
+    {"compress", 1, NULL, 'z'},
     {NULL, 0, NULL, 0}
   };
 
+  tdr_options_init(&opt);
+
 #ifdef TDR_DEBUG
-  verbosity = 10;
+  opt.verbosity = 10;
 #endif
   
-  progname = argv[0];
-  //  sfp = stdout;
+  tdr_progname = argv[0];
 
   while (1) {
-    c = getopt_long(argc, argv, "acd::e::fhimtv::V",
+    c = getopt_long(argc, argv, "abC:cd::De::fF:hij::L:mMno:R:sS:tv::Vx:z:",
 		    long_options, NULL);
 
     if (c == -1) {
@@ -1168,6 +450,20 @@ int main(int argc, char *argv[])
       choice = c;
       break;
 
+    case 'b':
+      opt.sink = &tdr_binary_sink;
+      opt.files = 1;
+      break;
+
+    case 'D':
+#if TDR_LIBUSB1
+      hotplug_daemon = 1;
+#else
+      errno = 0;
+      fatal("The daemon mode needs libusb-1.0");
+#endif
+      break;
+
     case 'e':
       if (optarg) {
 	if (strcmp(optarg, "full") == 0) full_eeprom_listing = 1;
@@ -1175,41 +471,81 @@ int main(int argc, char *argv[])
       choice = c;
       break;
 
+    case 'C':
+      capture_file = optarg;
+      break;
+
     case 'c':
-      clear_eeprom = 1;
+      opt.clear_eeprom = 1;
       if (choice == 'h') choice = '\0';
       break;
     
     case 'd':
       if (optarg) {
-	set_initial_time(atol(optarg));
+	tdr_set_days(&opt, atol(optarg));
       } else {
-	set_initial_time(0);
+	tdr_set_days(&opt, 0);
       }
       choice = c;
       break;
 
     case 'f':
-      write_session_to_file = 1;
+      opt.files = 1;
       if (choice == 'f') choice = '\0';
       break;
 
+    case 'F':
+      if (!(opt.sink = tdr_sink_find(optarg))) timexdr_usage(argv[0]);
+      if ((opt.sink == &tdr_binary_sink) || (opt.sink == &tdr_packed_sink)) {
+	opt.files = 1;
+      }
+      break;
+
+    case 'L':
+      if (tdr_set_fields(optarg) < 0) timexdr_usage(argv[0]);
+      break;
+
     case 'm':
-      dist_units = 0;
+      opt.units = 0;
+      break;
+
+    case 'M':
+      all_devices = 1;
+      break;
+
+    case 'n':
+      opt.sync = 1;
+      break;
+
+    case 'o':
+      if (tdr_output_add(&opt, optarg) < 0) {
+	if (errno == EINVAL) timexdr_usage(argv[0]);
+	exit(EXIT_FAILURE);
+      }
+      break;
+
+    case 'R':
+      opt.replay_file = optarg;
+      break;
+
+    case 's':
+      opt.stream = 1;
+      break;
+
+    case 'S':
+      opt.simulate = optarg;
       break;
 
     case 't':
-      dev = timexdr_open();
-      i = timex_ctrl(dev, SYNC_TIME, 0, buf, RESPONSE_BUFSIZE);
-      timexdr_close(dev);
+      opt.time_sync = 1;
       if (choice == 'h') choice = '\0';
       break;
 
     case 'v':
       if (optarg) {
-	verbosity = atol(optarg);
+	opt.verbosity = atol(optarg);
       } else {
-	verbosity = 1;
+	opt.verbosity = 1;
       }
       if (choice == 'v') choice = '\0';
       break;
@@ -1217,6 +553,23 @@ int main(int argc, char *argv[])
     case 'V':
       timexdr_version();
       break;
+
+    case 'j':
+      opt.jobs = optarg ? atol(optarg) : sysconf(_SC_NPROCESSORS_ONLN);
+      if (opt.jobs < 1) timexdr_usage(argv[0]);
+      if (opt.jobs > TDR_MAX_WORKERS) opt.jobs = TDR_MAX_WORKERS;
+      break;
+
+    case 'x':
+      opt.async_transfers = atol(optarg);
+      if (opt.async_transfers < 0) timexdr_usage(argv[0]);
+      break;
+
+    case 'z':
+      if ((opt.compress = tdr_compress_find(optarg)) < 0) {
+	timexdr_usage(argv[0]);
+      }
+      break;
    
     case 'h':
     default:
@@ -1225,87 +578,57 @@ int main(int argc, char *argv[])
     }
   }
 
-  if (((verbosity) && (choice != 'h')) || (choice == 'i')) {
+  if (((opt.verbosity) && (choice != 'h')) || (choice == 'i')) {
     printf("Timex Data Recorder control program version " VERSION "\n");
     printf("Report bugs to <"PACKAGE_BUGREPORT">\n\n");
   }
 
+  if (capture_file && (tdr_capture_open(capture_file) < 0)) {
+    exit(EXIT_FAILURE);
+  }
+  if (opt.replay_file) atexit(replay_report);
+
+#if TDR_LIBUSB1
+  if (hotplug_daemon && (opt.simulate || opt.replay_file)) {
+    errno = 0;
+    fatal("The daemon mode needs a real recorder");
+  }
+  if (hotplug_daemon) {
+    if (choice == 'h') timexdr_usage(argv[0]);
+    run_daemon(choice, full_eeprom_listing);
+    return (tdr_outputs_close() < 0) ? EXIT_FAILURE : 0;
+  }
+#endif
+
   switch (choice) {
 
   case 'i':            /* Display device info */
-    if (!verbosity) verbosity = 1;
-    dev = timexdr_open();
-    get_fw_version(dev);
-    get_eeprom_size(dev);
-    bytes = eeprom_usage(dev);
-    timexdr_close(dev);
+    if (!opt.verbosity) opt.verbosity = 1;
+    dev = timexdr_open(&tdr_info);
+    if ((opt.time_sync && (tdr_sync_time(dev) < 0)) || 
+	(tdr_read_info(dev) < 0)) {
+      status = EXIT_FAILURE;
+    }
+    if (tdr_close(dev) < 0) status = EXIT_FAILURE;
     break;
   case 'a':
   case 'd':
   case 'e':
-    dev = timexdr_open();
-
-    get_fw_version(dev);
-    get_eeprom_size(dev);
-
-    bytes = eeprom_usage(dev);
-
-    if (verbosity >= 3) {
-      printf("Expecting a transfer of %lu (0x%lx) bytes in %lu packets\n", 
-	     bytes, bytes, num_of_pages(bytes, EEPROM_PAGESIZE));
-    }
-
-    i = timex_ctrl(dev, DATA_UPLOAD, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE);
-
-    if ((bytes == (TIMEXDR_ATABLESIZE + num_of_pages(bytes, EEPROM_PAGESIZE))) && 
-	timex_ctrl(dev, UPLOAD_CANCEL, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE)) {
-      fprintf(stderr, "EEPROM empty.\n");
-      timexdr_close(dev);
-      exit(EXIT_SUCCESS);
-    }
-
-    bufsize = EEPROM_PAGESIZE * num_of_pages(bytes, EEPROM_PAGESIZE); 
-    databuf = (unsigned char *)calloc(bufsize, sizeof(unsigned char));
-    if (databuf == 0) fatal("databuf not initialized");
-   
-    /* The timeout may be unnecessary long but that is better than too short.
-     * This way we make sure that all data get tranferred.
-     */
-    timeout = (bytes / 2048 + 1) * 10 * TIMEXDR_CTRL_TIMEOUT;
-
-    if (verbosity > 3) printf("Data download will take up to %lu seconds\n", 
-			      timeout/1000);
-
-    /* Read the data from the recorder */
-    {
-      time_t t0, t1;
-
-      t0 = time(NULL);
-      i = timex_int_read(dev, databuf, bufsize, timeout);
-      t1 = time(NULL);
-      
-      if (verbosity) printf("Data transfer time was %lu seconds\n", t1-t0);
-    }
-    
-    i = timex_ctrl(dev, UPLOAD_DONE, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE);
-
-    /* Format the output as specified by the command line options */
-    switch (choice) {
-    case 'e': 
-      if (full_eeprom_listing == 0) squeeze_data(databuf, &bytes);
-      print_eeprom(databuf, bytes);
-      break;
-    case 'a':
-    case 'd':
-      squeeze_data(databuf, &bytes);
-      session = split_data(databuf);
-      print_session(session);
-      break;
-    default:
+    if (all_devices) {
+      if (choice != 'e') opt.files = 1;
+      opt.stream = 0;
+      if (download_all(choice, full_eeprom_listing) < 0) {
+	status = EXIT_FAILURE;
+      }
       break;
     }
 
-    timexdr_close(dev);
+    memset(&job, 0, sizeof(job));
+    job.dev = timexdr_open(&job.info);
+    job.choice = choice;
+    if (tdr_download(&job) < 0) status = EXIT_FAILURE;
+    if (tdr_export(&job, full_eeprom_listing) < 0) status = EXIT_FAILURE;
+    if (tdr_close(job.dev) < 0) status = EXIT_FAILURE;
     break;
 
   case 'h':
@@ -1316,16 +639,18 @@ int main(int argc, char *argv[])
     break;
   }
 
-  /* If the -c option was the only task requested, we need to open the device
-   * and clear the EEPROM. If other tasks were requested (like -a, -d, or -e),
-   * the memory would have been already cleaned (if -c was also specified)
+  /* If the -t or -c options were the only tasks requested, we need to open
+   * the device to set the clock and clear the EEPROM. If other tasks were
+   * requested (like -a, -d, or -e), the clock would have been already set and
+   * the memory cleaned in the same device session.
    */
-  if (clear_eeprom) {
-    dev = timexdr_open();
-    //    i = timex_ctrl(dev, EEPROM_CLEAR, DEFAULT_MICRO, buf, RESPONSE_BUFSIZE);
-    timexdr_close(dev);
+  if ((choice == '\0') && (opt.time_sync || opt.clear_eeprom)) {
+    dev = timexdr_open(&tdr_info);
+    if (opt.time_sync && (tdr_sync_time(dev) < 0)) status = EXIT_FAILURE;
+    if (tdr_close(dev) < 0) status = EXIT_FAILURE;
   }
 
-  return 0;
+  if (tdr_outputs_close() < 0) status = EXIT_FAILURE;
+  return status;
 }
 
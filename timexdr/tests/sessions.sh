@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Downloads the sessions of the simulated recorder holding sample.eep and
+# compares the output with the expected text. The image holds an HRM
+# session across the start of daylight saving time, a GPS session and a
+# multi-device session; the first read of page 3 times out so that every
+# download has to restart.
+#
+
+srcdir=`cd "${srcdir:-.}" && pwd`
+timexdr=`pwd`/../src/timexdr
+tdb2txt=`pwd`/../src/tdb2txt
+image="$srcdir/sample.eep"
+expected="$srcdir/expected"
+
+TZ=America/New_York
+LC_ALL=C
+export TZ LC_ALL
+
+tmp=`mktemp -d ${TMPDIR:-/tmp}/timexdr.XXXXXX` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+status=0
+
+# check NAME: compares $tmp/NAME with the expected text
+check() {
+  if cmp -s "$tmp/$1" "$expected/$1"; then
+    echo "PASS: $1 $2"
+  else
+    echo "FAIL: $1 $2"
+    diff "$expected/$1" "$tmp/$1" | head -20
+    status=1
+  fi
+}
+
+for opts in "" "-j" "-j3" "-s" "-s -j2"; do
+  $timexdr -S "$image,0,0,3" -a $opts > "$tmp/sessions.txt" 2> /dev/null ||
+    status=1
+  check sessions.txt "($opts)"
+done
+
+$timexdr -S "$image,0,0,3" -a -m > "$tmp/sessions-miles.txt" 2> /dev/null ||
+  status=1
+check sessions-miles.txt "(-m)"
+
+$timexdr -S "$image" -a -F csv > "$tmp/sessions.csv" || status=1
+check sessions.csv "(-F csv)"
+
+mkdir "$tmp/packed"
+(cd "$tmp/packed" && $timexdr -S "$image" -a -F packed > /dev/null) ||
+  status=1
+$tdb2txt "$tmp/packed"/*.tdp > "$tmp/packed.txt" || status=1
+check packed.txt "(-F packed)"
+
+exit $status